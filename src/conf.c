@@ -20,7 +20,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <arpa/inet.h>
 #include "log.h"
 #include "csv.h"
 #include "filters.h"
@@ -28,14 +30,29 @@
 #include "conf.h"
 
 
+/* config readers(queue and worker threads) state */
+struct conf_reader {
+	struct list_item_head list;
+	/* a config generation seen at the last quiescent state or 0 if
+	 * a reader is offline */
+	unsigned long ctr __attribute__ ((aligned(64)));
+};
+
+
 struct conf *conf;
 pthread_mutex_t conf_mut;
+/* a config generation, it's a grace period counter too */
+static unsigned long conf_gen = 1;
+static struct list_item_head conf_readers;
+static pthread_mutex_t conf_readers_mut = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct conf_reader *conf_reader;
 
 
 static int read_statement(FILE *f, char *statement, char *ffname, char *act, char *mark);
 static int read_token(FILE *f, char *str, unsigned int n);
-static struct elist* conf_load_list(char *fname, char *act, char *mark);
+static int conf_load_list(struct elist_chain *elchain, char *fname, char *act, char *mark);
 static struct elist* _elist_make(char *name, char *fname, char *act, char *mark);
+static int _parse_sinkhole_addr(char *str, struct elist *elist);
 static void conf_add_elist_chain(struct conf *c, struct elist_chain *elchain);
 static void _conf_stat_out(struct conf *c);
 static void _conf_replace(struct conf *c);
@@ -81,11 +98,11 @@ int
 conf_parse(const char * const fname)
 {
 	FILE *f;
-	char statement[11], ffname[101], act[11], mark[11], list_absfname[1024];
+	char statement[11], ffname[101], act[64], mark[11], list_absfname[1024];
 	char *absname;
-	struct elist *elist;
 	struct elist_chain *elchain;
 	struct conf *c;
+	int i;
 	
 	c = _conf_make();
 	if (!c)
@@ -106,19 +123,21 @@ conf_parse(const char * const fname)
 			  ffname);
 			if (!absname)
 				goto err_close_file;
-			elist = conf_load_list(absname, act, mark);
-			if (!elist)
+			if (conf_load_list(elchain, absname, act, mark) < 0)
 				goto err_close_file;
-			if (!elchain->elist_first)
-				elchain->elist_first = elist;
-			else
-				elist_add(elchain->elist_first, elist);
 		} else {
 			ERR_OUT("Config error: unknown statement: %s", statement);
 			goto err_close_file;
 		}
 	}
 	fclose(f);
+	for(i = 0; filters[i]; i++)
+		if ((filters[i]->list_build) &&
+		  (filters[i]->list_build(elchain->f_list[i]) < 0)) {
+			ERR_OUT("Config error: %s filter list building error",
+			  filters[i]->name);
+			goto err_free_elchain;
+		}
 	
 	INFO_OUT("config is loaded successfully");
 	_conf_stat_out(c);
@@ -147,7 +166,7 @@ read_statement(FILE *f, char *statement, char *ffname, char *act, char *mark)
 		ERR_OUT("Config read error");
 		exit(2);
 	}
-	ret = read_token(f, act, 11);
+	ret = read_token(f, act, 64);
 	if (ret != 0) {
 		ERR_OUT("Config read error");
 		exit(2);
@@ -213,8 +232,21 @@ read_token(FILE *f, char *str, unsigned int n)
 	return 0;
 }
 
-static struct elist*
-conf_load_list(char *fname, char *act, char *mark)
+/*
+ * Load a list file entries to the chain filters lists. Entries are
+ * tagged with a tag of new elist, which is added to the chain.
+ * elchain - an elist chain
+ * fname - a list file name
+ * act - an action on match
+ * mark - a mark on match
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - an error occured
+ */
+static int
+conf_load_list(struct elist_chain *elchain, char *fname, char *act,
+  char *mark)
 {
 	FILE *f;
 	int ret, i;
@@ -225,22 +257,18 @@ conf_load_list(char *fname, char *act, char *mark)
 	elist = _elist_make("q", fname, act, mark);
 	if (!elist) {
 		ERR_OUT("Can't create elist for %s", fname);
-		return NULL;
+		return -1;
 	}
-	
-	for(i = 0; filters[i]; i++) {
-		ret = filters[i]->list_make(&elist->f_list[i]);
-		if (ret != 0) {
-			ERR_OUT("Can't create elist entry for %s filter",
-			  filters[i]->name);
-			goto err_free_flist;
-		}
+	if (elist_chain_add(elchain, elist) < 0) {
+		ERR_OUT("Can't add elist for %s: no memory", fname);
+		elist_free(elist);
+		return -1;
 	}
 	
 	f = fopen(fname, "r");
 	if (!f) {
 		ERR_OUT("Can't open file: %s: %s", fname, strerror(errno));
-		goto err_free_flist;
+		return -1;
 	}
 	
 	csv_init(&csv);
@@ -255,20 +283,27 @@ conf_load_list(char *fname, char *act, char *mark)
 			continue;
 		}
 		for(i = 0; filters[i]; i++) {
-			ret = filters[i]->list_entry_add(elist->f_list[i],
-			  csv.rec.fields, csv.rec.fields_num);
+			ret = filters[i]->list_entry_add(elchain->f_list[i],
+			  csv.rec.fields, csv.rec.fields_num, elist->tag);
 			if (ret < 0) {
 				ERR_OUT("%s filter error on adding entry(%s:%u)",
 				  filters[i]->name, fname, lineno);
 				goto err_cleanup_csv;
-			} else if (ret == 0)
+			} else if (ret == 0) {
+				elchain->pkt_attrs |= filters[i]->pkt_attrs;
+				if ((filters[i]->pkt_attrs &
+				  ~(PKT_ATTR_ADDR | PKT_ATTR_PORT)) &&
+				  (elist->tag < elchain->payload_tag_min))
+					elchain->payload_tag_min = elist->tag;
 				break;
+			}
 		}
 		if (!filters[i]) {
 			ERR_OUT("Wrong entry(%s:%u): unknown filter: %s",
 			  fname, lineno, csv.rec.fields[0]);
 			continue;
 		}
+		elist->entries_cnt++;
 	}
 	if (ret != 2) {
 		switch (ret) {
@@ -286,18 +321,12 @@ conf_load_list(char *fname, char *act, char *mark)
 	csv_free_buffers(&csv);
 	fclose(f);
 	
-	return elist;
+	return 0;
 	
 err_cleanup_csv:
 	csv_free_buffers(&csv);
 	fclose(f);
-err_free_flist:
-	for(i = 0; filters[i]; i++)
-		if (elist->f_list[i]) {
-			ret = filters[i]->list_free(elist->f_list[i]);
-			ERR_OUT("elist %s filter entry free error", filters[i]->name);
-		}
-	return NULL;
+	return -1;
 }
 
 static struct elist*
@@ -324,7 +353,15 @@ _elist_make(char *name, char *fname, char *act, char *mark)
 		elist->act_on_match = elist_act_accept;
 	else if (strcmp(act, "repeat") == 0)
 		elist->act_on_match = elist_act_repeat;
-	else {
+	else if ((strncmp(act, "sinkhole", 8) == 0) &&
+	  ((act[8] == '\0') || (act[8] == '='))) {
+		elist->act_on_match = elist_act_sinkhole;
+		if ((act[8] == '=') &&
+		  (_parse_sinkhole_addr(act + 9, elist) < 0)) {
+			ERR_OUT("Wrong sinkhole address: %s", act + 9);
+			goto err_free_elist;
+		}
+	} else {
 		ERR_OUT("Unknown action: %s", act);
 		goto err_free_elist;
 	}
@@ -342,6 +379,26 @@ err_free_elist:
 	return NULL;
 }
 
+/*
+ * Parse an ipv4 or ipv6 address of sinkhole answers.
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a wrong address
+ */
+static int
+_parse_sinkhole_addr(char *str, struct elist *elist)
+{
+	if (inet_pton(AF_INET, str, elist->sinkhole_addr) == 1)
+		elist->sinkhole_af = AF_INET;
+	else if (inet_pton(AF_INET6, str, elist->sinkhole_addr) == 1)
+		elist->sinkhole_af = AF_INET6;
+	else
+		return -1;
+	
+	return 0;
+}
+
 static void
 conf_add_elist_chain(struct conf *c, struct elist_chain *elchain)
 {
@@ -349,54 +406,150 @@ conf_add_elist_chain(struct conf *c, struct elist_chain *elchain)
 	elchain->conf = c;
 }
 
+/*
+ * Get a current elist chain. No locks and atomic RMW operations are used:
+ * the chain is valid until the calling thread(which must be registered
+ * as a config reader) passes a quiescent state or goes offline.
+ */
 struct elist_chain*
 conf_get_elist_chain(void)
 {
+	return __atomic_load_n(&conf, __ATOMIC_ACQUIRE)->elist_chain;
+}
+
+/*
+ * Register the calling thread as a config reader. The thread is online
+ * after this call.
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ */
+int
+conf_reader_register(void)
+{
+	struct conf_reader *r;
 	int ret;
-	struct conf *c;
 	
-	ret = pthread_mutex_lock(&conf_mut);
+	r = aligned_alloc(64, sizeof(*r));
+	if (!r)
+		return -1;
+	memset(r, 0, sizeof(*r));
+	
+	ret = pthread_mutex_lock(&conf_readers_mut);
 	if (ret != 0) {
-		ERR_OUT("conf mutex lock error: %s", strerror(ret));
+		ERR_OUT("conf readers mutex lock error: %s", strerror(ret));
 		exit(2);
 	}
-	
-	c = conf;
-	c->ref_cnt++;
-	
-	ret = pthread_mutex_unlock(&conf_mut);
+	list_add(&r->list, &conf_readers);
+	ret = pthread_mutex_unlock(&conf_readers_mut);
 	if (ret != 0) {
-		ERR_OUT("conf mutex unlock error: %s", strerror(ret));
+		ERR_OUT("conf readers mutex unlock error: %s", strerror(ret));
 		exit(2);
 	}
+	conf_reader = r;
+	conf_online();
 	
-	return c->elist_chain;
+	return 0;
 }
 
+/*
+ * Unregister the calling thread as a config reader.
+ */
 void
-conf_release_elist_chain(struct elist_chain *elchain)
+conf_reader_unregister(void)
 {
 	int ret;
-	unsigned int ref_cnt;
-	struct conf *c;
 	
-	ret = pthread_mutex_lock(&conf_mut);
+	if (!conf_reader)
+		return;
+	/* a writer mustn't wait for us while we wait for the mutex */
+	conf_offline();
+	ret = pthread_mutex_lock(&conf_readers_mut);
 	if (ret != 0) {
-		ERR_OUT("conf mutex lock error: %s", strerror(ret));
+		ERR_OUT("conf readers mutex lock error: %s", strerror(ret));
 		exit(2);
 	}
-	
-	c = (struct conf*)elchain->conf;
-	ref_cnt = --c->ref_cnt;
-	
-	ret = pthread_mutex_unlock(&conf_mut);
+	list_rm(&conf_reader->list);
+	ret = pthread_mutex_unlock(&conf_readers_mut);
 	if (ret != 0) {
-		ERR_OUT("conf mutex unlock error: %s", strerror(ret));
+		ERR_OUT("conf readers mutex unlock error: %s", strerror(ret));
 		exit(2);
 	}
+	free(conf_reader);
+	conf_reader = NULL;
+}
+
+/*
+ * Report a quiescent state: the calling thread doesn't use any elist
+ * chain got before this call.
+ */
+void
+conf_quiescent(void)
+{
+	__atomic_store_n(&conf_reader->ctr,
+	  __atomic_load_n(&conf_gen, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+/*
+ * Go offline(e.g. before a blocking call): the calling thread doesn't use
+ * any elist chain until conf_online() call.
+ */
+void
+conf_offline(void)
+{
+	__atomic_store_n(&conf_reader->ctr, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Go online after conf_offline().
+ */
+void
+conf_online(void)
+{
+	__atomic_store_n(&conf_reader->ctr,
+	  __atomic_load_n(&conf_gen, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+	/* a writer must see we are online before we read a config pointer */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * Wait until every config reader passes a quiescent state or is offline.
+ */
+static void
+_conf_synchronize(void)
+{
+	struct list_item_head *lh;
+	struct conf_reader *r;
+	unsigned long gen, ctr;
+	int ret;
+	
+	gen = __atomic_add_fetch(&conf_gen, 1, __ATOMIC_SEQ_CST);
 	
-	if (ref_cnt == 0)
-		_conf_free(c);
+	/* The mutex isn't held while sleeping: readers can register and
+	 * unregister meanwhile, so the list is rescanned after each sleep.
+	 * Readers, which are seen done, stay done until the next call. */
+	for(;;) {
+		ret = pthread_mutex_lock(&conf_readers_mut);
+		if (ret != 0) {
+			ERR_OUT("conf readers mutex lock error: %s", strerror(ret));
+			exit(3);
+		}
+		list_for_each(lh, conf_readers.next) {
+			r = list_item(lh, struct conf_reader, list);
+			ctr = __atomic_load_n(&r->ctr, __ATOMIC_ACQUIRE);
+			if ((ctr != 0) && (ctr != gen))
+				break;
+		}
+		ret = pthread_mutex_unlock(&conf_readers_mut);
+		if (ret != 0) {
+			ERR_OUT("conf readers mutex unlock error: %s", strerror(ret));
+			exit(3);
+		}
+		if (!lh)
+			break;
+		usleep(1000);
+	}
 }
 
 static void
@@ -408,17 +561,19 @@ _conf_stat_out(struct conf *c)
 	
 	list_for_each(lh, &c->elist_chain->elist_first->list) {
 		elist = list_item(lh, struct elist, list);
-		INFO_OUT("stat for %s list:", elist->fname);
-		for(i = 0; filters[i]; i++)
-			filters[i]->list_stat_out(elist->f_list[i]);
+		INFO_OUT("stat for %s list: entries %u", elist->fname,
+		  elist->entries_cnt);
 	}
+	INFO_OUT("stat for merged lists:");
+	for(i = 0; filters[i]; i++)
+		filters[i]->list_stat_out(c->elist_chain->f_list[i]);
+	INFO_OUT("needed packet attributes: 0x%02x", c->elist_chain->pkt_attrs);
 }
 
 static void
 _conf_replace(struct conf *c)
 {
 	int ret;
-	unsigned int ref_cnt;
 	struct conf *old_conf;
 	
 	ret = pthread_mutex_lock(&conf_mut);
@@ -427,13 +582,9 @@ _conf_replace(struct conf *c)
 		exit(3);
 	}
 	
-	old_conf = conf;
-	conf = c;
-	if (old_conf)
-		ref_cnt = --old_conf->ref_cnt;
-	else
-		ref_cnt = 1;
-	c->ref_cnt++;
+	old_conf = __atomic_exchange_n(&conf, c, __ATOMIC_SEQ_CST);
+	/* free an old config only after all readers have stopped using it */
+	_conf_synchronize();
 	
 	ret = pthread_mutex_unlock(&conf_mut);
 	if (ret != 0) {
@@ -441,10 +592,19 @@ _conf_replace(struct conf *c)
 		exit(3);
 	}
 	
-	if (ref_cnt == 0)
+	if (old_conf)
 		_conf_free(old_conf);
 }
 
+/*
+ * Return a config generation. It's changed on every config replacing.
+ */
+unsigned int
+conf_gen_get(void)
+{
+	return __atomic_load_n(&conf_gen, __ATOMIC_ACQUIRE);
+}
+
 static char*
 _get_list_absfname(char *absname, int size, char *conf_name, char *list_name)
 {
@@ -4,14 +4,48 @@
 
 struct conf {
 	struct elist_chain *elist_chain;
-	unsigned int ref_cnt;
 };
 
 
 int conf_init(void);
 int conf_parse(const char * const fname);
+/*
+ * Get a current elist chain. No locks and atomic RMW operations are used:
+ * the chain is valid until the calling thread(which must be registered
+ * as a config reader) passes a quiescent state or goes offline.
+ */
 struct elist_chain* conf_get_elist_chain(void);
-void conf_release_elist_chain(struct elist_chain *elchain);
+/*
+ * Register the calling thread as a config reader. The thread is online
+ * after this call.
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ */
+int conf_reader_register(void);
+/*
+ * Unregister the calling thread as a config reader.
+ */
+void conf_reader_unregister(void);
+/*
+ * Report a quiescent state: the calling thread doesn't use any elist
+ * chain got before this call.
+ */
+void conf_quiescent(void);
+/*
+ * Go offline(e.g. before a blocking call): the calling thread doesn't use
+ * any elist chain until conf_online() call.
+ */
+void conf_offline(void);
+/*
+ * Go online after conf_offline().
+ */
+void conf_online(void);
+/*
+ * Return a config generation. It's changed on every config replacing.
+ */
+unsigned int conf_gen_get(void);
 
 
 #endif  /* __CONF_H__ */
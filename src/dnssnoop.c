@@ -0,0 +1,228 @@
+/*
+ * traffic filter
+ * Copyright (C) 2017, Oleg Nemanov <lego12239@yandex.ru>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "log.h"
+#include "dnssnoop.h"
+
+
+/* max number of slots checked for an address */
+#define DNSSNOOP_PROBES 4
+
+
+/*
+ * An entry is written by any thread under a seqlock: a writer makes
+ * a sequence odd, changes fields and makes it even again. A reader
+ * doesn't wait - an entry, which is changed during a read, is skipped.
+ * All fields are accessed atomically, so torn values are impossible.
+ */
+struct dnssnoop_entry {
+	/* odd - an entry is being written */
+	uint32_t seq;
+	/* an address in network byte order(ipv4 one is ipv4-mapped) */
+	uint32_t addr[4];
+	uint32_t gen;
+	/* an expiration time in seconds(0 - an entry is never used) */
+	uint32_t expire;
+	uint32_t tag;
+};
+
+
+static struct dnssnoop_entry *stable;
+static unsigned int smask;
+static unsigned int sttl_max;
+
+
+/*
+ * Make a dns snooping table: addresses from dns answers for names
+ * matched by domain filters with tags of matched elists. The table is
+ * shared by all threads. Must be called before packets processing.
+ * size - max number of addresses
+ * ttl_max - max address lifetime in seconds(an answer ttl is used, if
+ *           it's less)
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ */
+int
+dnssnoop_init(unsigned int size, unsigned int ttl_max)
+{
+	unsigned int n;
+	
+	/* round up to a power of 2 */
+	for(n = 1; n < size; n <<= 1);
+	stable = calloc(n, sizeof(*stable));
+	if (!stable) {
+		ERR_OUT("dns snooping table allocating error: no memory");
+		return -1;
+	}
+	smask = n - 1;
+	sttl_max = ttl_max;
+	
+	return 0;
+}
+
+static uint32_t
+_dnssnoop_now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	
+	return ts.tv_sec;
+}
+
+static uint32_t
+_dnssnoop_hash(const uint32_t *addr)
+{
+	uint32_t h;
+	
+	h = addr[0] ^ (addr[1] * 0x9e3779b1) ^ (addr[2] * 0x85ebca6b) ^
+	  (addr[3] * 0xc2b2ae35);
+	/* murmur3 finalizer */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	
+	return h;
+}
+
+/*
+ * Read an entry consistently.
+ * e - an entry
+ * c - a pointer to place a copy
+ *
+ * return:
+ *   1 - a copy is made
+ *   0 - an entry is being written
+ */
+static int
+_dnssnoop_entry_read(struct dnssnoop_entry *e, struct dnssnoop_entry *c)
+{
+	unsigned int i;
+	
+	c->seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+	if (c->seq & 1)
+		return 0;
+	for(i = 0; i < 4; i++)
+		c->addr[i] = __atomic_load_n(&e->addr[i], __ATOMIC_RELAXED);
+	c->gen = __atomic_load_n(&e->gen, __ATOMIC_RELAXED);
+	c->expire = __atomic_load_n(&e->expire, __ATOMIC_RELAXED);
+	c->tag = __atomic_load_n(&e->tag, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	
+	return __atomic_load_n(&e->seq, __ATOMIC_RELAXED) == c->seq;
+}
+
+/*
+ * Add an address to the table. A free, stale or expired slot is taken;
+ * if there is no one, an entry expiring first in a probe window is
+ * replaced. An address is skipped, if all slots of a probe window are
+ * being written by other threads.
+ * addr - an address in network byte order(ipv4 one is ipv4-mapped)
+ * gen - a config generation the tag is got with
+ * ttl - an answer ttl in seconds
+ * tag - a tag of a matched elist
+ */
+void
+dnssnoop_add(const uint8_t *addr, unsigned int gen, uint32_t ttl,
+  unsigned int tag)
+{
+	struct dnssnoop_entry *e, *victim = NULL, c;
+	uint32_t key[4], now, expire = 0, seq;
+	unsigned int i, idx;
+	
+	if (ttl > sttl_max)
+		ttl = sttl_max;
+	if (!ttl)
+		return;
+	memcpy(key, addr, sizeof(key));
+	now = _dnssnoop_now();
+	idx = _dnssnoop_hash(key);
+	for(i = 0; i < DNSSNOOP_PROBES; i++) {
+		e = &stable[(idx + i) & smask];
+		if (!_dnssnoop_entry_read(e, &c))
+			continue;
+		if ((!c.expire) || (memcmp(c.addr, key, sizeof(key)) == 0) ||
+		  (c.gen != gen) || ((int32_t)(now - c.expire) >= 0)) {
+			victim = e;
+			break;
+		}
+		if ((!victim) || ((int32_t)(c.expire - expire) < 0)) {
+			victim = e;
+			expire = c.expire;
+		}
+	}
+	if (!victim)
+		return;
+	
+	seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) || (!__atomic_compare_exchange_n(&victim->seq, &seq,
+	  seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)))
+		return;
+	/* fields stores mustn't be visible before an odd sequence */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for(i = 0; i < 4; i++)
+		__atomic_store_n(&victim->addr[i], key[i], __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->gen, gen, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->expire, now + ttl, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->tag, tag, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Look up an address in the table. Entries of other config generation or
+ * expired ones are ignored.
+ * addr - an address in network byte order(ipv4 one is ipv4-mapped)
+ * gen - a current config generation
+ * tag - a pointer to place a tag
+ *
+ * return:
+ *   1 - an address is found
+ *   0 - not found
+ */
+int
+dnssnoop_lookup(const uint32_t *addr, unsigned int gen, unsigned int *tag)
+{
+	struct dnssnoop_entry *e, c;
+	unsigned int i, idx;
+	
+	idx = _dnssnoop_hash(addr);
+	for(i = 0; i < DNSSNOOP_PROBES; i++) {
+		e = &stable[(idx + i) & smask];
+		if (!_dnssnoop_entry_read(e, &c))
+			continue;
+		if (!c.expire)
+			return 0;
+		if (memcmp(c.addr, addr, sizeof(c.addr)) != 0)
+			continue;
+		/* a fresh entry can follow an expired one */
+		if ((c.gen != gen) ||
+		  ((int32_t)(_dnssnoop_now() - c.expire) >= 0))
+			continue;
+		*tag = c.tag;
+		return 1;
+	}
+	
+	return 0;
+}
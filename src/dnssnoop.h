@@ -0,0 +1,45 @@
+#ifndef __DNSSNOOP_H__
+#define __DNSSNOOP_H__
+
+#include <stdint.h>
+
+
+/*
+ * Make a dns snooping table: addresses from dns answers for names
+ * matched by domain filters with tags of matched elists. The table is
+ * shared by all threads. Must be called before packets processing.
+ * size - max number of addresses
+ * ttl_max - max address lifetime in seconds(an answer ttl is used, if
+ *           it's less)
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ */
+int dnssnoop_init(unsigned int size, unsigned int ttl_max);
+/*
+ * Add an address to the table. A free, stale or expired slot is taken;
+ * if there is no one, an entry expiring first in a probe window is
+ * replaced. An address is skipped, if all slots of a probe window are
+ * being written by other threads.
+ * addr - an address in network byte order(ipv4 one is ipv4-mapped)
+ * gen - a config generation the tag is got with
+ * ttl - an answer ttl in seconds
+ * tag - a tag of a matched elist
+ */
+void dnssnoop_add(const uint8_t *addr, unsigned int gen, uint32_t ttl, unsigned int tag);
+/*
+ * Look up an address in the table. Entries of other config generation or
+ * expired ones are ignored.
+ * addr - an address in network byte order(ipv4 one is ipv4-mapped)
+ * gen - a current config generation
+ * tag - a pointer to place a tag
+ *
+ * return:
+ *   1 - an address is found
+ *   0 - not found
+ */
+int dnssnoop_lookup(const uint32_t *addr, unsigned int gen, unsigned int *tag);
+
+
+#endif  /* __DNSSNOOP_H__ */
@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdlib.h>
+#include <limits.h>
 #include <stdint.h>
 #include <pthread.h>
 #include "filters.h"
@@ -34,32 +35,19 @@ struct elist*
 elist_make(void)
 {
 	struct elist *elist;
-	int i;
 	
 	elist = malloc(sizeof(*elist));
 	if (!elist)
 		return NULL;
 	memset(elist, 0, sizeof(*elist));
-	for(i = 0; filters[i]; i++);
-	elist->f_list = malloc(sizeof(*elist->f_list) * i);
-	if (!elist->f_list) {
-		free(elist);
-		return NULL;
-	}
-	memset(elist->f_list, 0, sizeof(*elist->f_list) * i);
 	return elist;
 }
 
 void
 elist_free(struct elist *elist)
 {
-	int i;
-	
 	free(elist->name);
 	free(elist->fname);
-	for(i = 0; filters[i]; i++)
-		if (elist->f_list[i])
-			filters[i]->list_free(elist->f_list[i]);
 	free(elist);
 }
 
@@ -82,7 +70,36 @@ elist_add(struct elist *elist, struct elist *new)
 }
 
 /*
- * Create a elist chain.
+ * Add new elist to tail of a chain and set its tag.
+ * elchain - an elist chain
+ * elist - new elist to add
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ */
+int
+elist_chain_add(struct elist_chain *elchain, struct elist *elist)
+{
+	struct elist **elists;
+	
+	elists = realloc(elchain->elists,
+	  sizeof(*elists) * (elchain->elists_cnt + 1));
+	if (!elists)
+		return -1;
+	elchain->elists = elists;
+	elist->tag = elchain->elists_cnt;
+	elists[elchain->elists_cnt++] = elist;
+	if (!elchain->elist_first)
+		elchain->elist_first = elist;
+	else
+		elist_add(elchain->elist_first, elist);
+	
+	return 0;
+}
+
+/*
+ * Create a elist chain with empty filters lists.
  *
  * return:
  *   elist_chain - a pointer to a created elist chain
@@ -92,6 +109,7 @@ struct elist_chain*
 elist_chain_make(void)
 {
 	struct elist_chain *elchain;
+	int i;
 	
 	elchain = malloc(sizeof(*elchain));
 	if (!elchain) {
@@ -99,8 +117,30 @@ elist_chain_make(void)
 		return NULL;
 	}
 	memset(elchain, 0, sizeof(*elchain));
+	elchain->payload_tag_min = UINT_MAX;
+	for(i = 0; filters[i]; i++);
+	elchain->f_list = malloc(sizeof(*elchain->f_list) * i);
+	if (!elchain->f_list) {
+		ERR_OUT("elist chain creation error: no memory");
+		goto err_free_elchain;
+	}
+	memset(elchain->f_list, 0, sizeof(*elchain->f_list) * i);
+	for(i = 0; filters[i]; i++)
+		if (filters[i]->list_make(&elchain->f_list[i]) != 0) {
+			ERR_OUT("Can't create %s filter list", filters[i]->name);
+			goto err_free_flist;
+		}
 	
 	return elchain;
+	
+err_free_flist:
+	for(i = 0; filters[i]; i++)
+		if (elchain->f_list[i])
+			filters[i]->list_free(elchain->f_list[i]);
+	free(elchain->f_list);
+err_free_elchain:
+	free(elchain);
+	return NULL;
 }
 
 static void
@@ -115,6 +155,13 @@ _elist_chain_free_cb(struct list_item_head *lh)
 void
 elist_chain_free(struct elist_chain *elchain)
 {
+	int i;
+	
+	for(i = 0; filters[i]; i++)
+		if (elchain->f_list[i])
+			filters[i]->list_free(elchain->f_list[i]);
+	free(elchain->f_list);
 	list_free(&elchain->elist_first->list, _elist_chain_free_cb);
+	free(elchain->elists);
 	free(elchain);
 }
@@ -8,20 +8,38 @@
 enum elist_act {
 	elist_act_accept,
 	elist_act_drop,
-	elist_act_repeat
+	elist_act_repeat,
+	/* drop a packet; a dns query is answered by trfl */
+	elist_act_sinkhole
 };
 
 struct elist {
 	struct list_item_head list;
 	char *name;
 	char *fname;
-	void **f_list;
+	/* an elist index in a chain; it's a priority too(less is higher) */
+	unsigned int tag;
+	unsigned int entries_cnt;
 	enum elist_act act_on_match;
 	uint32_t mark_on_match;
+	/* an address of sinkhole answers(AF_INET or AF_INET6; 0 - answers
+	 * are NXDOMAIN) */
+	int sinkhole_af;
+	uint8_t sinkhole_addr[16];
 };
 
 struct elist_chain {
 	struct elist *elist_first;
+	/* elists indexed by a tag */
+	struct elist **elists;
+	unsigned int elists_cnt;
+	/* merged lists of entries of all elists for each filter */
+	void **f_list;
+	/* packet attributes(PKT_ATTR_*) needed by filters with entries */
+	unsigned int pkt_attrs;
+	/* a minimal tag of elists with payload entries(e.g. domains; UINT_MAX
+	 * - there are no such elists) */
+	unsigned int payload_tag_min;
 	void *conf;
 	/* FUTURE: */
 	enum elist_act act_default;
@@ -43,9 +61,19 @@ void elist_free(struct elist *elist);
  * new - new elist to add
  */
 void elist_add(struct elist *elist, struct elist *new);
+/*
+ * Add new elist to tail of a chain and set its tag.
+ * elchain - an elist chain
+ * elist - new elist to add
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ */
+int elist_chain_add(struct elist_chain *elchain, struct elist *elist);
 
 /*
- * Create a elist chain.
+ * Create a elist chain with empty filters lists.
  *
  * return:
  *   elist_chain - a pointer to a created elist chain
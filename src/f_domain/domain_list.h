@@ -1,23 +1,37 @@
 #ifndef __DOMAINLIST_H__
 #define __DOMAINLIST_H__
 
-#include "list.h"
-#include "avltree.h"
+#include <stdint.h>
 
-struct domain_list {
-	struct domain_list_item *first;
-	unsigned int len;
-};
 
-struct domain_list_item_value {
-	struct list_item_head list;
-	char *value;
-	unsigned int len;
+/*
+ * A domain list is a flat open addressing hash set(Swiss table like).
+ * Slots are grouped by DOMAINLIST_GROUP_SIZE; every slot has a control
+ * byte: DOMAINLIST_CTRL_EMPTY or 7 bits of a value hash. A group control
+ * bytes are compared with one SSE2 instruction. Values are placed into
+ * one strings blob.
+ */
+#define DOMAINLIST_GROUP_SIZE 16
+#define DOMAINLIST_CTRL_EMPTY 0x80
+
+struct domain_list_slot {
+	uint32_t hash;
+	/* a value offset in the blob */
+	uint32_t off;
+	uint32_t len;
+	/* a tag of an elist the value is from */
+	uint32_t tag;
 };
 
-struct domain_list_item {
-	struct avltree_node_head tree;
-	struct domain_list_item_value *values;
+struct domain_list {
+	uint8_t *ctrl;
+	struct domain_list_slot *slots;
+	/* slots number(a power of 2, multiple of a group size) */
+	unsigned int size;
+	unsigned int len;
+	char *blob;
+	unsigned int blob_len;
+	unsigned int blob_size;
 };
 
 
@@ -42,20 +56,36 @@ struct domain_list* domain_list_make(void);
  */
 int domain_list_free(struct domain_list *l);
 /*
- * Add specified domain to a specified domain_list.
+ * Add specified domain to a specified domain_list. If the domain is
+ * already in the list, a minimal tag is kept.
  *
  * l - a pointer to domain_list
  * value - a value to add
  * size - a value size
  * vfk - a value for key generation
  * vfk_size - a size of value for key
+ * tag - a tag of an elist the value is from
+ *
+ * return:
+ *   0 - if everything is ok
+ *  -1 - if memory error occured
+ */
+int domain_list_add(struct domain_list *l, char *value, unsigned int size, char *vfk, unsigned int vfk_size, unsigned int tag);
+/*
+ * Check if a value exists in a domain list.
+ *
+ * l - a pointer to domain_list
+ * value - a value to search
+ * size - a value size
+ * vfk - a value for key generation
+ * vfk_size - a size of value for key
+ * tag - a pointer to place a tag of the found value
  *
  * return:
- *   pointer - a pointer to struct domain_list_item_value with new domain
- *   NULL - if memory error occured or value too large
+ *   1 - a value is found
+ *   0 - a value isn't found
  */
-struct domain_list_item_value* domain_list_add(struct domain_list *l, char *value, unsigned int size, char *vfk, unsigned int vfk_size);
-int domain_list_value_exist(struct domain_list *l, char *value, unsigned int size, char *vfk, unsigned int vfk_size);
+int domain_list_value_exist(struct domain_list *l, char *value, unsigned int size, char *vfk, unsigned int vfk_size, unsigned int *tag);
 
 
 #endif /* __DOMAINLIST_H__ */
@@ -66,6 +66,7 @@ flist_free(void *list)
  * list - a pointer to a list
  * fields - a pointer to array of strings
  * n - number of strings in array
+ * tag - a tag of an elist the entry is from
  *
  * return:
  *   1 - entry is not processible by this filter - ignored
@@ -73,7 +74,8 @@ flist_free(void *list)
  *  <0 - an error occured
  */
 static int
-list_entry_add(void *list, char **fields, unsigned int n)
+list_entry_add(void *list, char **fields, unsigned int n,
+  unsigned int tag)
 {
 	struct domain_list *domainlist = list;
 	char buf[260];
@@ -89,10 +91,9 @@ list_entry_add(void *list, char **fields, unsigned int n)
 			ERR_OUT("domain: domain add error: %s: name too long", fields[1]);
 			return -1;
 		}
-		len++;
-		memcpy(buf, fields[1], len);
+		memcpy(buf, fields[1], len + 1);
 		normalize_domain_name(buf);
-		if (!domain_list_add(domainlist, buf, len, buf, len)) {
+		if (domain_list_add(domainlist, buf, len, buf, len, tag) < 0) {
 			ERR_OUT("domain: domain add error: %s: no memory", buf);
 			return -1;
 		}
@@ -113,25 +114,28 @@ list_stat_out(void *list)
 }
 
 static int
-filter_pkt(void *list, struct pkt *pkt)
+filter_pkt(void *list, struct pkt *pkt, unsigned int *tag)
 {
 	struct domain_list *domainlist = list;
 	struct pkt_nfq *pkt_nfq;
 	struct list_item_head *lh;
 	struct conn_domain *domain;
-	int ret;
+	unsigned int t;
+	int ret = 0;
 	
 	pkt_nfq = (struct pkt_nfq*)pkt;
 	if (!pkt_nfq->domain)
 		return 0;
 	list_for_each(lh, &pkt_nfq->domain->list) {
 		domain = list_item(lh, struct conn_domain, list);
-		ret = domain_list_value_exist(domainlist, domain->name,
-		  strlen(domain->name) + 1, domain->name, strlen(domain->name) + 1);
-		if (ret)
-			return 1;
+		if (!domain_list_value_exist(domainlist, domain->name, domain->len,
+		  domain->name, domain->len, &t))
+			continue;
+		if ((!ret) || (t < *tag))
+			*tag = t;
+		ret = 1;
 	}
-	return 0;
+	return ret;
 }
 
 struct filter filter_f_domain = {
@@ -141,6 +145,8 @@ struct filter filter_f_domain = {
 	flist_free,
 	list_entry_add,
 	list_stat_out,
-	filter_pkt
+	filter_pkt,
+	NULL,
+	PKT_ATTR_DOMAIN
 };
 
@@ -20,12 +20,17 @@
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "domain_list.h"
 
 
-static void domain_list_item_free(struct domain_list_item *item);
-static struct domain_list_item* domain_list_item_make(char *value, unsigned int size, char *vfk, unsigned int vfk_size);
-static struct domain_list_item_value* domain_list_item_value_make(char *value, unsigned int size);
+#define DOMAINLIST_SIZE_MIN 64
+#define DOMAINLIST_BLOB_SIZE_MIN 4096
+
+
+static int domain_list_resize(struct domain_list *l, unsigned int size);
 
 
 static uint32_t
@@ -51,6 +56,27 @@ domain_list_gen_key(char *value, unsigned int size)
 	return jenkins_one_at_a_time_hash((uint8_t*)value, size);
 }
 
+/*
+ * Return a bit mask of group slots with a control byte equal to c.
+ */
+static inline unsigned int
+_group_match(uint8_t *ctrl, uint8_t c)
+{
+#ifdef __SSE2__
+	__m128i g;
+	
+	g = _mm_load_si128((__m128i*)ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#else
+	unsigned int i, mask = 0;
+	
+	for(i = 0; i < DOMAINLIST_GROUP_SIZE; i++)
+		if (ctrl[i] == c)
+			mask |= 1 << i;
+	return mask;
+#endif
+}
+
 /*
  * Create new domain list with name of name.
  *
@@ -69,19 +95,14 @@ domain_list_make(void)
 	if (!l)
 		return NULL;
 	memset(l, 0, sizeof(*l));
+	if (domain_list_resize(l, DOMAINLIST_SIZE_MIN) != 0) {
+		free(l);
+		return NULL;
+	}
 	
 	return l;
 }
 
-static void
-_domain_list_free_item(struct avltree_node_head *h)
-{
-	struct domain_list_item *item;
-	
-	item = avltree_node(h, struct domain_list_item, tree);
-	domain_list_item_free(item);
-}
-
 /*
  * Free a domain list l.
  *
@@ -96,162 +117,200 @@ domain_list_free(struct domain_list *l)
 {
 	if (!l)
 		return -EINVAL;
-	if (l->first)
-		avltree_for_each_after(&(l->first->tree), _domain_list_free_item);
+	free(l->ctrl);
+	free(l->slots);
+	free(l->blob);
 	free(l);
 	
 	return 0;
 }
 
-static void
-domain_list_item_value_free(struct domain_list_item_value *v)
+/*
+ * Find a slot for a value. Groups are probed quadratically.
+ *
+ * return:
+ *   >=0 - an index of a slot with the value
+ *   <0 - the value isn't found; -(index + 1) of an empty slot for it
+ */
+static long
+_domain_list_find(struct domain_list *l, char *value, unsigned int size,
+  uint32_t hash)
 {
-	if (v->value)
-		free(v->value);
-	free(v);
+	struct domain_list_slot *s;
+	unsigned int g, gmask, i, mask;
+	uint8_t h2 = hash & 0x7f;
+	
+	gmask = l->size / DOMAINLIST_GROUP_SIZE - 1;
+	g = (hash >> 7) & gmask;
+	for(i = 1; ; i++) {
+		mask = _group_match(l->ctrl + g * DOMAINLIST_GROUP_SIZE, h2);
+		while (mask) {
+			s = &l->slots[g * DOMAINLIST_GROUP_SIZE + __builtin_ctz(mask)];
+			if ((s->hash == hash) && (s->len == size) &&
+			  (memcmp(l->blob + s->off, value, size) == 0))
+				return s - l->slots;
+			mask &= mask - 1;
+		}
+		mask = _group_match(l->ctrl + g * DOMAINLIST_GROUP_SIZE,
+		  DOMAINLIST_CTRL_EMPTY);
+		if (mask)
+			return -(long)(g * DOMAINLIST_GROUP_SIZE + __builtin_ctz(mask)) -
+			  1;
+		g = (g + i) & gmask;
+	}
 }
 
-static void
-domain_list_item_free(struct domain_list_item *item)
+/*
+ * Find an empty slot for a value with a hash.
+ */
+static unsigned int
+_domain_list_find_empty(struct domain_list *l, uint32_t hash)
 {
-	struct list_item_head *h;
-	struct domain_list_item_value *v;
+	unsigned int g, gmask, i, mask;
+	
+	gmask = l->size / DOMAINLIST_GROUP_SIZE - 1;
+	g = (hash >> 7) & gmask;
+	for(i = 1; ; i++) {
+		mask = _group_match(l->ctrl + g * DOMAINLIST_GROUP_SIZE,
+		  DOMAINLIST_CTRL_EMPTY);
+		if (mask)
+			return g * DOMAINLIST_GROUP_SIZE + __builtin_ctz(mask);
+		g = (g + i) & gmask;
+	}
+}
 
-	if (item->values) {	
-		h = &(item->values->list);
-		while (h) {
-			v = list_item(h, struct domain_list_item_value, list);
-			h = h->next;
-			domain_list_item_value_free(v);
-		}
+static int
+domain_list_resize(struct domain_list *l, unsigned int size)
+{
+	struct domain_list old = *l;
+	unsigned int i, idx;
+	
+	l->ctrl = aligned_alloc(DOMAINLIST_GROUP_SIZE, size);
+	l->slots = malloc(sizeof(*l->slots) * size);
+	if ((!l->ctrl) || (!l->slots)) {
+		free(l->ctrl);
+		free(l->slots);
+		*l = old;
+		return -1;
+	}
+	memset(l->ctrl, DOMAINLIST_CTRL_EMPTY, size);
+	l->size = size;
+	
+	/* old values are unique - just place them into empty slots */
+	for(i = 0; i < old.size; i++) {
+		if (old.ctrl[i] == DOMAINLIST_CTRL_EMPTY)
+			continue;
+		idx = _domain_list_find_empty(l, old.slots[i].hash);
+		l->ctrl[idx] = old.ctrl[i];
+		l->slots[idx] = old.slots[i];
 	}
-	free(item);
+	free(old.ctrl);
+	free(old.slots);
+	
+	return 0;
 }
 
 static int
-_domain_list_add_cb(struct avltree_node_head *new, struct avltree_node_head *e)
+_domain_list_blob_add(struct domain_list *l, char *value, unsigned int size)
 {
-	struct domain_list_item *item_new, *item_e;
+	unsigned int blob_size;
+	char *blob;
 	
-	item_new = avltree_node(new, struct domain_list_item, tree);
-	item_e = avltree_node(e, struct domain_list_item, tree);
-	list_add(&(item_new->values->list), &(item_e->values->list));
+	if (l->blob_size - l->blob_len < size) {
+		blob_size = l->blob_size ? l->blob_size : DOMAINLIST_BLOB_SIZE_MIN;
+		while (blob_size - l->blob_len < size)
+			blob_size *= 2;
+		blob = realloc(l->blob, blob_size);
+		if (!blob)
+			return -1;
+		l->blob = blob;
+		l->blob_size = blob_size;
+	}
+	memcpy(l->blob + l->blob_len, value, size);
+	l->blob_len += size;
 	
-	return 1;
+	return 0;
 }
 
 /*
- * Add specified domain to a specified domain_list.
+ * Add specified domain to a specified domain_list. If the domain is
+ * already in the list, a minimal tag is kept.
  *
  * l - a pointer to domain_list
  * value - a value to add
  * size - a value size
  * vfk - a value for key generation
  * vfk_size - a size of value for key
+ * tag - a tag of an elist the value is from
  *
  * return:
- *   pointer - a pointer to struct domain_list_item_value with new domain
- *   NULL - if memory error occured or value too large
+ *   0 - if everything is ok
+ *  -1 - if memory error occured
  */
-struct domain_list_item_value*
+int
 domain_list_add(struct domain_list *l, char *value, unsigned int size,
-  char *vfk, unsigned int vfk_size)
+  char *vfk, unsigned int vfk_size, unsigned int tag)
 {
-	struct domain_list_item *item;
-	struct domain_list_item_value *v;
-	struct avltree_node_head *new_root = &(l->first->tree);
-	int ret;
-	
-	item = domain_list_item_make(value, size, vfk, vfk_size);
-	if (!item)
-		return NULL;
-	v = item->values;
+	struct domain_list_slot *s;
+	uint32_t hash;
+	long idx;
 	
-	if (!l->first) {
-		l->first = item;
-	} else {
-		ret = avltree_add(&(item->tree), &(l->first->tree), _domain_list_add_cb,
-		  &new_root);
-		if (ret == 1) {
-			item->values = NULL;
-			domain_list_item_free(item);
-		} else if (ret != 0) {
-			domain_list_item_free(item);
-			return NULL;
-		}
-		l->first = avltree_node(new_root, struct domain_list_item, tree);
+	hash = domain_list_gen_key(vfk, vfk_size);
+	idx = _domain_list_find(l, value, size, hash);
+	if (idx >= 0) {
+		if (tag < l->slots[idx].tag)
+			l->slots[idx].tag = tag;
+		return 0;
 	}
 	
-	l->len++;
-	
-	return v;
-}
-
-static struct domain_list_item*
-domain_list_item_make(char *value, unsigned int size, char *vfk,
-  unsigned int vfk_size)
-{
-	struct domain_list_item *item;
-
-	item = malloc(sizeof(*item));
-	if (!item)
-		return NULL;
-	memset(item, 0, sizeof(*item));
-	avltree_node_head_init(&(item->tree));
-	item->values = domain_list_item_value_make(value, size);
-	if (!item->values) {
-		free(item);
-		return NULL;
+	/* keep a load factor <= 7/8 */
+	if ((l->len + 1) * 8 > l->size * 7) {
+		if (domain_list_resize(l, l->size * 2) != 0)
+			return -1;
+		idx = _domain_list_find(l, value, size, hash);
 	}
+	idx = -idx - 1;
+	if (_domain_list_blob_add(l, value, size) != 0)
+		return -1;
+	s = &l->slots[idx];
+	s->hash = hash;
+	s->off = l->blob_len - size;
+	s->len = size;
+	s->tag = tag;
+	l->ctrl[idx] = hash & 0x7f;
 	
-	item->tree.key = domain_list_gen_key(vfk, vfk_size);
-	
-	return item;
-}
-
-static struct domain_list_item_value*
-domain_list_item_value_make(char *value, unsigned int size)
-{
-	struct domain_list_item_value *v;
+	l->len++;
 	
-	v = malloc(sizeof(*v));
-	if (!v)
-		return NULL;
-	memset(v, 0, sizeof(*v));
-	list_item_head_init(&(v->list));
-	v->len = size;
-	v->value = malloc(size);
-	if (!v->value) {
-		free(v);
-		return NULL;
-	}
-	memcpy(v->value, value, size);
-
-	return v;
+	return 0;
 }
 
+/*
+ * Check if a value exists in a domain list.
+ *
+ * l - a pointer to domain_list
+ * value - a value to search
+ * size - a value size
+ * vfk - a value for key generation
+ * vfk_size - a size of value for key
+ * tag - a pointer to place a tag of the found value
+ *
+ * return:
+ *   1 - a value is found
+ *   0 - a value isn't found
+ */
 int
 domain_list_value_exist(struct domain_list *l, char *value,
-  unsigned int size, char *vfk, unsigned int vfk_size)
+  unsigned int size, char *vfk, unsigned int vfk_size, unsigned int *tag)
 {
-	struct domain_list_item *item;
-	struct domain_list_item_value *v;
-	struct avltree_node_head *nh;
-	struct list_item_head *lh;
-	unsigned int key;
+	long idx;
 	
-	if (!l->first)
+	if (!l->len)
 		return 0;
-	key = domain_list_gen_key(vfk, vfk_size);
-	nh = avltree_search(&(l->first->tree), key);
-	if (!nh)
+	idx = _domain_list_find(l, value, size, domain_list_gen_key(vfk,
+	  vfk_size));
+	if (idx < 0)
 		return 0;
-	item = avltree_node(nh, struct domain_list_item, tree);
-	list_for_each(lh, &(item->values->list)) {
-		v = list_item(lh, struct domain_list_item_value, list);
-		if ((size >= v->len) && (memcmp(value, v->value, v->len) == 0))
-			return 1;
-	}
+	*tag = l->slots[idx].tag;
 	
-	return 0;
+	return 1;
 }
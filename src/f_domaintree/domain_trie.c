@@ -0,0 +1,301 @@
+/*
+ * traffic filter
+ * Copyright (C) 2017, Oleg Nemanov <lego12239@yandex.ru>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include "domain_list.h"
+#include "domain_trie.h"
+
+
+#define DOMAINTRIE_EDGES_SIZE_MIN 64
+#define DOMAINTRIE_TAGS_SIZE_MIN 64
+
+
+static int domain_trie_edges_resize(struct domain_trie *t, unsigned int size);
+
+
+static inline uint32_t
+_edge_hash(uint32_t parent, uint32_t label)
+{
+	uint64_t h;
+	
+	h = ((uint64_t)parent << 32) | label;
+	/* murmur3 64-bit finalizer */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	
+	return h;
+}
+
+/*
+ * Find an edge slot. Linear probing is used.
+ *
+ * return:
+ *   a pointer to an edge slot with the key or to an empty slot for it
+ */
+static struct domain_trie_edge*
+_edge_find(struct domain_trie *t, uint32_t parent, uint32_t label)
+{
+	struct domain_trie_edge *e;
+	unsigned int i, mask = t->edges_size - 1;
+	
+	for(i = _edge_hash(parent, label) & mask; ; i = (i + 1) & mask) {
+		e = &t->edges[i];
+		if ((!e->child) || ((e->parent == parent) && (e->label == label)))
+			return e;
+	}
+}
+
+/*
+ * Create new domain trie.
+ *
+ * return:
+ *   pointer - if everything is ok
+ *   NULL - if a memory error occured
+ */
+struct domain_trie*
+domain_trie_make(void)
+{
+	struct domain_trie *t;
+	
+	t = malloc(sizeof(*t));
+	if (!t)
+		return NULL;
+	memset(t, 0, sizeof(*t));
+	t->labels = domain_list_make();
+	if (!t->labels)
+		goto err_free_trie;
+	if (domain_trie_edges_resize(t, DOMAINTRIE_EDGES_SIZE_MIN) != 0)
+		goto err_free_labels;
+	t->tags = malloc(sizeof(*t->tags) * DOMAINTRIE_TAGS_SIZE_MIN);
+	if (!t->tags)
+		goto err_free_edges;
+	t->tags_size = DOMAINTRIE_TAGS_SIZE_MIN;
+	t->tags[0] = DOMAINTRIE_NO_TAG;
+	t->nodes_cnt = 1;
+	
+	return t;
+	
+err_free_edges:
+	free(t->edges);
+err_free_labels:
+	domain_list_free(t->labels);
+err_free_trie:
+	free(t);
+	return NULL;
+}
+
+/*
+ * Free a domain trie t.
+ *
+ * return:
+ *   0 - if everything is ok
+ *   -EINVAL - if t is NULL
+ */
+int
+domain_trie_free(struct domain_trie *t)
+{
+	if (!t)
+		return -EINVAL;
+	domain_list_free(t->labels);
+	free(t->edges);
+	free(t->tags);
+	free(t);
+	
+	return 0;
+}
+
+static int
+domain_trie_edges_resize(struct domain_trie *t, unsigned int size)
+{
+	struct domain_trie_edge *edges, *e;
+	unsigned int i, old_size;
+	
+	edges = t->edges;
+	old_size = t->edges_size;
+	t->edges = calloc(size, sizeof(*t->edges));
+	if (!t->edges) {
+		t->edges = edges;
+		return -1;
+	}
+	t->edges_size = size;
+	for(i = 0; i < old_size; i++) {
+		if (!edges[i].child)
+			continue;
+		e = _edge_find(t, edges[i].parent, edges[i].label);
+		*e = edges[i];
+	}
+	free(edges);
+	
+	return 0;
+}
+
+/*
+ * Get an interned label id.
+ * is_add - add a label, if it isn't interned yet
+ *
+ * return:
+ *   1 - a label id is placed to id
+ *   0 - a label isn't found
+ *  -1 - a memory error occured
+ */
+static int
+_label_get(struct domain_trie *t, char *label, unsigned int len,
+  unsigned int *id, int is_add)
+{
+	if (domain_list_value_exist(t->labels, label, len, label, len, id))
+		return 1;
+	if (!is_add)
+		return 0;
+	if (domain_list_add(t->labels, label, len, label, len,
+	  t->labels_cnt) < 0)
+		return -1;
+	*id = t->labels_cnt++;
+	
+	return 1;
+}
+
+/*
+ * Get a child node of a node by a label, create it if it doesn't exist.
+ *
+ * return:
+ *   >0 - a child node id
+ *   0 - a memory error occured
+ */
+static uint32_t
+_child_get(struct domain_trie *t, uint32_t parent, uint32_t label)
+{
+	struct domain_trie_edge *e;
+	uint32_t *tags;
+	
+	e = _edge_find(t, parent, label);
+	if (e->child)
+		return e->child;
+	
+	/* keep a load factor <= 1/2 */
+	if (t->nodes_cnt * 2 > t->edges_size) {
+		if (domain_trie_edges_resize(t, t->edges_size * 2) != 0)
+			return 0;
+		e = _edge_find(t, parent, label);
+	}
+	if (t->nodes_cnt == t->tags_size) {
+		tags = realloc(t->tags, sizeof(*tags) * t->tags_size * 2);
+		if (!tags)
+			return 0;
+		t->tags = tags;
+		t->tags_size *= 2;
+	}
+	t->tags[t->nodes_cnt] = DOMAINTRIE_NO_TAG;
+	e->parent = parent;
+	e->label = label;
+	e->child = t->nodes_cnt++;
+	
+	return e->child;
+}
+
+/*
+ * Add a domain to a trie. If the domain is already in the trie, a minimal
+ * tag is kept.
+ * t - a pointer to domain_trie
+ * name - a zero terminated domain name
+ * tag - a tag of an elist the domain is from
+ *
+ * return:
+ *   0 - if everything is ok
+ *  -1 - if memory error occured
+ */
+int
+domain_trie_add(struct domain_trie *t, char *name, unsigned int tag)
+{
+	char *end, *ptr;
+	unsigned int label;
+	uint32_t node = 0;
+	
+	end = name + strlen(name);
+	while (end != name) {
+		for(ptr = end; (ptr != name) && (*(ptr - 1) != '.'); ptr--);
+		/* skip empty labels */
+		if (ptr != end) {
+			if (_label_get(t, ptr, end - ptr, &label, 1) < 0)
+				return -1;
+			node = _child_get(t, node, label);
+			if (!node)
+				return -1;
+		}
+		end = (ptr == name) ? ptr : ptr - 1;
+	}
+	if (!node)
+		return 0;
+	if (t->tags[node] == DOMAINTRIE_NO_TAG)
+		t->len++;
+	if ((t->tags[node] == DOMAINTRIE_NO_TAG) || (tag < t->tags[node]))
+		t->tags[node] = tag;
+	
+	return 0;
+}
+
+/*
+ * Check if a domain or any its parent domain is in a trie. Labels are
+ * processed once from the right to the left.
+ * t - a pointer to domain_trie
+ * name - a domain name(not null terminated)
+ * len - a name length
+ * tag - a pointer to place a minimal tag of the found domains
+ *
+ * return:
+ *   1 - a domain is found
+ *   0 - a domain isn't found
+ */
+int
+domain_trie_match(struct domain_trie *t, char *name, unsigned int len,
+  unsigned int *tag)
+{
+	struct domain_trie_edge *e;
+	char *end, *ptr;
+	unsigned int label;
+	uint32_t node = 0;
+	int ret = 0;
+	
+	if (!t->len)
+		return 0;
+	end = name + len;
+	while (end != name) {
+		for(ptr = end; (ptr != name) && (*(ptr - 1) != '.'); ptr--);
+		if (ptr != end) {
+			if (!_label_get(t, ptr, end - ptr, &label, 0))
+				break;
+			e = _edge_find(t, node, label);
+			if (!e->child)
+				break;
+			node = e->child;
+			if ((t->tags[node] != DOMAINTRIE_NO_TAG) &&
+			  ((!ret) || (t->tags[node] < *tag))) {
+				*tag = t->tags[node];
+				ret = 1;
+			}
+		}
+		end = (ptr == name) ? ptr : ptr - 1;
+	}
+	
+	return ret;
+}
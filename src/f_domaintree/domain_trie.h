@@ -0,0 +1,82 @@
+#ifndef __DOMAINTRIE_H__
+#define __DOMAINTRIE_H__
+
+#include <stdint.h>
+#include "domain_list.h"
+
+
+/*
+ * A domain trie over reversed labels(from TLD to the left). Labels are
+ * interned into a domain list(a label id is kept as a tag) and trie edges
+ * are kept in one hash table keyed by (parent node id, label id). The root
+ * node id is 0.
+ */
+struct domain_trie_edge {
+	uint32_t parent;
+	uint32_t label;
+	/* 0 - an empty slot */
+	uint32_t child;
+};
+
+struct domain_trie {
+	struct domain_list *labels;
+	unsigned int labels_cnt;
+	struct domain_trie_edge *edges;
+	/* edges slots number(a power of 2) */
+	unsigned int edges_size;
+	/* nodes number(including the root) */
+	unsigned int nodes_cnt;
+	/* a tag of an entry ending at a node or DOMAINTRIE_NO_TAG */
+	uint32_t *tags;
+	unsigned int tags_size;
+	/* entries number */
+	unsigned int len;
+};
+
+#define DOMAINTRIE_NO_TAG 0xffffffff
+
+
+/*
+ * Create new domain trie.
+ *
+ * return:
+ *   pointer - if everything is ok
+ *   NULL - if a memory error occured
+ */
+struct domain_trie* domain_trie_make(void);
+/*
+ * Free a domain trie t.
+ *
+ * return:
+ *   0 - if everything is ok
+ *   -EINVAL - if t is NULL
+ */
+int domain_trie_free(struct domain_trie *t);
+/*
+ * Add a domain to a trie. If the domain is already in the trie, a minimal
+ * tag is kept.
+ * t - a pointer to domain_trie
+ * name - a zero terminated domain name
+ * tag - a tag of an elist the domain is from
+ *
+ * return:
+ *   0 - if everything is ok
+ *  -1 - if memory error occured
+ */
+int domain_trie_add(struct domain_trie *t, char *name, unsigned int tag);
+/*
+ * Check if a domain or any its parent domain is in a trie. Labels are
+ * processed once from the right to the left.
+ * t - a pointer to domain_trie
+ * name - a domain name(not null terminated)
+ * len - a name length
+ * tag - a pointer to place a minimal tag of the found domains
+ *
+ * return:
+ *   1 - a domain is found
+ *   0 - a domain isn't found
+ */
+int domain_trie_match(struct domain_trie *t, char *name, unsigned int len, unsigned int *tag);
+
+
+#endif /* __DOMAINTRIE_H__ */
@@ -24,10 +24,7 @@
 #include "util.h"
 #include "pkt/pkt.h"
 #include "filters.h"
-#include "domain_list.h"
-
-
-static int is_domain_match(struct domain_list *domainlist, char *name);
+#include "domain_trie.h"
 
 
 static int
@@ -39,15 +36,15 @@ init(void)
 static int
 list_make(void **list)
 {
-	struct domain_list *domainlist;
+	struct domain_trie *trie;
 
-	domainlist = domain_list_make();
-	if (!domainlist) {
+	trie = domain_trie_make();
+	if (!trie) {
 		ERR_OUT("domain-tree: can't allocate memory for list");
 		return -1;
 	}
 	
-	*list = domainlist;
+	*list = trie;
 	
 	return 0;
 }
@@ -55,9 +52,9 @@ list_make(void **list)
 static int
 flist_free(void *list)
 {
-	struct domain_list *domainlist = list;
+	struct domain_trie *trie = list;
 	
-	if (domain_list_free(domainlist) != 0)
+	if (domain_trie_free(trie) != 0)
 		ERR_OUT("domain-tree: error on list free");
 	
 	return 0;
@@ -69,6 +66,7 @@ flist_free(void *list)
  * list - a pointer to a list
  * fields - a pointer to array of strings
  * n - number of strings in array
+ * tag - a tag of an elist the entry is from
  *
  * return:
  *   1 - entry is not processible by this filter - ignored
@@ -76,9 +74,10 @@ flist_free(void *list)
  *  <0 - an error occured
  */
 static int
-list_entry_add(void *list, char **fields, unsigned int n)
+list_entry_add(void *list, char **fields, unsigned int n,
+  unsigned int tag)
 {
-	struct domain_list *domainlist = list;
+	struct domain_trie *trie = list;
 	char buf[260];
 	unsigned int len, off = 0;
 	
@@ -99,7 +98,7 @@ list_entry_add(void *list, char **fields, unsigned int n)
 			len++;
 		memcpy(buf, fields[1] + off, len);
 		normalize_domain_name(buf);
-		if (!domain_list_add(domainlist, buf, len, buf, len)) {
+		if (domain_trie_add(trie, buf, tag) < 0) {
 			ERR_OUT("domain-tree: domain add error: %s: no memory", buf);
 			return -1;
 		}
@@ -112,32 +111,36 @@ list_entry_add(void *list, char **fields, unsigned int n)
 static int
 list_stat_out(void *list)
 {
-	struct domain_list *domainlist = list;
+	struct domain_trie *trie = list;
 	
-	INFO_OUT("f_domaintree: list entries %u", domainlist->len);
+	INFO_OUT("f_domaintree: list entries %u(labels %u, nodes %u)", trie->len,
+	  trie->labels_cnt, trie->nodes_cnt);
 	
 	return 0;
 }
 
 static int
-filter_pkt(void *list, struct pkt *pkt)
+filter_pkt(void *list, struct pkt *pkt, unsigned int *tag)
 {
-	struct domain_list *domainlist = list;
+	struct domain_trie *trie = list;
 	struct pkt_nfq *pkt_nfq;
 	struct list_item_head *lh;
 	struct conn_domain *domain;
-	int ret;
+	unsigned int t;
+	int ret = 0;
 	
 	pkt_nfq = (struct pkt_nfq*)pkt;
 	if (!pkt_nfq->domain)
 		return 0;
 	list_for_each(lh, &pkt_nfq->domain->list) {
 		domain = list_item(lh, struct conn_domain, list);
-		ret = is_domain_match(domainlist, domain->name);
-		if (ret)
-			return 1;
+		if (!domain_trie_match(trie, domain->name, domain->len, &t))
+			continue;
+		if ((!ret) || (t < *tag))
+			*tag = t;
+		ret = 1;
 	}
-	return 0;
+	return ret;
 }
 
 struct filter filter_f_domaintree = {
@@ -147,23 +150,7 @@ struct filter filter_f_domaintree = {
 	flist_free,
 	list_entry_add,
 	list_stat_out,
-	filter_pkt
+	filter_pkt,
+	NULL,
+	PKT_ATTR_DOMAIN
 };
-
-static int
-is_domain_match(struct domain_list *domainlist, char *name)
-{
-	int ret, len;
-	char *ptr = name + strlen(name);
-	
-	if (ptr == name)
-		return 0;
-	len = 1;
-	do {
-		for(ptr--, len++; (ptr != name) && (*(ptr - 1) != '.'); ptr--, len++);
-		ret = domain_list_value_exist(domainlist, ptr, len, ptr, len);
-		if (ret)
-			return 1;
-	} while (ptr != name);
-	return 0;
-}
@@ -17,10 +17,13 @@
  */
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
 #include "main.h"
 #include "log.h"
 #include "pkt/pkt.h"
 #include "pkt/pkt_ip.h"
+#include "pkt/pkt_ip6.h"
 #include "filters.h"
 #include "ipsrv_list.h"
 #include "ipprotos.h"
@@ -30,8 +33,8 @@ static struct ipproto *ipprotos[256];
 
 
 static int _parse_ip(char *str, uint32_t *addr, uint8_t *mask);
+static int _parse_ip6(char *str, uint8_t *addr, uint8_t *mask);
 static uint8_t _parse_proto(char *str);
-static unsigned int _make_value(uint32_t ip, uint8_t proto, uint8_t *out);
 
 
 static int
@@ -48,23 +51,13 @@ init(void)
 static int
 list_make(void **list)
 {
-	int i;
-	struct ipsrv_list **iplist;
+	struct ipsrv_list *iplist;
 	
-	iplist = malloc(sizeof(*iplist) * 32);
+	iplist = ipsrv_list_make();
 	if (!iplist) {
 		ERR_OUT("ip-srv: can't allocate memory for ip list");
 		return -1;
 	}
-		
-	for(i = 0; i < 32; i++) {
-		iplist[i] = ipsrv_list_make();
-		if (!iplist[i]) {
-			ERR_OUT("ip-srv: can't allocate memory for ip list");
-			free(iplist);
-			return -1;
-		}
-	}
 	
 	*list = iplist;
 	
@@ -74,13 +67,8 @@ list_make(void **list)
 static int
 flist_free(void *list)
 {
-	int i;
-	struct ipsrv_list **iplist = list;
-	
-	for(i = 0; i < 32; i++)
-		if (ipsrv_list_free(iplist[i]) != 0)
-			ERR_OUT("ip-srv: error on list free");
-	free(iplist);
+	if (ipsrv_list_free(list) != 0)
+		ERR_OUT("ip-srv: error on list free");
 	
 	return 0;
 }
@@ -91,6 +79,7 @@ flist_free(void *list)
  * list - a pointer to a list
  * fields - a pointer to array of strings
  * n - number of strings in array
+ * tag - a tag of an elist the entry is from
  *
  * return:
  *   1 - entry is not processible by this filter - ignored
@@ -98,34 +87,40 @@ flist_free(void *list)
  *  -1 - error occured
  */
 static int
-list_entry_add(void *list, char **fields, unsigned int n)
+list_entry_add(void *list, char **fields, unsigned int n,
+  unsigned int tag)
 {
-	struct ipsrv_list **iplist = list;
+	struct ipsrv_list *iplist = list;
+	struct ipsrv_list_rule rule;
 	uint32_t ip;
-	uint8_t proto = 0, mask;
-	uint8_t value[IPSRVLIST_VALUE_SIZE];
-	unsigned int value_size;
-	int ret;
+	uint8_t ip6[16], mask;
+	int ret, is_ip6;
 	
 	if (strcmp(fields[0], "ip-srv") != 0)
 		return 1;
-	ret = _parse_ip(fields[1], &ip, &mask);
+	is_ip6 = strchr(fields[1], ':') != NULL;
+	if (is_ip6)
+		ret = _parse_ip6(fields[1], ip6, &mask);
+	else
+		ret = _parse_ip(fields[1], &ip, &mask);
 	if (ret < 0)
 		return ret;
+	memset(&rule, 0, sizeof(rule));
+	rule.tag = tag;
 	if (n > 2)
-		proto = _parse_proto(fields[2]);
-	ip = (ip >> (32 - mask)) << (32 - mask);
-	value_size = _make_value(ip, proto, value);
+		rule.proto = _parse_proto(fields[2]);
+	if (!is_ip6)
+		ip = (ip >> (32 - mask)) << (32 - mask);
 	if (n > 3) {
-		if (ipprotos[proto]) {
-			ret = ipprotos[proto]->make_value(&fields[3], n - 3,
-			  value + value_size, IPSRVLIST_VALUE_SIZE - value_size);
+		if (ipprotos[rule.proto]) {
+			ret = ipprotos[rule.proto]->make_value(&fields[3], n - 3,
+			  &rule.from, &rule.to);
 			if (ret < 0) {
 				ERR_OUT("ip-srv: protocol %d module making value error",
-				  proto);
+				  rule.proto);
 				return -1;
 			}
-			value_size += ret;
+			rule.is_ranged = 1;
 		} else {
 			ERR_OUT("ip-srv: no module to process '%s:%s:%s:...' entry. "
 			  "Fallback to filtering by ip & proto.", fields[0], fields[1],
@@ -133,11 +128,32 @@ list_entry_add(void *list, char **fields, unsigned int n)
 		}
 		
 	}
-	if (!ipsrv_list_add(iplist[mask - 1], value, value_size, value, 4)) {
-		ERR_OUT("ip-srv: ip-srv add error: %u:%hhu:...: no memory", ip, proto);
+	if (is_ip6) {
+		if (ipsrv_list_add6(iplist, ip6, mask, &rule) < 0) {
+			ERR_OUT("ip-srv: ip-srv add error: %s:%hhu:...: no memory",
+			  fields[1], rule.proto);
+			return -1;
+		}
+		DBG_OUT("ip-srv: add ip-srv %s:%hhu:%hu-%hu", fields[1], rule.proto,
+		  rule.from, rule.to);
+	} else if (ipsrv_list_add(iplist, ip, mask, &rule) < 0) {
+		ERR_OUT("ip-srv: ip-srv add error: %u:%hhu:...: no memory", ip,
+		  rule.proto);
 		return -1;
 	} else {
-		DBG_OUT("ip-srv: add ip-srv %u:%hhu:...", ip, proto);
+		DBG_OUT("ip-srv: add ip-srv %u/%hhu:%hhu:%hu-%hu", ip, mask,
+		  rule.proto, rule.from, rule.to);
+	}
+	
+	return 0;
+}
+
+static int
+list_build(void *list)
+{
+	if (ipsrv_list_build(list) < 0) {
+		ERR_OUT("ip-srv: can't build ip list: no memory");
+		return -1;
 	}
 	
 	return 0;
@@ -146,62 +162,50 @@ list_entry_add(void *list, char **fields, unsigned int n)
 static int
 list_stat_out(void *list)
 {
-	struct ipsrv_list **iplist = list;
-	int i, is_empty = 1;
+	struct ipsrv_list *iplist = list;
 	
-	for(i = 0; i < 32; i++)
-		if (iplist[i]->len > 0) {
-			INFO_OUT("f_ipsrv: /%u list entries %u", i + 1, iplist[i]->len);
-			is_empty = 0;
-		}
-	/* show something to understand that filter works */
-	if (is_empty)
-		INFO_OUT("f_ipsrv: list entries 0");
+	INFO_OUT("f_ipsrv: list entries %u, lpm nodes %u, ipv6 lpm nodes %u, "
+	  "services sets %u (descriptors %u, ranges %u)", iplist->len,
+	  iplist->lpm->nodes_cnt, iplist->lpm6 ? iplist->lpm6->nodes_cnt : 0,
+	  iplist->sets_cnt, iplist->svcs_cnt, iplist->ranges_cnt);
 	
 	return 0;
 }
 
 static int
-filter_pkt(void *list, struct pkt *pkt)
+filter_pkt(void *list, struct pkt *pkt, unsigned int *tag)
 {
-	struct ipsrv_list **iplist = list;
-	uint8_t value[IPSRVLIST_VALUE_SIZE];
-	uint32_t addr;
-	unsigned int value_size;
-	struct pkt_ip *pkt_ip;
-	//unsigned int pkt_id;
-	int ret, i;
+	struct ipsrv_list *iplist = list;
+	struct pkt *pkt_l3;
+	uint16_t value = 0;
+	uint8_t proto;
+	int has_value = 0;
 	
-	//pkt_id = get_pkt_id(pkt);
-	pkt = get_next_pkt(pkt);
-	if (!pkt)
+	pkt_l3 = get_next_pkt(pkt);
+	if (!pkt_l3)
 		return 0;
-	if (pkt->pkt_type != pkt_type_ip)
+	if (pkt_l3->pkt_type == pkt_type_ip)
+		proto = ((struct pkt_ip*)pkt_l3)->proto;
+	else if (pkt_l3->pkt_type == pkt_type_ip6)
+		proto = ((struct pkt_ip6*)pkt_l3)->proto;
+	else
 		return 0;
-	pkt_ip = (struct pkt_ip*)pkt;
 	
-	for(i = 0; i < 32; i++) {
-		if (iplist[i]->len == 0)
-			continue;
-		addr = (pkt_ip->daddr >> (32 - (i + 1))) << (32 - (i + 1));
-		value_size = _make_value(addr, pkt_ip->proto, value);
-		pkt = get_next_pkt((struct pkt*)pkt_ip);
-		if ((pkt) && (ipprotos[pkt_ip->proto])) {
-			ret = ipprotos[pkt_ip->proto]->make_value2(pkt,
-			  value + value_size, IPSRVLIST_VALUE_SIZE - value_size);
-			if (ret < 0) {
-				ERR_OUT("ip-srv: protocol %d module making value2 error",
-				  pkt_ip->proto);
-				return 0;
-			}
-			value_size +=ret;
+	pkt = get_next_pkt(pkt_l3);
+	if ((pkt) && (ipprotos[proto])) {
+		if (ipprotos[proto]->make_value2(pkt, &value) < 0) {
+			ERR_OUT("ip-srv: protocol %d module making value2 error",
+			  proto);
+			return 0;
 		}
-		ret = ipsrv_list_value_exist(iplist[i], value, value_size, value, 4);
-		if (ret)
-			return ret;
+		has_value = 1;
 	}
 	
-	return 0;
+	if (pkt_l3->pkt_type == pkt_type_ip6)
+		return ipsrv_list_value_exist6(iplist,
+		  ((struct pkt_ip6*)pkt_l3)->daddr, proto, has_value, value, tag);
+	return ipsrv_list_value_exist(iplist, ((struct pkt_ip*)pkt_l3)->daddr,
+	  proto, has_value, value, tag);
 }
 
 struct filter filter_f_ipsrv = {
@@ -211,7 +215,9 @@ struct filter filter_f_ipsrv = {
 	flist_free,
 	list_entry_add,
 	list_stat_out,
-	filter_pkt
+	filter_pkt,
+	list_build,
+	PKT_ATTR_ADDR | PKT_ATTR_PORT
 };
 
 static int
@@ -265,6 +271,45 @@ _parse_ip(char *str, uint32_t *addr, uint8_t *mask)
 	return 0;
 }
 
+/*
+ * Parse an ipv6 prefix ADDR[/LEN]. Bits after a prefix length are
+ * cleared.
+ */
+static int
+_parse_ip6(char *str, uint8_t *addr, uint8_t *mask)
+{
+	unsigned long int n;
+	char buf[INET6_ADDRSTRLEN], *s, *e;
+	unsigned int i;
+	
+	s = strchr(str, '/');
+	i = s ? s - str : strlen(str);
+	if (i >= sizeof(buf)) {
+		ERR_OUT("ip-srv: wrong ipv6 prefix format: %s", str);
+		return -2;
+	}
+	memcpy(buf, str, i);
+	buf[i] = '\0';
+	if (inet_pton(AF_INET6, buf, addr) != 1) {
+		ERR_OUT("ip-srv: wrong ipv6 prefix format: %s", str);
+		return -2;
+	}
+	
+	*mask = 128;
+	if (s) {
+		n = strtoul(s + 1, &e, 10);
+		if ((e == s + 1) || (*e != '\0') || (n > 128) || (n < 1)) {
+			ERR_OUT("ip-srv: wrong ipv6 prefix format: %s", str);
+			return -2;
+		}
+		*mask = n;
+	}
+	for(i = *mask; i < 128; i++)
+		addr[i >> 3] &= ~(0x80 >> (i & 7));
+	
+	return 0;
+}
+
 static uint8_t
 _parse_proto(char *str)
 {
@@ -279,21 +324,3 @@ _parse_proto(char *str)
 	
 	return (uint8_t)n;
 }
-
-static unsigned int
-_make_value(uint32_t ip, uint8_t proto, uint8_t *out)
-{
-	unsigned int len = 0;
-	uint32_t *i32;
-	
-	i32 = (uint32_t*)out;
-	*i32 = ip;
-	len = 4;
-	if (!proto)
-		goto out;
-	*(out + len) = proto;
-	len++;
-
-out:
-	return len;
-}
@@ -21,42 +21,48 @@
 #include "pkt/pkt.h"
 #include "pkt/pkt_icmp.h"
 #include "filters.h"
-#include "ipsrv_list.h"
 #include "ipprotos.h"
 
 
-static uint8_t _parse_type(char *str);
-static uint8_t _parse_code(char *str);
-static unsigned int _make_value(uint8_t type, uint8_t code, uint8_t *out);
+static int _parse_byte(char *str, char *name, uint8_t *n);
 
 
+/*
+ * Parse TYPE[:CODE]. A value is type(high byte):code(low byte), so TYPE
+ * alone is a range of all its codes. Type 0 means any type and code 0
+ * means any code.
+ */
 static int
-make_value(char **fields, unsigned int n, uint8_t *value,
-  unsigned int value_size)
+make_value(char **fields, unsigned int n, uint16_t *from, uint16_t *to)
 {
-	uint8_t type = 0;
-	uint8_t code = 0;
+	uint8_t type, code = 0;
 	
-	if (n == 0)
-		return 0;
-	if (n > 0)
-		type = _parse_type(fields[0]);
-	if (n > 1)
-		code = _parse_code(fields[1]);
-	value_size = _make_value(type, code, value);
+	if (_parse_byte(fields[0], "type", &type) < 0)
+		return -1;
+	if ((n > 1) && (_parse_byte(fields[1], "code", &code) < 0))
+		return -1;
+	if (!type) {
+		*from = 0;
+		*to = 0xffff;
+	} else if (!code) {
+		*from = type << 8;
+		*to = *from | 0xff;
+	} else {
+		*from = (type << 8) | code;
+		*to = *from;
+	}
 	
-	return value_size;
+	return 0;
 }
 
 static int
-make_value2(struct pkt *pkt, uint8_t *value, unsigned int value_size)
+make_value2(struct pkt *pkt, uint16_t *value)
 {
 	struct pkt_icmp *pkt_icmp;
 	
 	pkt_icmp = (struct pkt_icmp*)pkt;
-	value_size = _make_value(pkt_icmp->type,
-	  pkt_icmp->code, value);
-	return value_size;
+	*value = (pkt_icmp->type << 8) | pkt_icmp->code;
+	return 0;
 }
 
 struct ipproto ipproto_icmp = {
@@ -66,50 +72,18 @@ struct ipproto ipproto_icmp = {
 	make_value2
 };
 
-static uint8_t
-_parse_type(char *str)
-{
-	unsigned long int n;
-	char *e;
-	
-	n = strtoul(str, &e, 10);
-	if ((*e != '\0') || (n > 255)) {
-		ERR_OUT("Wrong icmp type format: %s", str);
-		exit(EXIT_FAILURE);
-	}
-	
-	return (uint8_t)n;
-}
-
-static uint8_t
-_parse_code(char *str)
+static int
+_parse_byte(char *str, char *name, uint8_t *n)
 {
-	unsigned long int n;
+	unsigned long int v;
 	char *e;
 	
-	n = strtoul(str, &e, 10);
-	if ((*e != '\0') || (n > 255)) {
-		ERR_OUT("Wrong icmp code format: %s", str);
-		exit(EXIT_FAILURE);
+	v = strtoul(str, &e, 10);
+	if ((e == str) || (*e != '\0') || (v > 255)) {
+		ERR_OUT("Wrong icmp %s format: %s", name, str);
+		return -1;
 	}
+	*n = v;
 	
-	return (uint8_t)n;
-}
-
-static unsigned int
-_make_value(uint8_t type, uint8_t code, uint8_t *out)
-{
-	unsigned int len = 0;
-
-	if (!type)
-		goto out;
-	*out = type;
-	len++;
-	if (!code)
-		goto out;
-	*(out + len) = code;
-	len++;
-
-out:
-	return len;
+	return 0;
 }
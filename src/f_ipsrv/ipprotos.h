@@ -3,13 +3,19 @@
 
 #include "pkt/pkt.h"
 
+/*
+ * A protocol module makes a 16-bit value of a protocol data(e.g. a port):
+ * make_value() parses PROTO_DATA entry fields to an inclusive range of
+ * values and make_value2() gets a value of a packet. Both return 0 on
+ * success and <0 on error.
+ */
 struct ipproto {
 	char *name;
 	unsigned char idx;
-	int (*make_value)(char **fields, unsigned int n, uint8_t *value, unsigned int value_size);
-	int (*make_value2)(struct pkt *pkt, uint8_t *value, unsigned int value_size);
+	int (*make_value)(char **fields, unsigned int n, uint16_t *from, uint16_t *to);
+	int (*make_value2)(struct pkt *pkt, uint16_t *value);
 };
 
 extern struct ipproto *ipprotos_list[];
 
-#endif /* __IPPROTOS_H__ */
\ No newline at end of file
+#endif /* __IPPROTOS_H__ */
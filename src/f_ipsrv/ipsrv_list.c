@@ -23,38 +23,46 @@
 #include "ipsrv_list.h"
 
 
-static void ipsrv_list_item_free(struct ipsrv_list_item *item);
-static struct ipsrv_list_item* ipsrv_list_item_make(uint8_t *value, unsigned int value_size, uint8_t *value_for_key, unsigned int vfk_size);
-static struct ipsrv_list_item_value* ipsrv_list_item_value_make(uint8_t *value, unsigned int size);
+#define BIT_SET(bm, n) ((bm)[(n) >> 6] |= 1ULL << ((n) & 63))
+#define BIT_TEST(bm, n) ((bm)[(n) >> 6] & (1ULL << ((n) & 63)))
 
 
-static uint32_t
-jenkins_one_at_a_time_hash(const uint8_t* key, size_t length)
+/*
+ * Make sure an array has a room for one more element.
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ */
+static int
+_array_grow(void **a, unsigned int *size, unsigned int cnt, size_t esize)
 {
-	size_t i = 0;
-	uint32_t hash = 0;
+	void *p;
+	unsigned int new_size;
 	
-	while (i != length) {
-		hash += key[i++];
-		hash += hash << 10;
-		hash ^= hash >> 6;
-	}
-	hash += hash << 3;
-	hash ^= hash >> 11;
-	hash += hash << 15;
-	return hash;
+	if (cnt < *size)
+		return 0;
+	new_size = *size ? *size * 2 : 64;
+	p = realloc(*a, esize * new_size);
+	if (!p)
+		return -1;
+	*a = p;
+	*size = new_size;
+	
+	return 0;
 }
 
-static unsigned int
-ipsrv_list_gen_key(uint8_t *value, unsigned int size)
+static void
+_addr_to_key(uint32_t addr, uint8_t *key)
 {
-	return jenkins_one_at_a_time_hash(value, size);
+	key[0] = addr >> 24;
+	key[1] = addr >> 16;
+	key[2] = addr >> 8;
+	key[3] = addr;
 }
 
 /*
- * Create new ip list with name of name.
- *
- * name - name of the list.
+ * Create new ip list.
  *
  * return:
  *   pointer - if everything is ok
@@ -69,19 +77,15 @@ ipsrv_list_make(void)
 	if (!l)
 		return NULL;
 	memset(l, 0, sizeof(*l));
+	l->lpm = lpm_make(32);
+	if (!l->lpm) {
+		free(l);
+		return NULL;
+	}
 	
 	return l;
 }
 
-static void
-_ipsrv_list_free_item(struct avltree_node_head *h)
-{
-	struct ipsrv_list_item *item;
-	
-	item = avltree_node(h, struct ipsrv_list_item, tree);
-	ipsrv_list_item_free(item);
-}
-
 /*
  * Free an ip list l.
  *
@@ -96,156 +100,400 @@ ipsrv_list_free(struct ipsrv_list *l)
 {
 	if (!l)
 		return -EINVAL;
-	if (l->first)
-		avltree_for_each_after(&(l->first->tree), _ipsrv_list_free_item);
+	lpm_free(l->lpm);
+	if (l->lpm6)
+		lpm_free(l->lpm6);
+	free(l->prefixes);
+	free(l->rules);
+	free(l->sets);
+	free(l->svcs);
+	free(l->ranges);
 	free(l);
 	
 	return 0;
 }
 
-static void
-ipsrv_list_item_value_free(struct ipsrv_list_item_value *v)
+/*
+ * Add a prefix to a list.
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ */
+static int
+_ipsrv_list_prefix_add(struct ipsrv_list *l, int is_ip6, const uint8_t *key,
+  uint8_t plen, struct ipsrv_list_rule *rule)
 {
-	free(v);
+	struct ipsrv_list_prefix *p;
+	
+	if (_array_grow((void**)&l->prefixes, &l->prefixes_size,
+	  l->prefixes_cnt, sizeof(*l->prefixes)) < 0)
+		return -1;
+	p = &l->prefixes[l->prefixes_cnt++];
+	memset(p, 0, sizeof(*p));
+	p->is_ip6 = is_ip6;
+	memcpy(p->key, key, is_ip6 ? 16 : 4);
+	p->plen = plen;
+	p->rule = *rule;
+	l->len++;
+	
+	return 0;
 }
 
-static void
-ipsrv_list_item_free(struct ipsrv_list_item *item)
+/*
+ * Add a service rule for a prefix. The rule takes effect only after
+ * ipsrv_list_build().
+ *
+ * l - a pointer to ipsrv_list
+ * addr - a prefix address(host byte order, bits after plen are 0)
+ * plen - a prefix length(1-32)
+ * rule - a rule to add
+ *
+ * return:
+ *   0 - if everything is ok
+ *  -1 - if memory error occured
+ */
+int
+ipsrv_list_add(struct ipsrv_list *l, uint32_t addr, uint8_t plen,
+  struct ipsrv_list_rule *rule)
 {
-	struct list_item_head *h;
-	struct ipsrv_list_item_value *v;
+	uint8_t key[4];
+	
+	_addr_to_key(addr, key);
+	
+	return _ipsrv_list_prefix_add(l, 0, key, plen, rule);
+}
 
-	if (item->values) {	
-		h = &(item->values->list);
-		while (h) {
-			v = list_item(h, struct ipsrv_list_item_value, list);
-			h = h->next;
-			ipsrv_list_item_value_free(v);
-		}
+/*
+ * Add a service rule for an ipv6 prefix. The rule takes effect only after
+ * ipsrv_list_build().
+ *
+ * l - a pointer to ipsrv_list
+ * addr - a prefix address(16 bytes, network byte order, bits after plen
+ *        are 0)
+ * plen - a prefix length(1-128)
+ * rule - a rule to add
+ *
+ * return:
+ *   0 - if everything is ok
+ *  -1 - if memory error occured
+ */
+int
+ipsrv_list_add6(struct ipsrv_list *l, const uint8_t *addr, uint8_t plen,
+  struct ipsrv_list_rule *rule)
+{
+	if (!l->lpm6) {
+		l->lpm6 = lpm_make(128);
+		if (!l->lpm6)
+			return -1;
 	}
-	free(item);
+	
+	return _ipsrv_list_prefix_add(l, 1, addr, plen, rule);
+}
+
+static int
+_prefix_cmp(const void *a, const void *b)
+{
+	const struct ipsrv_list_prefix *pa = a, *pb = b;
+	
+	if (pa->is_ip6 != pb->is_ip6)
+		return pa->is_ip6 < pb->is_ip6 ? -1 : 1;
+	if (pa->plen != pb->plen)
+		return pa->plen < pb->plen ? -1 : 1;
+	return memcmp(pa->key, pb->key, sizeof(pa->key));
 }
 
 static int
-_ipsrv_list_add_cb(struct avltree_node_head *new, struct avltree_node_head *e)
+_rule_cmp(const void *a, const void *b)
 {
-	struct ipsrv_list_item *item_new, *item_e;
+	const struct ipsrv_list_rule *ra = a, *rb = b;
 	
-	item_new = avltree_node(new, struct ipsrv_list_item, tree);
-	item_e = avltree_node(e, struct ipsrv_list_item, tree);
-	list_add(&(item_new->values->list), &(item_e->values->list));
+	if (ra->tag != rb->tag)
+		return ra->tag < rb->tag ? -1 : 1;
+	if (ra->proto != rb->proto)
+		return ra->proto < rb->proto ? -1 : 1;
+	if (ra->from != rb->from)
+		return ra->from < rb->from ? -1 : 1;
+	return 0;
+}
+
+static int
+_ipsrv_list_rule_add(struct ipsrv_list *l, struct ipsrv_list_rule *rule)
+{
+	struct ipsrv_list_rule r = *rule;
 	
-	return 1;
+	/* rule can point to the rules array itself */
+	if (_array_grow((void**)&l->rules, &l->rules_size, l->rules_cnt,
+	  sizeof(*l->rules)) < 0)
+		return -1;
+	l->rules[l->rules_cnt++] = r;
+	
+	return 0;
 }
 
 /*
- * Add specified ip to a specified ipsrv_list.
- *
- * l - a pointer to ipsrv_list
- * value - a value to add
- * value_for_key - a value for key generation
+ * Add a rule to the last service descriptor.
  *
  * return:
- *   pointer - a pointer to struct ipsrv_list_item_value with new ip
- *   NULL - if memory error occured or value too large
+ *   0 - everything is ok
+ *  -1 - a memory error occured
  */
-struct ipsrv_list_item_value*
-ipsrv_list_add(struct ipsrv_list *l, uint8_t *value, unsigned int value_size,
-  uint8_t *value_for_key, unsigned int vfk_size)
+static int
+_ipsrv_list_svc_rule_add(struct ipsrv_list *l, struct ipsrv_list_rule *r)
 {
-	struct ipsrv_list_item *item;
-	struct ipsrv_list_item_value *v;
-	struct avltree_node_head *new_root = &(l->first->tree);
-	int ret;
+	struct ipsrv_list_svc *svc;
+	struct ipsrv_list_range *range;
 	
-	if (value_size > IPSRVLIST_VALUE_SIZE)
-		return NULL;
-	item = ipsrv_list_item_make(value, value_size, value_for_key, vfk_size);
-	if (!item)
-		return NULL;
-	v = item->values;
-	
-	if (!l->first) {
-		l->first = item;
-	} else {
-		ret = avltree_add(&(item->tree), &(l->first->tree), _ipsrv_list_add_cb,
-		  &new_root);
-		if (ret == 1) {
-			item->values = NULL;
-			ipsrv_list_item_free(item);
-		} else if (ret != 0) {
-			ipsrv_list_item_free(item);
-			return NULL;
-		}
-		l->first = avltree_node(new_root, struct ipsrv_list_item, tree);
+	svc = &l->svcs[l->svcs_cnt - 1];
+	if (!r->is_ranged) {
+		if (r->proto)
+			BIT_SET(svc->protos, r->proto);
+		else
+			svc->is_any = 1;
+		return 0;
 	}
 	
-	l->len++;
+	/* rules are sorted by proto and from - merge with the previous range
+	 * if they are overlapped or adjacent */
+	if (svc->ranges_cnt) {
+		range = &l->ranges[l->ranges_cnt - 1];
+		if ((range->proto == r->proto) && (r->from <= range->to + 1)) {
+			if (r->to > range->to)
+				range->to = r->to;
+			return 0;
+		}
+	}
+	if (_array_grow((void**)&l->ranges, &l->ranges_size, l->ranges_cnt,
+	  sizeof(*l->ranges)) < 0)
+		return -1;
+	range = &l->ranges[l->ranges_cnt++];
+	range->proto = r->proto;
+	range->from = r->from;
+	range->to = r->to;
+	BIT_SET(svc->ranged_protos, r->proto);
+	svc->ranges_cnt++;
 	
-	return v;
+	return 0;
 }
 
-static struct ipsrv_list_item*
-ipsrv_list_item_make(uint8_t *value, unsigned int value_size,
-  uint8_t *value_for_key, unsigned int vfk_size)
+/*
+ * Compile rules of a set to service descriptors(one per tag).
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ */
+static int
+_ipsrv_list_set_compile(struct ipsrv_list *l, struct ipsrv_list_set *s)
 {
-	struct ipsrv_list_item *item;
-
-	item = malloc(sizeof(*item));
-	if (!item)
-		return NULL;
-	memset(item, 0, sizeof(*item));
-	avltree_node_head_init(&(item->tree));
-	item->values = ipsrv_list_item_value_make(value, value_size);
-	if (!item->values) {
-		free(item);
-		return NULL;
-	}
+	struct ipsrv_list_rule *r;
+	struct ipsrv_list_svc *svc;
+	unsigned int i;
 	
-	item->tree.key = ipsrv_list_gen_key(value_for_key, vfk_size);
+	r = &l->rules[s->rules_first];
+	qsort(r, s->rules_cnt, sizeof(*r), _rule_cmp);
+	s->svcs_first = l->svcs_cnt;
+	for(i = 0; i < s->rules_cnt; i++) {
+		if ((!i) || (r[i].tag != r[i - 1].tag)) {
+			if (_array_grow((void**)&l->svcs, &l->svcs_size, l->svcs_cnt,
+			  sizeof(*l->svcs)) < 0)
+				return -1;
+			svc = &l->svcs[l->svcs_cnt++];
+			memset(svc, 0, sizeof(*svc));
+			svc->tag = r[i].tag;
+			svc->ranges_first = l->ranges_cnt;
+		}
+		if (_ipsrv_list_svc_rule_add(l, &r[i]) < 0)
+			return -1;
+	}
+	s->svcs_cnt = l->svcs_cnt - s->svcs_first;
 	
-	return item;
+	return 0;
 }
 
-static struct ipsrv_list_item_value*
-ipsrv_list_item_value_make(uint8_t *value, unsigned int size)
+/*
+ * Make a services set for prefixes from p to p + n(the same prefix) and
+ * rules of an ancestor set.
+ *
+ * return:
+ *   >0 - a set index + 1
+ *   -1 - a memory error occured
+ */
+static long
+_ipsrv_list_set_make(struct ipsrv_list *l, struct ipsrv_list_prefix *p,
+  unsigned int n, uint32_t ancestor)
 {
-	struct ipsrv_list_item_value *v;
+	struct ipsrv_list_set *s;
+	unsigned int i, first;
 	
-	v = malloc(sizeof(*v));
-	if (!v)
-		return NULL;
-	memset(v, 0, sizeof(*v));
-	list_item_head_init(&(v->list));
-	v->len = size;
-	memcpy(v->value, value, v->len);
-
-	return v;
+	if (_array_grow((void**)&l->sets, &l->sets_size, l->sets_cnt,
+	  sizeof(*l->sets)) < 0)
+		return -1;
+	first = l->rules_cnt;
+	for(i = 0; i < n; i++)
+		if (_ipsrv_list_rule_add(l, &p[i].rule) < 0)
+			return -1;
+	if (ancestor) {
+		s = &l->sets[ancestor - 1];
+		for(i = 0; i < s->rules_cnt; i++)
+			if (_ipsrv_list_rule_add(l, &l->rules[s->rules_first + i]) < 0)
+				return -1;
+	}
+	s = &l->sets[l->sets_cnt++];
+	s->rules_first = first;
+	s->rules_cnt = l->rules_cnt - first;
+	if (_ipsrv_list_set_compile(l, s) < 0)
+		return -1;
+	
+	return l->sets_cnt;
 }
 
+/*
+ * Build a lookup table from all added prefixes.
+ *
+ * return:
+ *   0 - if everything is ok
+ *  -1 - if memory error occured
+ */
 int
-ipsrv_list_value_exist(struct ipsrv_list *l, uint8_t *value,
-  unsigned int value_size, uint8_t *value_for_key, unsigned int vfk_size)
+ipsrv_list_build(struct ipsrv_list *l)
 {
-	struct ipsrv_list_item *item;
-	struct ipsrv_list_item_value *v;
-	struct avltree_node_head *nh;
-	struct list_item_head *lh;
-	unsigned int key;
+	struct ipsrv_list_prefix *p;
+	struct lpm *lpm;
+	unsigned int i, n;
+	long set;
+	
+	/* ipv4 prefixes go first, both families are sorted by length */
+	qsort(l->prefixes, l->prefixes_cnt, sizeof(*l->prefixes), _prefix_cmp);
+	for(i = 0; i < l->prefixes_cnt; i += n) {
+		p = &l->prefixes[i];
+		for(n = 1; i + n < l->prefixes_cnt; n++)
+			if (_prefix_cmp(p, p + n) != 0)
+				break;
+		lpm = p->is_ip6 ? l->lpm6 : l->lpm;
+		/* shorter prefixes are already added - a lookup finds the nearest
+		 * covering one */
+		set = _ipsrv_list_set_make(l, p, n, lpm_lookup(lpm, p->key));
+		if (set < 0)
+			return -1;
+		if (lpm_add(lpm, p->key, p->plen, set) < 0)
+			return -1;
+	}
+	free(l->prefixes);
+	l->prefixes = NULL;
+	l->prefixes_cnt = 0;
+	l->prefixes_size = 0;
+	free(l->rules);
+	l->rules = NULL;
+	l->rules_cnt = 0;
+	l->rules_size = 0;
 	
-	if (!l->first)
+	if ((l->lpm6) && (lpm_build(l->lpm6) < 0))
+		return -1;
+	return lpm_build(l->lpm);
+}
+
+/*
+ * Check if there is a range with value of proto.
+ */
+static int
+_ipsrv_list_range_find(struct ipsrv_list *l, struct ipsrv_list_svc *svc,
+  uint8_t proto, uint16_t value)
+{
+	struct ipsrv_list_range *r;
+	unsigned int lo, hi, mid;
+	
+	/* find the last range with (proto, from) <= (proto, value) */
+	r = &l->ranges[svc->ranges_first];
+	lo = 0;
+	hi = svc->ranges_cnt;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if ((r[mid].proto < proto) ||
+		  ((r[mid].proto == proto) && (r[mid].from <= value)))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
 		return 0;
-	key = ipsrv_list_gen_key(value_for_key, vfk_size);
-	nh = avltree_search(&(l->first->tree), key);
-	if (!nh)
+	r = &r[lo - 1];
+	
+	return (r->proto == proto) && (value <= r->to);
+}
+
+/*
+ * Check if a packet matches a service of a set.
+ * set - a set index + 1(0 - no set)
+ */
+static int
+_ipsrv_list_set_match(struct ipsrv_list *l, uint32_t set, uint8_t proto,
+  int has_value, uint16_t value, unsigned int *tag)
+{
+	struct ipsrv_list_set *s;
+	struct ipsrv_list_svc *svc;
+	unsigned int i;
+	
+	if (!set)
 		return 0;
-	item = avltree_node(nh, struct ipsrv_list_item, tree);
-	list_for_each(lh, &(item->values->list)) {
-		v = list_item(lh, struct ipsrv_list_item_value, list);
-		if (v->len <= value_size)
-			if (memcmp(value, v->value, v->len) == 0)
-				return 1;
+	s = &l->sets[set - 1];
+	/* descriptors are sorted by tag - the first matched has a minimal one */
+	for(i = 0; i < s->svcs_cnt; i++) {
+		svc = &l->svcs[s->svcs_first + i];
+		if ((svc->is_any) || (BIT_TEST(svc->protos, proto)) ||
+		  ((has_value) && (BIT_TEST(svc->ranged_protos, proto)) &&
+		  (_ipsrv_list_range_find(l, svc, proto, value)))) {
+			*tag = svc->tag;
+			return 1;
+		}
 	}
 	
 	return 0;
 }
+
+/*
+ * Check if a packet matches a service of the longest prefix of addr.
+ * addr - a packet address(host byte order)
+ * proto - a packet protocol
+ * has_value - a protocol value is present
+ * value - a protocol value(e.g. a port)
+ * tag - a pointer to place a minimal tag of the matched services
+ *
+ * return:
+ *   1 - a value is found
+ *   0 - a value isn't found
+ */
+int
+ipsrv_list_value_exist(struct ipsrv_list *l, uint32_t addr, uint8_t proto,
+  int has_value, uint16_t value, unsigned int *tag)
+{
+	uint8_t key[4];
+	
+	_addr_to_key(addr, key);
+	
+	return _ipsrv_list_set_match(l, lpm_lookup(l->lpm, key), proto,
+	  has_value, value, tag);
+}
+
+/*
+ * Check if an ipv6 packet matches a service of the longest prefix of addr.
+ * addr - a packet address(16 bytes, network byte order)
+ * proto - a packet upper layer protocol
+ * has_value - a protocol value is present
+ * value - a protocol value(e.g. a port)
+ * tag - a pointer to place a minimal tag of the matched services
+ *
+ * return:
+ *   1 - a value is found
+ *   0 - a value isn't found
+ */
+int
+ipsrv_list_value_exist6(struct ipsrv_list *l, const uint8_t *addr,
+  uint8_t proto, int has_value, uint16_t value, unsigned int *tag)
+{
+	if (!l->lpm6)
+		return 0;
+	
+	return _ipsrv_list_set_match(l, lpm_lookup(l->lpm6, addr), proto,
+	  has_value, value, tag);
+}
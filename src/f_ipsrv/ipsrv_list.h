@@ -1,33 +1,104 @@
 #ifndef __IPSRVLIST_H__
 #define __IPSRVLIST_H__
 
-#include "list.h"
-#include "avltree.h"
+#include <stdint.h>
+#include "lpm.h"
 
-#define IPSRVLIST_VALUE_SIZE 7
+/*
+ * A service rule of a prefix.
+ */
+struct ipsrv_list_rule {
+	/* a protocol number or 0 for any protocol */
+	uint8_t proto;
+	/* if not 0, only packets with a protocol value(e.g. a port) from
+	 * from-to range are matched */
+	uint8_t is_ranged;
+	uint16_t from;
+	uint16_t to;
+	/* a tag of an elist the rule is from */
+	unsigned int tag;
+};
 
-struct ipsrv_list {
-	struct ipsrv_list_item *first;
-	unsigned int len;
+struct ipsrv_list_prefix {
+	/* an ipv6 prefix */
+	uint8_t is_ip6;
+	uint8_t plen;
+	/* a big endian address(4 bytes for ipv4) */
+	uint8_t key[16];
+	struct ipsrv_list_rule rule;
 };
 
-struct ipsrv_list_item_value {
-	struct list_item_head list;
-	/* ip(4):proto(1):port(2) */
-	uint8_t value[IPSRVLIST_VALUE_SIZE];
-	unsigned int len;
+struct ipsrv_list_range {
+	uint8_t proto;
+	uint16_t from;
+	uint16_t to;
+};
+
+/*
+ * A service descriptor: all rules of one tag of a prefix compiled to
+ * protocol bitmaps and port(or other protocol value) ranges.
+ */
+struct ipsrv_list_svc {
+	unsigned int tag;
+	/* match any packet */
+	uint8_t is_any;
+	/* protocols matched with any value */
+	uint64_t protos[4];
+	/* protocols having value ranges */
+	uint64_t ranged_protos[4];
+	/* ranges sorted by proto and from, not overlapped */
+	unsigned int ranges_first;
+	unsigned int ranges_cnt;
+};
+
+/*
+ * Services of a prefix: own rules of the prefix and rules of all shorter
+ * prefixes covering it. Descriptors are sorted by tag.
+ */
+struct ipsrv_list_set {
+	unsigned int svcs_first;
+	unsigned int svcs_cnt;
+	/* source rules(used on building only) */
+	unsigned int rules_first;
+	unsigned int rules_cnt;
 };
 
-struct ipsrv_list_item {
-	struct avltree_node_head tree;
-	struct ipsrv_list_item_value *values;
+/*
+ * Prefixes are collected by ipsrv_list_add()/ipsrv_list_add6() and
+ * ipsrv_list_build() makes longest prefix match tables of them(one per
+ * address family), which values are services sets indexes(+1). Thus
+ * a packet destination is looked up once.
+ */
+struct ipsrv_list {
+	struct lpm *lpm;
+	/* it's made on the first ipv6 prefix adding */
+	struct lpm *lpm6;
+	struct ipsrv_list_prefix *prefixes;
+	unsigned int prefixes_cnt;
+	unsigned int prefixes_size;
+	struct ipsrv_list_rule *rules;
+	unsigned int rules_cnt;
+	unsigned int rules_size;
+	struct ipsrv_list_set *sets;
+	unsigned int sets_cnt;
+	unsigned int sets_size;
+	struct ipsrv_list_svc *svcs;
+	unsigned int svcs_cnt;
+	unsigned int svcs_size;
+	struct ipsrv_list_range *ranges;
+	unsigned int ranges_cnt;
+	unsigned int ranges_size;
+	unsigned int len;
 };
 
 
 struct ipsrv_list* ipsrv_list_make(void);
 int ipsrv_list_free(struct ipsrv_list *l);
-struct ipsrv_list_item_value* ipsrv_list_add(struct ipsrv_list *l, uint8_t *value, unsigned int value_size, uint8_t *value_for_key, unsigned int vfk_size);
-int ipsrv_list_value_exist(struct ipsrv_list *l, uint8_t *value, unsigned int value_size, uint8_t *value_for_key, unsigned int vfk_size);
+int ipsrv_list_add(struct ipsrv_list *l, uint32_t addr, uint8_t plen, struct ipsrv_list_rule *rule);
+int ipsrv_list_add6(struct ipsrv_list *l, const uint8_t *addr, uint8_t plen, struct ipsrv_list_rule *rule);
+int ipsrv_list_build(struct ipsrv_list *l);
+int ipsrv_list_value_exist(struct ipsrv_list *l, uint32_t addr, uint8_t proto, int has_value, uint16_t value, unsigned int *tag);
+int ipsrv_list_value_exist6(struct ipsrv_list *l, const uint8_t *addr, uint8_t proto, int has_value, uint16_t value, unsigned int *tag);
 
 
 #endif /* __IPSRVLIST_H__ */
@@ -21,34 +21,45 @@
 #include "pkt/pkt.h"
 #include "pkt/pkt_udp.h"
 #include "filters.h"
-#include "ipsrv_list.h"
 #include "ipprotos.h"
 
 
-static uint16_t _parse_port(char *str);
-static unsigned int _make_value(uint16_t ip, uint8_t *out);
+static int _parse_port(char *str, char **end, uint16_t *port);
 
 
+/*
+ * Parse PORT[-PORT]. Port 0 without a range means any port.
+ */
 static int
-make_value(char **fields, unsigned int n, uint8_t *value,
-  unsigned int value_size)
+make_value(char **fields, unsigned int n, uint16_t *from, uint16_t *to)
 {
-	uint16_t port;
+	char *e;
 	
-	port = _parse_port(fields[0]);
-	value_size = _make_value(port, value);
+	if (_parse_port(fields[0], &e, from) < 0)
+		return -1;
+	*to = *from;
+	if (*e == '-') {
+		if (_parse_port(e + 1, &e, to) < 0)
+			return -1;
+	} else if (!*from) {
+		*to = 65535;
+	}
+	if ((*e != '\0') || (*to < *from)) {
+		ERR_OUT("Wrong port range format: %s", fields[0]);
+		return -1;
+	}
 	
-	return value_size;
+	return 0;
 }
 
 static int
-make_value2(struct pkt *pkt, uint8_t *value, unsigned int value_size)
+make_value2(struct pkt *pkt, uint16_t *value)
 {
 	struct pkt_udp *pkt_udp;
 	
 	pkt_udp = (struct pkt_udp*)pkt;
-	value_size = _make_value(pkt_udp->dport, value);
-	return value_size;
+	*value = pkt_udp->dport;
+	return 0;
 }
 
 struct ipproto ipproto_udp = {
@@ -58,32 +69,17 @@ struct ipproto ipproto_udp = {
 	make_value2
 };
 
-static uint16_t
-_parse_port(char *str)
+static int
+_parse_port(char *str, char **end, uint16_t *port)
 {
 	unsigned long int n;
-	char *e;
 	
-	n = strtoul(str, &e, 10);
-	if ((*e != '\0') || (n > 65535)) {
+	n = strtoul(str, end, 10);
+	if ((*end == str) || (n > 65535)) {
 		ERR_OUT("Wrong port format: %s", str);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
+	*port = n;
 	
-	return (uint16_t)n;
-}
-
-static unsigned int
-_make_value(uint16_t port, uint8_t *out)
-{
-	unsigned int len = 0;
-	uint16_t *i16;
-	
-	if (!port)
-		return len;
-	i16 = (uint16_t*)out;
-	*i16 = port;
-	len += 2;
-
-	return len;
+	return 0;
 }
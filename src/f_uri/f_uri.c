@@ -66,6 +66,7 @@ flist_free(void *list)
  * list - a pointer to a list
  * fields - a pointer to array of strings
  * n - number of strings in array
+ * tag - a tag of an elist the entry is from
  *
  * return:
  *   1 - entry is not processible by this filter - ignored
@@ -73,7 +74,8 @@ flist_free(void *list)
  *  <0 - an error is occured
  */
 static int
-list_entry_add(void *list, char **fields, unsigned int n)
+list_entry_add(void *list, char **fields, unsigned int n,
+  unsigned int tag)
 {
 	struct uri_list *urilist = list;
 	
@@ -82,7 +84,7 @@ list_entry_add(void *list, char **fields, unsigned int n)
 	if (n < 2)
 		return 0;
 	if (fields[1][0] != '\0') {
-		if (!uri_list_add(urilist, fields[1])) {
+		if (!uri_list_add(urilist, fields[1], tag)) {
 			ERR_OUT("uri: uri add error: %s: no memory", fields[1]);
 			return -1;
 		}
@@ -103,13 +105,14 @@ list_stat_out(void *list)
 }
 
 static int
-filter_pkt(void *list, struct pkt *pkt)
+filter_pkt(void *list, struct pkt *pkt, unsigned int *tag)
 {
 	struct uri_list *urilist = list;
 	struct pkt_nfq *pkt_nfq;
 	struct list_item_head *lh;
 	struct conn_uri *uri;
-	int ret;
+	unsigned int t;
+	int ret = 0;
 	
 	pkt_nfq = (struct pkt_nfq*)pkt;
 	if (!pkt_nfq->uri)
@@ -117,11 +120,13 @@ filter_pkt(void *list, struct pkt *pkt)
 
 	list_for_each(lh, &pkt_nfq->uri->list) {
 		uri = list_item(lh, struct conn_uri, list);
-		ret = uri_list_value_exist(urilist, uri->value);
-		if (ret)
-			return 1;
+		if (!uri_list_value_exist(urilist, uri->value, uri->len, &t))
+			continue;
+		if ((!ret) || (t < *tag))
+			*tag = t;
+		ret = 1;
 	}
-	return 0;
+	return ret;
 }
 
 struct filter filter_f_uri = {
@@ -131,6 +136,8 @@ struct filter filter_f_uri = {
 	flist_free,
 	list_entry_add,
 	list_stat_out,
-	filter_pkt
+	filter_pkt,
+	NULL,
+	PKT_ATTR_URI
 };
 
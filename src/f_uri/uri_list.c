@@ -46,9 +46,9 @@ jenkins_one_at_a_time_hash(const uint8_t* key, size_t length)
 }
 
 static unsigned int
-uri_list_gen_key(char *value)
+uri_list_gen_key(char *value, unsigned int len)
 {
-	return jenkins_one_at_a_time_hash((uint8_t*)value, strlen(value));
+	return jenkins_one_at_a_time_hash((uint8_t*)value, len);
 }
 
 /*
@@ -145,13 +145,14 @@ _uri_list_add_cb(struct avltree_node_head *new, struct avltree_node_head *e)
  *
  * l - a pointer to uri_list
  * value - a value to add
+ * tag - a tag of an elist the value is from
  *
  * return:
  *   pointer - a pointer to struct uri_list_item_value with new uri
  *   NULL - if memory error occured or value too large
  */
 struct uri_list_item_value*
-uri_list_add(struct uri_list *l, char *value)
+uri_list_add(struct uri_list *l, char *value, unsigned int tag)
 {
 	struct uri_list_item *item;
 	struct uri_list_item_value *v;
@@ -162,6 +163,7 @@ uri_list_add(struct uri_list *l, char *value)
 	if (!item)
 		return NULL;
 	v = item->values;
+	v->tag = tag;
 	
 	if (!l->first) {
 		l->first = item;
@@ -199,7 +201,8 @@ uri_list_item_make(char *value)
 		return NULL;
 	}
 	
-	item->tree.key = uri_list_gen_key(value);
+	item->tree.key = uri_list_gen_key(item->values->value,
+	  item->values->len);
 	
 	return item;
 }
@@ -219,31 +222,49 @@ uri_list_item_value_make(char *value)
 		free(v);
 		return NULL;
 	}
+	v->len = strlen(v->value);
 
 	return v;
 }
 
+/*
+ * Check if a value exists in a uri list.
+ *
+ * l - a pointer to uri_list
+ * value - a value to search(not null terminated)
+ * len - a value length
+ * tag - a pointer to place a minimal tag of the found values
+ *
+ * return:
+ *   1 - a value is found
+ *   0 - a value isn't found
+ */
 int
-uri_list_value_exist(struct uri_list *l, char *value)
+uri_list_value_exist(struct uri_list *l, char *value, unsigned int len,
+  unsigned int *tag)
 {
 	struct uri_list_item *item;
 	struct uri_list_item_value *v;
 	struct avltree_node_head *nh;
 	struct list_item_head *lh;
 	unsigned int key;
+	int ret = 0;
 	
 	if (!l->first)
 		return 0;
-	key = uri_list_gen_key(value);
+	key = uri_list_gen_key(value, len);
 	nh = avltree_search(&(l->first->tree), key);
 	if (!nh)
 		return 0;
 	item = avltree_node(nh, struct uri_list_item, tree);
 	list_for_each(lh, &(item->values->list)) {
 		v = list_item(lh, struct uri_list_item_value, list);
-		if (strcmp(value, v->value) == 0)
-			return 1;
+		if ((v->len == len) && (memcmp(value, v->value, len) == 0))
+			if ((!ret) || (v->tag < *tag)) {
+				*tag = v->tag;
+				ret = 1;
+			}
 	}
 	
-	return 0;
+	return ret;
 }
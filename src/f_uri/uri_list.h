@@ -12,6 +12,9 @@ struct uri_list {
 struct uri_list_item_value {
 	struct list_item_head list;
 	char *value;
+	unsigned int len;
+	/* a tag of an elist the value is from */
+	unsigned int tag;
 };
 
 struct uri_list_item {
@@ -45,13 +48,26 @@ int uri_list_free(struct uri_list *l);
  *
  * l - a pointer to uri_list
  * value - a value to add
+ * tag - a tag of an elist the value is from
  *
  * return:
  *   pointer - a pointer to struct uri_list_item_value with new uri
  *   NULL - if memory error occured or value too large
  */
-struct uri_list_item_value* uri_list_add(struct uri_list *l, char *value);
-int uri_list_value_exist(struct uri_list *l, char *value);
+struct uri_list_item_value* uri_list_add(struct uri_list *l, char *value, unsigned int tag);
+/*
+ * Check if a value exists in a uri list.
+ *
+ * l - a pointer to uri_list
+ * value - a value to search(not null terminated)
+ * len - a value length
+ * tag - a pointer to place a minimal tag of the found values
+ *
+ * return:
+ *   1 - a value is found
+ *   0 - a value isn't found
+ */
+int uri_list_value_exist(struct uri_list *l, char *value, unsigned int len, unsigned int *tag);
 
 
 #endif /* __URILIST_H__ */
@@ -3,14 +3,23 @@
 
 #include "pkt/pkt.h"
 
+/*
+ * A filter list is a merged index of entries of all elists. Each entry is
+ * added with a tag of its elist(an elist priority, less is higher) and
+ * filter_pkt() returns a minimal tag of all matched entries.
+ */
 struct filter {
 	char *name;
 	int (*init)(void);
 	int (*list_make)(void **list);
 	int (*list_free)(void *list);
-	int (*list_entry_add)(void *list, char **fields, unsigned int n);
+	int (*list_entry_add)(void *list, char **fields, unsigned int n, unsigned int tag);
 	int (*list_stat_out)(void *list);
-	int (*filter_pkt)(void *list, struct pkt *pkt);
+	int (*filter_pkt)(void *list, struct pkt *pkt, unsigned int *tag);
+	/* Called after all entries are added(can be NULL). Return <0 on error. */
+	int (*list_build)(void *list);
+	/* Packet attributes(PKT_ATTR_*) filter_pkt() looks at */
+	unsigned int pkt_attrs;
 };
 
 extern struct filter *filters[];
@@ -0,0 +1,282 @@
+/*
+ * traffic filter
+ * Copyright (C) 2017, Oleg Nemanov <lego12239@yandex.ru>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include "main.h"
+#include "log.h"
+#include "pkt/pkt.h"
+#include "pkt/pkt_ip6.h"
+#include "flow.h"
+
+
+/* max number of slots checked for a key */
+#define FLOW_CACHE_PROBES 8
+
+
+struct flow_cache_entry {
+	struct flow_key key;
+	uint8_t is_used;
+	unsigned int gen;
+	uint32_t verdict;
+	uint32_t mark;
+	/* adding and last hit time in seconds */
+	uint32_t ts_add;
+	uint32_t ts_hit;
+};
+
+struct flow_cache {
+	struct flow_cache_entry *e;
+	unsigned int mask;
+};
+
+
+extern struct global_opts opts;
+
+static __thread struct flow_cache *fcache;
+
+
+/*
+ * Get a flow key from a raw ipv4 or ipv6 packet. Ports are 0 for
+ * protocols other than tcp and udp and for fragments.
+ * data - a packet data
+ * size - a packet size
+ * key - a key to fill
+ *
+ * return:
+ *   0 - key is filled
+ *   1 - not ip packet or a packet is too short
+ */
+int
+flow_key_get(unsigned char *data, int size, struct flow_key *key)
+{
+	struct iphdr *iph;
+	struct ip6_hdr *ip6h;
+	uint16_t frag;
+	int hlen;
+	
+	if (size < sizeof(*iph))
+		return 1;
+	memset(key, 0, sizeof(*key));
+	iph = (struct iphdr*)data;
+	if (iph->version == 4) {
+		hlen = iph->ihl * 4;
+		key->saddr[2] = htobe32(0xffff);
+		key->saddr[3] = iph->saddr;
+		key->daddr[2] = htobe32(0xffff);
+		key->daddr[3] = iph->daddr;
+		key->proto = iph->protocol;
+		frag = be16toh(iph->frag_off) & (IP_MF | IP_OFFMASK);
+	} else if ((iph->version == 6) && (size >= sizeof(*ip6h))) {
+		ip6h = (struct ip6_hdr*)data;
+		memcpy(key->saddr, &ip6h->ip6_src, 16);
+		memcpy(key->daddr, &ip6h->ip6_dst, 16);
+		key->proto = ip6h->ip6_nxt;
+		hlen = pkt_ip6_exts_skip(data, size, &key->proto, &frag);
+		/* ports are unknown */
+		if (hlen < 0)
+			return 0;
+	} else {
+		return 1;
+	}
+	
+	/* ports of non first fragments are unknown, so they are left 0 for
+	 * all fragments(fragments of a datagram have the same key) */
+	if (frag)
+		return 0;
+	if (((key->proto == 6) || (key->proto == 17)) && (size >= hlen + 4)) {
+		key->sport = (data[hlen] << 8) | data[hlen + 1];
+		key->dport = (data[hlen + 2] << 8) | data[hlen + 3];
+	}
+	
+	return 0;
+}
+
+/*
+ * Compare flow keys.
+ * return:
+ *   1 - keys are equal
+ *   0 - otherwise
+ */
+int
+flow_key_eq(struct flow_key *k1, struct flow_key *k2)
+{
+	return (memcmp(k1->saddr, k2->saddr, sizeof(k1->saddr)) == 0) &&
+	  (memcmp(k1->daddr, k2->daddr, sizeof(k1->daddr)) == 0) &&
+	  (k1->sport == k2->sport) && (k1->dport == k2->dport) &&
+	  (k1->proto == k2->proto);
+}
+
+/*
+ * Return a symmetric(the same for both directions of a flow) hash of
+ * a flow key.
+ */
+uint32_t
+flow_key_hash_sym(struct flow_key *key)
+{
+	uint32_t h = 0;
+	unsigned int i;
+	
+	/* a xor of both addresses doesn't depend on a direction */
+	for(i = 0; i < 4; i++)
+		h = h * 0x9e3779b1 + (key->saddr[i] ^ key->daddr[i]);
+	h ^= ((key->sport ^ key->dport) << 16) ^ key->proto;
+	/* murmur3 finalizer */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	
+	return h;
+}
+
+static struct flow_cache*
+_flow_cache_get(void)
+{
+	struct flow_cache *fc;
+	unsigned int size;
+	
+	if (fcache)
+		return fcache;
+	
+	/* round up to a power of 2 */
+	for(size = 1; size < opts.fcache_size; size <<= 1);
+	fc = malloc(sizeof(*fc));
+	if (!fc)
+		goto err;
+	fc->e = calloc(size, sizeof(*fc->e));
+	if (!fc->e) {
+		free(fc);
+		goto err;
+	}
+	fc->mask = size - 1;
+	fcache = fc;
+	
+	return fc;
+	
+err:
+	ERR_OUT("flow cache allocating error: no memory");
+	exit(EXIT_FAILURE);
+}
+
+static uint32_t
+_flow_cache_now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	
+	return ts.tv_sec;
+}
+
+static int
+_flow_cache_is_alive(struct flow_cache_entry *e, unsigned int gen,
+  uint32_t now)
+{
+	return (e->gen == gen) && (now - e->ts_hit < opts.fcache_idle) &&
+	  (now - e->ts_add < opts.fcache_max);
+}
+
+/*
+ * Look up a final verdict of a flow in the flow cache of the current
+ * thread. Entries of other config generation or expired ones(idle or
+ * absolute expiry) are ignored.
+ * key - a flow key
+ * gen - a current config generation
+ * verdict - a pointer to place a verdict
+ * mark - a pointer to place a mark
+ *
+ * return:
+ *   1 - a verdict is found
+ *   0 - not found
+ */
+int
+flow_cache_lookup(struct flow_key *key, unsigned int gen, uint32_t *verdict,
+  uint32_t *mark)
+{
+	struct flow_cache *fc;
+	struct flow_cache_entry *e;
+	unsigned int i, idx;
+	uint32_t now;
+	
+	fc = _flow_cache_get();
+	idx = flow_key_hash_sym(key);
+	for(i = 0; i < FLOW_CACHE_PROBES; i++) {
+		e = &fc->e[(idx + i) & fc->mask];
+		if (!e->is_used)
+			return 0;
+		if (!flow_key_eq(&e->key, key))
+			continue;
+		now = _flow_cache_now();
+		if (!_flow_cache_is_alive(e, gen, now))
+			return 0;
+		e->ts_hit = now;
+		*verdict = e->verdict;
+		*mark = e->mark;
+		return 1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Add a final verdict of a flow to the flow cache of the current thread.
+ * A free, stale or expired slot is taken; if there is no one, the oldest
+ * entry in a probe window is replaced.
+ * key - a flow key
+ * gen - a config generation the verdict is got with
+ * verdict - a verdict
+ * mark - a mark
+ */
+void
+flow_cache_add(struct flow_key *key, unsigned int gen, uint32_t verdict,
+  uint32_t mark)
+{
+	struct flow_cache *fc;
+	struct flow_cache_entry *e, *victim = NULL;
+	unsigned int i, idx;
+	uint32_t now;
+	
+	fc = _flow_cache_get();
+	now = _flow_cache_now();
+	idx = flow_key_hash_sym(key);
+	for(i = 0; i < FLOW_CACHE_PROBES; i++) {
+		e = &fc->e[(idx + i) & fc->mask];
+		if ((!e->is_used) || (flow_key_eq(&e->key, key)) ||
+		  (!_flow_cache_is_alive(e, gen, now))) {
+			victim = e;
+			break;
+		}
+		if ((!victim) || (e->ts_hit < victim->ts_hit))
+			victim = e;
+	}
+	
+	victim->key = *key;
+	victim->is_used = 1;
+	victim->gen = gen;
+	victim->verdict = verdict;
+	victim->mark = mark;
+	victim->ts_add = now;
+	victim->ts_hit = now;
+}
@@ -0,0 +1,68 @@
+#ifndef __FLOW_H__
+#define __FLOW_H__
+
+#include <stdint.h>
+
+
+struct flow_key {
+	/* addresses in network byte order(ipv4 ones are ipv4-mapped) */
+	uint32_t saddr[4];
+	uint32_t daddr[4];
+	uint16_t sport;
+	uint16_t dport;
+	uint8_t proto;
+};
+
+
+/*
+ * Get a flow key from a raw ipv4 or ipv6 packet. Ports are 0 for
+ * protocols other than tcp and udp and for fragments.
+ * data - a packet data
+ * size - a packet size
+ * key - a key to fill
+ *
+ * return:
+ *   0 - key is filled
+ *   1 - not ip packet or a packet is too short
+ */
+int flow_key_get(unsigned char *data, int size, struct flow_key *key);
+/*
+ * Compare flow keys.
+ * return:
+ *   1 - keys are equal
+ *   0 - otherwise
+ */
+int flow_key_eq(struct flow_key *k1, struct flow_key *k2);
+/*
+ * Return a symmetric(the same for both directions of a flow) hash of
+ * a flow key.
+ */
+uint32_t flow_key_hash_sym(struct flow_key *key);
+
+/*
+ * Look up a final verdict of a flow in the flow cache of the current
+ * thread. Entries of other config generation or expired ones(idle or
+ * absolute expiry) are ignored.
+ * key - a flow key
+ * gen - a current config generation
+ * verdict - a pointer to place a verdict
+ * mark - a pointer to place a mark
+ *
+ * return:
+ *   1 - a verdict is found
+ *   0 - not found
+ */
+int flow_cache_lookup(struct flow_key *key, unsigned int gen, uint32_t *verdict, uint32_t *mark);
+/*
+ * Add a final verdict of a flow to the flow cache of the current thread.
+ * A free, stale or expired slot is taken; if there is no one, the oldest
+ * entry in a probe window is replaced.
+ * key - a flow key
+ * gen - a config generation the verdict is got with
+ * verdict - a verdict
+ * mark - a mark
+ */
+void flow_cache_add(struct flow_key *key, unsigned int gen, uint32_t verdict, uint32_t mark);
+
+
+#endif  /* __FLOW_H__ */
@@ -0,0 +1,310 @@
+/*
+ * traffic filter
+ * Copyright (C) 2017, Oleg Nemanov <lego12239@yandex.ru>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "lpm.h"
+
+
+#define LPM_STRIDE_SIZE (1 << LPM_STRIDE)
+
+
+/*
+ * Get n(<= 8) bits of a key starting from bit off. Bits after a key end
+ * are 0.
+ */
+static inline unsigned int
+_key_bits(const uint8_t *key, unsigned int key_bits, unsigned int off,
+  unsigned int n)
+{
+	unsigned int i, v;
+	
+	i = off >> 3;
+	if (i * 8 >= key_bits)
+		return 0;
+	v = key[i] << 8;
+	if ((off + n > (i + 1) * 8) && ((i + 1) * 8 < key_bits))
+		v |= key[i + 1];
+	
+	return (v >> (16 - (off & 7) - n)) & ((1 << n) - 1);
+}
+
+/*
+ * Make an empty lpm table.
+ * key_bits - a key length in bits(a multiple of 8, >= LPM_TOP_BITS)
+ *
+ * return:
+ *   pointer - if everything is ok
+ *   NULL - if a memory error occured
+ */
+struct lpm*
+lpm_make(unsigned int key_bits)
+{
+	struct lpm *t;
+	
+	t = malloc(sizeof(*t));
+	if (!t)
+		return NULL;
+	memset(t, 0, sizeof(*t));
+	t->key_bits = key_bits;
+	t->top = calloc(1 << LPM_TOP_BITS, sizeof(*t->top));
+	if (!t->top) {
+		free(t);
+		return NULL;
+	}
+	
+	return t;
+}
+
+static void
+_lpm_bnodes_free(struct lpm *t)
+{
+	unsigned int i;
+	
+	for(i = 0; i < t->bnodes_cnt; i++)
+		free(t->bnodes[i]);
+	free(t->bnodes);
+	t->bnodes = NULL;
+	t->bnodes_cnt = 0;
+	t->bnodes_size = 0;
+}
+
+void
+lpm_free(struct lpm *t)
+{
+	_lpm_bnodes_free(t);
+	free(t->top);
+	free(t->nodes);
+	free(t->leaves);
+	free(t);
+}
+
+/*
+ * Make a plain trie node with all children equal to a value.
+ *
+ * return:
+ *   >=0 - a node index
+ *   -1 - a memory error occured
+ */
+static long
+_lpm_bnode_make(struct lpm *t, uint32_t value)
+{
+	uint32_t **bnodes, *n;
+	unsigned int i;
+	
+	if (t->bnodes_cnt == t->bnodes_size) {
+		bnodes = realloc(t->bnodes,
+		  sizeof(*bnodes) * (t->bnodes_size ? t->bnodes_size * 2 : 64));
+		if (!bnodes)
+			return -1;
+		t->bnodes = bnodes;
+		t->bnodes_size = t->bnodes_size ? t->bnodes_size * 2 : 64;
+	}
+	n = malloc(sizeof(*n) * LPM_STRIDE_SIZE);
+	if (!n)
+		return -1;
+	for(i = 0; i < LPM_STRIDE_SIZE; i++)
+		n[i] = value;
+	t->bnodes[t->bnodes_cnt] = n;
+	
+	return t->bnodes_cnt++;
+}
+
+/*
+ * Add a prefix. Prefixes must be added in order of not decreasing prefix
+ * length(a value of a shorter prefix is overwritten in the range of
+ * a longer one). Can be called only before lpm_build().
+ * t - a lpm table
+ * key - a prefix(bits after plen must be 0)
+ * plen - a prefix length
+ * value - a value(< LPM_NODE)
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ *  -2 - wrong prefixes order
+ */
+int
+lpm_add(struct lpm *t, const uint8_t *key, unsigned int plen, uint32_t value)
+{
+	uint32_t *e;
+	unsigned int i, off, rem, start, cnt;
+	long idx;
+	
+	if (plen < t->last_plen)
+		return -2;
+	t->last_plen = plen;
+	
+	if (plen <= LPM_TOP_BITS) {
+		start = (key[0] << 8) | key[1];
+		cnt = 1 << (LPM_TOP_BITS - plen);
+		for(i = 0; i < cnt; i++)
+			t->top[start + i] = value;
+		return 0;
+	}
+	
+	e = &t->top[(key[0] << 8) | key[1]];
+	off = LPM_TOP_BITS;
+	rem = plen - LPM_TOP_BITS;
+	for(;;) {
+		if (!(*e & LPM_NODE)) {
+			idx = _lpm_bnode_make(t, *e);
+			if (idx < 0)
+				return -1;
+			*e = LPM_NODE | idx;
+		}
+		e = t->bnodes[*e & ~LPM_NODE];
+		if (rem <= LPM_STRIDE)
+			break;
+		e = &e[_key_bits(key, t->key_bits, off, LPM_STRIDE)];
+		off += LPM_STRIDE;
+		rem -= LPM_STRIDE;
+	}
+	start = _key_bits(key, t->key_bits, off, LPM_STRIDE);
+	cnt = 1 << (LPM_STRIDE - rem);
+	for(i = 0; i < cnt; i++)
+		e[start + i] = value;
+	
+	return 0;
+}
+
+/*
+ * Compress a plain trie node to a poptrie node with index idx. Children
+ * nodes are placed contiguously.
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ */
+static int
+_lpm_compress(struct lpm *t, uint32_t *bn, unsigned int idx,
+  unsigned int *leaves_size)
+{
+	struct lpm_node *n;
+	uint32_t *leaves, prev = 0;
+	unsigned int i, j, cnt = 0, is_first = 1;
+	
+	n = &t->nodes[idx];
+	n->vector = 0;
+	n->leafvec = 0;
+	n->base0 = t->leaves_cnt;
+	for(i = 0; i < LPM_STRIDE_SIZE; i++) {
+		if (bn[i] & LPM_NODE) {
+			n->vector |= 1ULL << i;
+			cnt++;
+			continue;
+		}
+		if ((!is_first) && (bn[i] == prev))
+			continue;
+		if (t->leaves_cnt == *leaves_size) {
+			leaves = realloc(t->leaves, sizeof(*leaves) * *leaves_size * 2);
+			if (!leaves)
+				return -1;
+			t->leaves = leaves;
+			*leaves_size *= 2;
+		}
+		n->leafvec |= 1ULL << i;
+		t->leaves[t->leaves_cnt++] = bn[i];
+		prev = bn[i];
+		is_first = 0;
+	}
+	n->base1 = t->nodes_cnt;
+	t->nodes_cnt += cnt;
+	
+	for(i = 0, j = 0; i < LPM_STRIDE_SIZE; i++)
+		if (bn[i] & LPM_NODE)
+			if (_lpm_compress(t, t->bnodes[bn[i] & ~LPM_NODE],
+			  t->nodes[idx].base1 + j++, leaves_size) < 0)
+				return -1;
+	
+	return 0;
+}
+
+/*
+ * Compress a table. After this call only lpm_lookup() can be used.
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ */
+int
+lpm_build(struct lpm *t)
+{
+	unsigned int i, leaves_size = 64, idx;
+	
+	/* every plain node becomes exactly one poptrie node */
+	t->nodes = malloc(sizeof(*t->nodes) * (t->bnodes_cnt + 1));
+	t->leaves = malloc(sizeof(*t->leaves) * leaves_size);
+	if ((!t->nodes) || (!t->leaves))
+		return -1;
+	t->nodes_cnt = 0;
+	t->leaves_cnt = 0;
+	for(i = 0; i < (1 << LPM_TOP_BITS); i++) {
+		if (!(t->top[i] & LPM_NODE))
+			continue;
+		idx = t->nodes_cnt++;
+		if (_lpm_compress(t, t->bnodes[t->top[i] & ~LPM_NODE], idx,
+		  &leaves_size) < 0)
+			return -1;
+		t->top[i] = LPM_NODE | idx;
+	}
+	_lpm_bnodes_free(t);
+	
+	return 0;
+}
+
+/*
+ * Find a value of the longest prefix matching a key. Can be used before
+ * lpm_build() too.
+ *
+ * return:
+ *   value - a found value
+ *   0 - no matching prefix
+ */
+uint32_t
+lpm_lookup(struct lpm *t, const uint8_t *key)
+{
+	struct lpm_node *n;
+	uint32_t e;
+	uint64_t bit;
+	unsigned int off = LPM_TOP_BITS, v;
+	
+	e = t->top[(key[0] << 8) | key[1]];
+	if (t->bnodes) {
+		while (e & LPM_NODE) {
+			e = t->bnodes[e & ~LPM_NODE][_key_bits(key, t->key_bits, off,
+			  LPM_STRIDE)];
+			off += LPM_STRIDE;
+		}
+		return e;
+	}
+	while (e & LPM_NODE) {
+		n = &t->nodes[e & ~LPM_NODE];
+		v = _key_bits(key, t->key_bits, off, LPM_STRIDE);
+		off += LPM_STRIDE;
+		bit = 1ULL << v;
+		if (n->vector & bit)
+			e = LPM_NODE |
+			  (n->base1 + __builtin_popcountll(n->vector & (bit - 1)));
+		else
+			return t->leaves[n->base0 +
+			  __builtin_popcountll(n->leafvec & (~0ULL >> (63 - v))) - 1];
+	}
+	
+	return e;
+}
@@ -0,0 +1,95 @@
+#ifndef __LPM_H__
+#define __LPM_H__
+
+#include <stdint.h>
+
+
+/*
+ * A longest prefix match table for big endian byte keys(e.g. IPv4 or IPv6
+ * addresses) mapping prefixes to 32-bit values(0 means no value).
+ *
+ * It's built in two stages. At the first one prefixes are added to
+ * a plain multibit trie. Then lpm_build() compresses it to a poptrie:
+ * a top level array indexed by the first LPM_TOP_BITS bits of a key and
+ * nodes with LPM_STRIDE bits stride, where children and leaves are found
+ * with a popcount over 64-bit vectors. A lookup costs one memory access
+ * for short prefixes and one more for every next stride.
+ */
+#define LPM_TOP_BITS 16
+#define LPM_STRIDE 6
+
+struct lpm_node {
+	/* bit i is set if a child i is a node */
+	uint64_t vector;
+	/* bit i is set if a child i is a leaf, which starts a new run of
+	 * equal leaves */
+	uint64_t leafvec;
+	/* an index of the first child node */
+	uint32_t base1;
+	/* an index of the first leaf */
+	uint32_t base0;
+};
+
+struct lpm {
+	unsigned int key_bits;
+	/* a top level array: a value or LPM_NODE | a node index */
+	uint32_t *top;
+	struct lpm_node *nodes;
+	unsigned int nodes_cnt;
+	uint32_t *leaves;
+	unsigned int leaves_cnt;
+	/* a plain trie nodes(the first stage only) */
+	uint32_t **bnodes;
+	unsigned int bnodes_cnt;
+	unsigned int bnodes_size;
+	unsigned int last_plen;
+};
+
+#define LPM_NODE 0x80000000
+
+
+/*
+ * Make an empty lpm table.
+ * key_bits - a key length in bits(a multiple of 8, >= LPM_TOP_BITS)
+ *
+ * return:
+ *   pointer - if everything is ok
+ *   NULL - if a memory error occured
+ */
+struct lpm* lpm_make(unsigned int key_bits);
+void lpm_free(struct lpm *t);
+/*
+ * Add a prefix. Prefixes must be added in order of not decreasing prefix
+ * length(a value of a shorter prefix is overwritten in the range of
+ * a longer one). Can be called only before lpm_build().
+ * t - a lpm table
+ * key - a prefix(bits after plen must be 0)
+ * plen - a prefix length
+ * value - a value(< LPM_NODE)
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ *  -2 - wrong prefixes order
+ */
+int lpm_add(struct lpm *t, const uint8_t *key, unsigned int plen, uint32_t value);
+/*
+ * Compress a table. After this call only lpm_lookup() can be used.
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ */
+int lpm_build(struct lpm *t);
+/*
+ * Find a value of the longest prefix matching a key. Can be used before
+ * lpm_build() too.
+ *
+ * return:
+ *   value - a found value
+ *   0 - no matching prefix
+ */
+uint32_t lpm_lookup(struct lpm *t, const uint8_t *key);
+
+
+#endif  /* __LPM_H__ */
@@ -15,11 +15,13 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
 #include <time.h>
 #include <signal.h>
@@ -39,11 +41,31 @@
 #include "elist.h"
 #include "conf.h"
 #include "pkt/pkt.h"
+#include "pkt/reasm.h"
+#include "pkt/ipfrag.h"
+#include "pkt/pkt_dns.h"
 #include "filters.h"
+#include "flow.h"
+#include "dnssnoop.h"
+#include "sinkhole.h"
+#include "pipeline.h"
+#ifdef WITH_URING
+#include "uring.h"
+#endif
 
 
 #define VERSION "0.9.9"
 #define QUEUE_MAXLEN 1024
+#define PKT_BUF_SIZE 80000
+#define MMSG_VLEN 16
+#define VBATCH_LATENCY_DEFAULT 1000
+#define FCACHE_IDLE_DEFAULT 30
+#define FCACHE_MAX_DEFAULT 600
+#define REASM_BYTES_DEFAULT 4096
+#define REASM_TIMEOUT_DEFAULT 2
+#define FRAG_BYTES_DEFAULT 16384
+#define FRAG_TIMEOUT_DEFAULT 2
+#define DNSSNOOP_TTL_DEFAULT 3600
 #define CONF_NAME_LEN 1024
 
 
@@ -52,7 +74,11 @@ static struct thread_data *thread_data;
 __thread unsigned int thread_idx;
 pthread_mutex_t nfq_open_mut;
 
+static unsigned int parse_uint(char *str, char *what);
+static unsigned int parse_mark(char *str, char *what);
+static void parse_io_engine(char *str);
 static void parse_queue_num(char *str, unsigned int *qf, unsigned int *ql);
+static void parse_uint_fields(char *str, char *what, unsigned int *n1, unsigned int *n2, unsigned int *n3);
 static void output_usage(void);
 static void output_version(void);
 static void supervisor_stop(int exit_code, pid_t child);
@@ -110,7 +136,16 @@ parse_opts(int argc, char **argv)
 {
 	int opt;
 	
-	while ((opt = getopt(argc, argv, "q:p:fdhv")) != -1) {
+	opts.vbatch_size = 1;
+	opts.vbatch_latency = VBATCH_LATENCY_DEFAULT;
+	opts.fcache_idle = FCACHE_IDLE_DEFAULT;
+	opts.fcache_max = FCACHE_MAX_DEFAULT;
+	opts.reasm_bytes = REASM_BYTES_DEFAULT;
+	opts.reasm_timeout = REASM_TIMEOUT_DEFAULT;
+	opts.frag_bytes = FRAG_BYTES_DEFAULT;
+	opts.frag_timeout = FRAG_TIMEOUT_DEFAULT;
+	opts.dnssnoop_ttl = DNSSNOOP_TTL_DEFAULT;
+	while ((opt = getopt(argc, argv, "q:p:b:l:E:w:o:c:r:F:Rs:fdhv")) != -1) {
 		switch (opt) {
 		case 'q':
 			parse_queue_num(optarg, &opts.qn_first, &opts.qn_last);
@@ -121,6 +156,43 @@ parse_opts(int argc, char **argv)
 		case 'p':
 			opts.pidfile_name = optarg;
 			break;
+		case 'b':
+			opts.vbatch_size = parse_uint(optarg, "verdict batch size");
+			break;
+		case 'l':
+			opts.vbatch_latency = parse_uint(optarg, "verdict batch latency");
+			break;
+		case 'E':
+			parse_io_engine(optarg);
+			break;
+		case 'w':
+			opts.workers = parse_uint(optarg, "workers number");
+			break;
+		case 'o':
+			opts.offload_mark = parse_mark(optarg, "offload mark");
+			break;
+		case 'c':
+			/* not given lifetimes are reset to defaults */
+			opts.fcache_idle = FCACHE_IDLE_DEFAULT;
+			opts.fcache_max = FCACHE_MAX_DEFAULT;
+			parse_uint_fields(optarg, "flow cache", &opts.fcache_size,
+			  &opts.fcache_idle, &opts.fcache_max);
+			break;
+		case 'r':
+			parse_uint_fields(optarg, "tcp reassembly", &opts.reasm_size,
+			  &opts.reasm_bytes, &opts.reasm_timeout);
+			break;
+		case 'F':
+			parse_uint_fields(optarg, "fragments reassembly",
+			  &opts.frag_size, &opts.frag_bytes, &opts.frag_timeout);
+			break;
+		case 'R':
+			opts.is_reasm_hold = 1;
+			break;
+		case 's':
+			parse_uint_fields(optarg, "dns snooping", &opts.dnssnoop_size,
+			  &opts.dnssnoop_ttl, NULL);
+			break;
 		case 'd':
 			opts.is_debug = 1;
 #ifndef DEBUG
@@ -139,6 +211,34 @@ parse_opts(int argc, char **argv)
 		}
 	}
 	
+	if ((opts.workers) && (opts.vbatch_size > 1)) {
+		INFO_OUT("verdict batching is disabled with classifier workers");
+		opts.vbatch_size = 1;
+	}
+	if ((opts.is_reasm_hold) && (!opts.reasm_size) && (!opts.frag_size)) {
+		INFO_OUT("holding of reassembled packets is disabled without "
+		  "tcp or fragments reassembly");
+		opts.is_reasm_hold = 0;
+	}
+	/* held packets of one thread must be from one queue */
+	if ((opts.is_reasm_hold) && (opts.io_engine == io_engine_uring) &&
+	  (opts.uring_nq > 1)) {
+		INFO_OUT("holding of reassembled packets is disabled with "
+		  "several queues per thread");
+		opts.is_reasm_hold = 0;
+	}
+	/* a batch verdict is set for all packets with lesser ids, including
+	 * held ones */
+	if ((opts.is_reasm_hold) && (opts.vbatch_size > 1)) {
+		INFO_OUT("verdict batching is disabled with holding of reassembled "
+		  "packets");
+		opts.vbatch_size = 1;
+	}
+	reasm_set(opts.reasm_size, opts.reasm_bytes, opts.reasm_timeout,
+	  opts.is_reasm_hold);
+	ipfrag_set(opts.frag_size, opts.frag_bytes, opts.frag_timeout,
+	  opts.is_reasm_hold);
+	
 	if (optind >= argc) {
 		output_usage();
 		exit(EXIT_FAILURE);
@@ -148,6 +248,63 @@ parse_opts(int argc, char **argv)
 		exit(1);
 }
 
+static unsigned int
+parse_uint(char *str, char *what)
+{
+	unsigned long int n;
+	char *e;
+	
+	n = strtoul(str, &e, 10);
+	if ((*e != '\0') || (e == str) || (n > 0xffffffff)) {
+		ERR_OUT("Wrong %s format: %s", what, str);
+		exit(EXIT_FAILURE);
+	}
+	
+	return n;
+}
+
+static unsigned int
+parse_mark(char *str, char *what)
+{
+	unsigned long int n;
+	char *e;
+	
+	n = strtoul(str, &e, 0);
+	if ((*e != '\0') || (e == str) || (n == 0) || (n > 0xffffffff)) {
+		ERR_OUT("Wrong %s format: %s", what, str);
+		exit(EXIT_FAILURE);
+	}
+	
+	return n;
+}
+
+static void
+parse_io_engine(char *str)
+{
+	if (strcmp(str, "recv") == 0) {
+		opts.io_engine = io_engine_recv;
+	} else if (strcmp(str, "recvmmsg") == 0) {
+		opts.io_engine = io_engine_recvmmsg;
+	} else if ((strcmp(str, "uring") == 0) ||
+	  (strncmp(str, "uring:", 6) == 0)) {
+#ifndef WITH_URING
+		ERR_OUT("no compiled in support for -E uring");
+		exit(EXIT_FAILURE);
+#endif
+		opts.io_engine = io_engine_uring;
+		opts.uring_nq = 1;
+		if (str[5] == ':')
+			opts.uring_nq = parse_uint(str + 6, "queues per thread number");
+		if (opts.uring_nq == 0) {
+			ERR_OUT("Wrong queues per thread number: %s", str);
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		ERR_OUT("Unknown io engine: %s", str);
+		exit(EXIT_FAILURE);
+	}
+}
+
 static void
 parse_queue_num(char *str, unsigned int *qf, unsigned int *ql)
 {
@@ -177,6 +334,45 @@ parse_queue_num(char *str, unsigned int *qf, unsigned int *ql)
 	}
 }
 
+/*
+ * Parse an option with 2 or 3 positive numeric fields(N1:N2[:N3]), where
+ * only the first field is mandatory. Not given fields are left untouched.
+ * str - an option value
+ * what - an option name for an error message
+ * n1, n2, n3 - pointers to place fields(n3 is NULL for 2 fields)
+ */
+static void
+parse_uint_fields(char *str, char *what, unsigned int *n1, unsigned int *n2,
+  unsigned int *n3)
+{
+	unsigned int *n[3] = { n1, n2, n3 };
+	unsigned long int v[3];
+	char *s, *e;
+	int i, cnt;
+	
+	cnt = n3 ? 3 : 2;
+	s = str;
+	for(i = 0; i < cnt; i++) {
+		v[i] = strtoul(s, &e, 10);
+		if ((e == s) || ((*e != '\0') && (*e != ':')) ||
+		  (v[i] == 0) || (v[i] > 0x7fffffff))
+			goto err;
+		if (*e == '\0')
+			break;
+		s = e + 1;
+	}
+	if (i == cnt)
+		goto err;
+	
+	for(; i >= 0; i--)
+		*n[i] = v[i];
+	return;
+	
+err:
+	ERR_OUT("Wrong %s format: %s", what, str);
+	exit(EXIT_FAILURE);
+}
+
 static void
 output_usage(void)
 {
@@ -188,10 +384,56 @@ output_usage(void)
 #endif
 	  "\n"
 	  "  -q    NFQUEUE numbers(format: FIRST[:LAST])\n"
+	  "  -b    max number of packets in a verdict batch(default: 1 - "
+	  "no batching)\n"
+	  "  -l    max verdict batch flush latency in microseconds"
+	  "(default: %u)\n"
+	  "  -E    io engine: recv(default) - one netlink message per syscall,\n"
+	  "        recvmmsg - up to %u netlink messages per syscall,\n"
+	  "        uring[:N] - io_uring, N queues per thread(default: 1)"
+#ifndef WITH_URING
+	  "(NO COMPILED IN SUPPORT)"
+#endif
+	  "\n"
+	  "  -w    number of classifier workers for each queue(default: 0 - "
+	  "a packet\n"
+	  "        is classified by a queue thread)\n"
+	  "  -o    flow offload mark bits(e.g. 0x10000), OR'ed to a packet mark,\n"
+	  "        when a flow verdict is final(default: 0 - no offload)\n"
+	  "  -c    final flow verdicts cache for each thread(format: "
+	  "SIZE[:IDLE[:MAX]],\n"
+	  "        IDLE and MAX are idle and max entry lifetime in seconds"
+	  "(default: %u:%u))\n"
+	  "  -r    tcp reassembly of split http requests and tls ClientHellos "
+	  "for each\n"
+	  "        thread(format: SIZE[:BYTES[:TIMEOUT]], SIZE is max number of "
+	  "flows,\n"
+	  "        BYTES is max buffered bytes of a flow, TIMEOUT is max flow "
+	  "lifetime\n"
+	  "        in seconds(default: %u:%u))\n"
+	  "  -F    ipv4 fragments reassembly for each thread(format:\n"
+	  "        SIZE[:BYTES[:TIMEOUT]], SIZE is max number of datagrams, BYTES "
+	  "is max\n"
+	  "        datagram payload size, TIMEOUT is max datagram lifetime in "
+	  "seconds\n"
+	  "        (default: %u:%u))\n"
+	  "  -R    hold verdicts of buffered segments until a domain is got and\n"
+	  "        of buffered fragments until a datagram is complete\n"
+	  "        (default: buffered segments and fragments are accepted)\n"
+	  "  -s    dns snooping: addresses from dns answers for names matched "
+	  "by\n"
+	  "        domain lists are matched like these names(format: "
+	  "SIZE[:TTL],\n"
+	  "        SIZE is max number of addresses, TTL is max address "
+	  "lifetime in\n"
+	  "        seconds(default: %u))\n"
 	  "  -f    stay foreground\n"
 	  "  -p    pidfile name\n"
 	  "  -h    output this help\n"
-	  "  -v    output version\n");
+	  "  -v    output version\n", VBATCH_LATENCY_DEFAULT, MMSG_VLEN,
+	  FCACHE_IDLE_DEFAULT, FCACHE_MAX_DEFAULT, REASM_BYTES_DEFAULT,
+	  REASM_TIMEOUT_DEFAULT, FRAG_BYTES_DEFAULT, FRAG_TIMEOUT_DEFAULT,
+	  DNSSNOOP_TTL_DEFAULT);
 }
 
 static void
@@ -334,6 +576,7 @@ supervisor_start(void)
 		
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
 	sigaddset(&mask, SIGTERM);
 	sigaddset(&mask, SIGINT);
 	sigaddset(&mask, SIGQUIT);
@@ -343,8 +586,9 @@ supervisor_start(void)
 	while ((ret = sigwait(&mask, &signo)) == 0) {
 		switch (signo) {
 		case SIGUSR1:
-			INFO_OUT("Got SIGUSR1 - send to child");
-			ret = kill(pid, SIGUSR1);
+		case SIGUSR2:
+			INFO_OUT("Got %d signal - send to child", signo);
+			ret = kill(pid, signo);
 			if (ret < 0) {
 				ERR_OUT("Can't send signal to child: %s", strerror(errno));
 				supervisor_stop(1, pid);
@@ -416,6 +660,7 @@ sig_init(void)
 	
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
 	sigaddset(&mask, SIGTERM);
 	sigaddset(&mask, SIGCHLD);
 	sigaddset(&mask, SIGINT);
@@ -436,6 +681,7 @@ sig_wait_loop(void)
 	
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
 	sigaddset(&mask, SIGTERM);
 	
 	while ((ret = sigwait(&mask, &signo)) == 0) {
@@ -445,6 +691,10 @@ sig_wait_loop(void)
 			if (conf_parse(opts.conf_name) < 0)
 				ERR_OUT("config reloading error - stay with old one");
 			break;
+		case SIGUSR2:
+			INFO_OUT("Got SIGUSR2 - output stat");
+			pkt_stat_out();
+			break;
 		case SIGTERM:
 			INFO_OUT("Got SIGTERM - terminating");
 			exit(0);
@@ -458,48 +708,334 @@ sig_wait_loop(void)
 	ERR_OUT("sigwait() error: %s", strerror(ret));
 }
 
+/*
+ * Match a packet by filters looking at given attributes.
+ * elchain - an elist chain
+ * pkt - a parsed packet
+ * attrs - packet attributes(PKT_ATTR_*) of filters to use
+ * tag - a pointer to place a tag of the matched elist
+ *
+ * return:
+ *   1 - a packet is matched
+ *   0 - otherwise
+ */
 static int
-is_pkt_match(struct pkt *pkt, enum elist_act *act, uint32_t *mark,
-  enum elist_act *act_default, uint32_t *mark_default)
+pkt_match(struct elist_chain *elchain, struct pkt *pkt, unsigned int attrs,
+  unsigned int *tag)
 {
 	int i, ret = 0;
-	struct elist *elist;
-	struct elist_chain *elchain;
-	struct list_item_head *lh;
+	unsigned int t;
 	
-	elchain = conf_get_elist_chain();
+	/* every filter list holds entries of all elists, so a packet is
+	 * looked up once per filter; the matched elist with the highest
+	 * priority(the minimal tag) wins */
+	for(i = 0; filters[i]; i++) {
+		if (!(filters[i]->pkt_attrs & attrs))
+			continue;
+		if (!filters[i]->filter_pkt(elchain->f_list[i], pkt, &t))
+			continue;
+		if ((!ret) || (t < *tag))
+			*tag = t;
+		ret = 1;
+		if (*tag == 0)
+			break;
+	}
+	
+	return ret;
+}
+
+/*
+ * Match a packet by all filters and by dns snooping.
+ * elchain - an elist chain
+ * snoop_tag - a tag of a destination learned from dns answers(UINT_MAX -
+ *             a destination isn't learned)
+ * pkt - a parsed packet
+ * elist_matched - a pointer to place the matched elist
+ * act, mark - pointers to place an action and a mark of the matched elist
+ * act_default, mark_default - pointers to place a default action and mark
+ *
+ * return:
+ *   1 - a packet is matched
+ *   0 - otherwise
+ */
+static int
+is_pkt_match(struct elist_chain *elchain, unsigned int snoop_tag,
+  struct pkt *pkt, struct elist **elist_matched, enum elist_act *act,
+  uint32_t *mark, enum elist_act *act_default, uint32_t *mark_default)
+{
+	int ret;
+	unsigned int tag_min = 0;
+	struct elist *elist;
 	
 	*act_default = elchain->act_default;
 	*mark_default = elchain->mark_default;
 	
-	list_for_each(lh, &elchain->elist_first->list) {
-		elist = list_item(lh, struct elist, list);
-		for(i = 0; filters[i]; i++) {
-			ret = filters[i]->filter_pkt(elist->f_list[i], pkt);
-			if (ret == 1) {
-				*act = elist->act_on_match;
-				*mark = elist->mark_on_match;
-				goto out;
-			}
+	ret = pkt_match(elchain, pkt, PKT_ATTR_ALL, &tag_min);
+	/* a destination learned from a dns answer is matched like a domain
+	 * of the answer */
+	if ((snoop_tag < elchain->elists_cnt) &&
+	  ((!ret) || (snoop_tag < tag_min))) {
+		DBG_OUT("%u: destination is matched by dns snooping(tag %u)",
+		  get_pkt_id(pkt), snoop_tag);
+		tag_min = snoop_tag;
+		ret = 1;
+	}
+	if (ret) {
+		elist = elchain->elists[tag_min];
+		*elist_matched = elist;
+		*act = elist->act_on_match;
+		*mark = elist->mark_on_match;
+	}
+	
+	return ret;
+}
+
+/*
+ * Learn addresses of a dns answer. If a question name is matched by
+ * domain filters, answer addresses are added to the dns snooping table
+ * with a tag of the matched elist. Thus, later flows to these addresses
+ * are matched even without a domain(e.g. no sni or a hardcoded
+ * resolver).
+ * elchain - an elist chain
+ * gen - a config generation got before the chain(if a config is changed
+ *       between, learned tags are ignored as stale ones, instead of being
+ *       applied to elists of a new config)
+ * pkt - a parsed packet
+ */
+static void
+dns_answer_learn(struct elist_chain *elchain, unsigned int gen,
+  struct pkt *pkt)
+{
+	struct pkt *p;
+	struct pkt_dns *pkt_dns;
+	unsigned int i, tag;
+	
+	for(p = get_next_pkt(pkt); p; p = get_next_pkt(p))
+		if (p->pkt_type == pkt_type_dns)
+			break;
+	if (!p)
+		return;
+	pkt_dns = (struct pkt_dns*)p;
+	if ((!pkt_dns->qr) || (!pkt_dns->answer_cnt))
+		return;
+	
+	/* an answer is already filtered, so its domains can be added now */
+	for(i = 0; i < pkt_dns->qdcount; i++)
+		if (pkt_domain_add(pkt, pkt_dns->qentry[i].qname,
+		  pkt_dns->qentry[i].qname_len) < 0)
+			return;
+	if (!pkt_match(elchain, pkt, PKT_ATTR_DOMAIN, &tag))
+		return;
+	for(i = 0; i < pkt_dns->answer_cnt; i++)
+		dnssnoop_add(pkt_dns->answer[i].addr, gen, pkt_dns->answer[i].ttl,
+		  tag);
+	DBG_OUT("%u: %u dns answer addresses are learned(tag %u)",
+	  get_pkt_id(pkt), pkt_dns->answer_cnt, tag);
+}
+
+/*
+ * Check if a flow verdict can't be changed by later packets of the flow.
+ * It's true when filters don't look at a payload(the verdict depends
+ * on addresses and ports only, e.g. a destination is matched by dns
+ * snooping) or when a domain is taken from a TLS or
+ * QUIC SNI - it's sent once per connection. HTTP isn't counted: a
+ * keep-alive connection can carry many requests with other Host and URI.
+ * DNS isn't counted too: a resolver can send many queries from one
+ * socket(thus, through one conntrack entry).
+ * pkt - a parsed packet
+ * return:
+ *   1 - a flow verdict is final
+ *   0 - otherwise
+ */
+static int
+is_flow_final(struct pkt *pkt)
+{
+	struct pkt *p;
+	
+	if (!(((struct pkt_nfq*)pkt)->attrs & (PKT_ATTR_DOMAIN | PKT_ATTR_URI)))
+		return 1;
+	if (!((struct pkt_nfq*)pkt)->domain)
+		return 0;
+	for(p = get_next_pkt(pkt); p; p = get_next_pkt(p))
+		if (p->pkt_type == pkt_type_tls)
+			return 1;
+#ifdef WITH_QUIC
+		else if (p->pkt_type == pkt_type_quic)
+			return 1;
+#endif
+	
+	return 0;
+}
+
+/*
+ * Parse and filter a packet.
+ * data - a packet data
+ * size - a packet size
+ * id - a packet id
+ * verdict - a pointer to place a verdict(VERDICT_HOLD - a packet is held
+ *           by a tcp reassembly)
+ * mark - a pointer to place a mark
+ * vh - a pointer to place held packets, which get the same verdict, and
+ *      released ones, which must be accepted
+ */
+void
+pkt_verdict_get(unsigned char *data, int size, uint32_t id,
+  uint32_t *verdict, uint32_t *mark, struct verdict_held *vh)
+{
+	struct pkt *pkt;
+	struct pkt_nfq *pkt_nfq;
+	struct elist *elist = NULL;
+	struct elist_chain *elchain;
+	struct flow_key key;
+	uint32_t mark_def;
+	unsigned int gen, attrs, snoop_tag = UINT_MAX;
+	int is_key = 0, is_cacheable = 0;
+	enum elist_act act, act_def;
+	
+	*verdict = NF_ACCEPT;
+	*mark = 0;
+	vh->held_cnt = 0;
+	/* a generation is got before a chain: a result got with a newer chain
+	 * is stored as a stale one, never the reverse */
+	gen = conf_gen_get();
+	if ((opts.fcache_size) || (opts.dnssnoop_size))
+		is_key = flow_key_get(data, size, &key) == 0;
+	if ((opts.fcache_size) && (is_key) && (key.sport)) {
+		if (flow_cache_lookup(&key, gen, verdict, mark)) {
+			DBG_OUT("%u: VERDICT FROM FLOW CACHE - %u(mark - %u)", id,
+			  *verdict, *mark);
+			goto out;
+		}
+		is_cacheable = 1;
+	}
+	elchain = conf_get_elist_chain();
+	attrs = elchain->pkt_attrs;
+	/* a destination learned from a dns answer is matched at the ip layer:
+	 * if no elist with a higher priority has payload entries, a payload
+	 * can't change a verdict, so it isn't parsed(and the verdict is
+	 * final) */
+	if ((opts.dnssnoop_size) && (is_key) &&
+	  (dnssnoop_lookup(key.daddr, gen, &snoop_tag)) &&
+	  (snoop_tag < elchain->elists_cnt) &&
+	  (snoop_tag <= elchain->payload_tag_min))
+		attrs &= PKT_ATTR_ADDR | PKT_ATTR_PORT;
+	/* answers are snooped only for names of domain lists */
+	if ((opts.dnssnoop_size) && (attrs & PKT_ATTR_DOMAIN))
+		attrs |= PKT_ATTR_ANSWER;
+	pkt = pkt_make(data, size, id, attrs);
+	if (!pkt)
+		goto out;
+	pkt_nfq = (struct pkt_nfq*)pkt;
+	if (pkt_nfq->is_held) {
+		*verdict = VERDICT_HOLD;
+		DBG_OUT("%u: VERDICT - HOLD", id);
+		goto out_free;
+	}
+	pkt_dump(pkt);
+	if (!is_pkt_match(elchain, snoop_tag, pkt, &elist, &act, mark,
+	  &act_def, &mark_def)) {
+		act = act_def;
+		*mark = mark_def;
+	}
+	switch (act) {
+	case elist_act_accept:
+		*verdict = NF_ACCEPT;
+		DBG_OUT("%u: VERDICT - ACCEPT(mark - %u)", id, *mark);
+		break;
+	case elist_act_drop:
+		*verdict = NF_DROP;
+		DBG_OUT("%u: VERDICT - DROP", id);
+		break;
+	case elist_act_repeat:
+		*verdict = NF_REPEAT;
+		DBG_OUT("%u: VERDICT - REPEAT(mark - %u)", id, *mark);
+		break;
+	case elist_act_sinkhole:
+		/* a query is answered instead of client retries */
+		*verdict = NF_DROP;
+		if (sinkhole_answer(pkt, elist) == 0)
+			DBG_OUT("%u: VERDICT - DROP(sinkhole answer is sent)", id);
+		else
+			DBG_OUT("%u: VERDICT - DROP", id);
+		break;
+	}
+	if (attrs & PKT_ATTR_ANSWER)
+		dns_answer_learn(elchain, gen, pkt);
+	/* every sinkholed query needs its own answer, so such a verdict is
+	 * never offloaded or cached */
+	if ((act != elist_act_sinkhole) && (is_flow_final(pkt))) {
+		if ((opts.offload_mark) && (*verdict != NF_DROP)) {
+			*mark |= opts.offload_mark;
+			DBG_OUT("%u: flow is offloaded(mark - %u)", id, *mark);
 		}
+		if (is_cacheable)
+			flow_cache_add(&key, gen, *verdict, *mark);
+	}
+	/* held ids are in the packet arena */
+	vh->held_cnt = pkt_nfq->held_cnt;
+	if (vh->held_cnt) {
+		memcpy(vh->held, pkt_nfq->held_ids,
+		  sizeof(*vh->held) * vh->held_cnt);
+		DBG_OUT("%u: verdict is set for %u held packets", id, vh->held_cnt);
 	}
 	
+out_free:
+	pkt_free(pkt);
 out:
-	conf_release_elist_chain(elchain);
+	vh->released_cnt = reasm_released_get(vh->released, REASM_RELEASED_MAX);
+	vh->released_cnt += ipfrag_released_get(vh->released + vh->released_cnt,
+	  IPFRAG_RELEASED_MAX);
+}
+
+/*
+ * Delete expired reassembled flows and fragmented datagrams of the current
+ * thread, if SWEEP_INTERVAL is passed since the last sweep. Held packets
+ * of deleted ones are released.
+ * vh - a pointer to place released packets, which must be accepted
+ *
+ * return:
+ *   0 - a sweep is finished or isn't needed
+ *   1 - a sweep isn't finished; call it again after vh packets are
+ *       accepted
+ */
+int
+pkt_sweep(struct verdict_held *vh)
+{
+	static __thread time_t sweep_ts;
+	/* tables with an unfinished sweep */
+	static __thread int is_reasm_left, is_ipfrag_left;
+	struct timespec now;
 	
-	return ret;
+	vh->held_cnt = 0;
+	vh->released_cnt = 0;
+	if ((!is_reasm_left) && (!is_ipfrag_left)) {
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+		if (now.tv_sec - sweep_ts < SWEEP_INTERVAL)
+			return 0;
+		sweep_ts = now.tv_sec;
+		is_reasm_left = 1;
+		is_ipfrag_left = 1;
+	}
+	if (is_reasm_left)
+		is_reasm_left = reasm_sweep();
+	if (is_ipfrag_left)
+		is_ipfrag_left = ipfrag_sweep();
+	vh->released_cnt = reasm_released_get(vh->released, REASM_RELEASED_MAX);
+	vh->released_cnt += ipfrag_released_get(vh->released + vh->released_cnt,
+	  IPFRAG_RELEASED_MAX);
+	
+	return is_reasm_left || is_ipfrag_left;
 }
 
 static int
 cb(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struct nfq_data *nfad,
   void *data)
 {
+	struct thread_data *td = (struct thread_data*)data;
 	struct nfqnl_msg_packet_hdr *ph;
 	unsigned char *payload;
-	struct pkt *pkt;
-	unsigned int verdict = NF_ACCEPT;
-	uint32_t mark = 0, mark_def;
-	enum elist_act act, act_def;
+	uint32_t id, verdict, mark;
+	struct verdict_held vh;
 	int ret;
 	
 	ph = nfq_get_msg_packet_hdr(nfad);
@@ -508,43 +1044,20 @@ cb(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struct nfq_data *nfad,
 		ERR_OUT("nfq_get_payload() error");
 		return 0;
 	}
-	pkt = pkt_make(payload, ret, ntohl(ph->packet_id));
-	if (pkt) {
-		pkt_dump(pkt);
-		if (!is_pkt_match(pkt, &act, &mark, &act_def, &mark_def)) {
-			act = act_def;
-			mark = mark_def;
-		}
-		switch (act) {
-		case elist_act_accept:
-			verdict = NF_ACCEPT;
-			DBG_OUT("%u: VERDICT - ACCEPT(mark - %u)",
-			  ntohl(ph->packet_id), mark);
-			break;
-		case elist_act_drop:
-			verdict = NF_DROP;
-			DBG_OUT("%u: VERDICT - DROP", ntohl(ph->packet_id));
-			break;
-		case elist_act_repeat:
-			verdict = NF_REPEAT;
-			DBG_OUT("%u: VERDICT - REPEAT(mark - %u)",
-			  ntohl(ph->packet_id), mark);
-			break;
-		}
-		pkt_free(pkt);
+	id = ntohl(ph->packet_id);
+	if (opts.workers) {
+		pipeline_push(td, id, payload, ret);
+		return 0;
 	}
-
-	ret = nfq_set_verdict2(qh, ntohl(ph->packet_id), verdict, mark, 0, NULL);
-	if (ret < 0)
-		ERR_OUT("nfq_set_verdict() error");
+	pkt_verdict_get(payload, ret, id, &verdict, &mark, &vh);
 	
-	return ret;
+	return verdict_held_set(&td->vb, &vh, id, verdict, mark);
 }
 
 static void
 threads_init(void)
 {
-	unsigned int n, i;
+	unsigned int n, i, nq;
 	
 	n = opts.qn_last - opts.qn_first + 1;
 	thread_data = malloc(sizeof(*thread_data) * n);
@@ -554,17 +1067,22 @@ threads_init(void)
 	}
 	memset(thread_data, 0, sizeof(*thread_data) * n);
 
+	nq = (opts.io_engine == io_engine_uring) ? opts.uring_nq : 1;
 	for(i = 0; i < n; i++) {
 		thread_data[i].idx = i;
 		thread_data[i].nfq_num = opts.qn_first + i;
+		if ((i % nq) == 0)
+			thread_data[i].nq = ((n - i) < nq) ? (n - i) : nq;
 	}
 }
 
 static struct nfq_handle*
-init_nfq(unsigned int nfq_num)
+init_nfq(struct thread_data *td)
 {
+	unsigned int nfq_num = td->nfq_num;
 	struct nfq_handle *h;
 	struct nfq_q_handle *qh;
+	struct timeval tv;
 	int size, ret;
 	
 	ret = pthread_mutex_lock(&nfq_open_mut);
@@ -584,17 +1102,17 @@ init_nfq(unsigned int nfq_num)
 		exit(EXIT_FAILURE);
 	}
 	
-	if (nfq_unbind_pf(h, AF_INET) < 0) {
+	if ((nfq_unbind_pf(h, AF_INET) < 0) || (nfq_unbind_pf(h, AF_INET6) < 0)) {
 		ERR_OUT("thread %u: nfq error: queue %d nfq_bind_pf() error",
 		  thread_idx, nfq_num);
 		exit(EXIT_FAILURE);
 	}
-	if (nfq_bind_pf(h, AF_INET) < 0) {
+	if ((nfq_bind_pf(h, AF_INET) < 0) || (nfq_bind_pf(h, AF_INET6) < 0)) {
 		ERR_OUT("thread %u: nfq error: queue %d nfq_bind_pf() error",
 		  thread_idx, nfq_num);
 		exit(EXIT_FAILURE);
 	}
-	qh = nfq_create_queue(h, nfq_num, &cb, NULL);
+	qh = nfq_create_queue(h, nfq_num, &cb, td);
 	if (!qh) {
 		ERR_OUT("thread %u: nfq error: queue %d nfq_create_queue() error",
 		  thread_idx, nfq_num);
@@ -605,6 +1123,7 @@ init_nfq(unsigned int nfq_num)
 		  thread_idx, nfq_num);
 		exit(EXIT_FAILURE);
 	}
+	verdict_batch_init(&td->vb, qh, nfq_num);
 
 	size = nfq_set_queue_maxlen(qh, QUEUE_MAXLEN);
 	if (size < 0)
@@ -626,37 +1145,153 @@ init_nfq(unsigned int nfq_num)
 		exit(EXIT_FAILURE);
 	}
 	
+	/* expired reassembled flows are deleted without incoming packets */
+	tv.tv_sec = SWEEP_INTERVAL;
+	tv.tv_usec = 0;
+	ret = setsockopt(nfq_fd(h), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (ret != 0) {
+		ERR_OUT("setsockopt() error: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	
 	return h;
 }
 
-static void*
-thread_start(void *data)
+/*
+ * Receive netlink messages one per recv() call.
+ */
+static void
+recv_loop(struct thread_data *td, struct nfq_handle *h)
 {
-	struct nfq_handle *h;
 	int fd, n;
 	char *pkt_buf;
-	struct thread_data *td = (struct thread_data*)data;
-
-	thread_idx = td->idx;
-
-	INFO_OUT("start thread %u[%u] for nfqueue %u", thread_idx,
-	  syscall(SYS_gettid), td->nfq_num);
 	
-	pkt_buf = malloc(80000);
+	pkt_buf = malloc(PKT_BUF_SIZE);
 	if (!pkt_buf) {
 		ERR_OUT("packet buffer allocating error: no memory");
 		exit(EXIT_FAILURE);
 	}
-	h = init_nfq(td->nfq_num);
 	fd = nfq_fd(h);
-	while ((n = recv(fd, pkt_buf, 80000, 0)) > 0) {
-		nfq_handle_packet(h, pkt_buf, n);
+	/* While a batch isn't empty, do not block in recv(). The batch is
+	 * flushed as soon as the socket receive buffer is drained. */
+	for(;;) {
+		conf_offline();
+		n = recv(fd, pkt_buf, PKT_BUF_SIZE, td->vb.cnt ? MSG_DONTWAIT : 0);
+		conf_online();
+		if (n > 0) {
+			nfq_handle_packet(h, pkt_buf, n);
+			verdict_sweep(&td->vb);
+			verdict_flush_expired(&td->vb);
+		} else if ((n < 0) && (errno == EAGAIN)) {
+			verdict_sweep(&td->vb);
+			verdict_flush(&td->vb);
+		} else {
+			break;
+		}
 	}
+	/* a config isn't used until the thread is unregistered */
+	conf_offline();
 	ERR_OUT("recv error: %s", strerror(errno));
-	if (nfq_close(h) != 0) {
-		ERR_OUT("nfq_close() error");
+	free(pkt_buf);
+}
+
+/*
+ * Receive up to MMSG_VLEN netlink messages per recvmmsg() call and
+ * process them back to back.
+ */
+static void
+recvmmsg_loop(struct thread_data *td, struct nfq_handle *h)
+{
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	char *pkt_bufs;
+	int fd, n, i;
+	
+	msgs = malloc(sizeof(*msgs) * MMSG_VLEN);
+	iovs = malloc(sizeof(*iovs) * MMSG_VLEN);
+	pkt_bufs = malloc(PKT_BUF_SIZE * MMSG_VLEN);
+	if ((!msgs) || (!iovs) || (!pkt_bufs)) {
+		ERR_OUT("packet buffers allocating error: no memory");
 		exit(EXIT_FAILURE);
 	}
+	memset(msgs, 0, sizeof(*msgs) * MMSG_VLEN);
+	for(i = 0; i < MMSG_VLEN; i++) {
+		iovs[i].iov_base = pkt_bufs + PKT_BUF_SIZE * i;
+		iovs[i].iov_len = PKT_BUF_SIZE;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	fd = nfq_fd(h);
+	/* Block only until the first message is received(and only if a verdict
+	 * batch is empty). Less than MMSG_VLEN messages means that the socket
+	 * receive buffer is drained. */
+	for(;;) {
+		conf_offline();
+		n = recvmmsg(fd, msgs, MMSG_VLEN,
+		  td->vb.cnt ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+		conf_online();
+		if (n > 0) {
+			for(i = 0; i < n; i++)
+				nfq_handle_packet(h, iovs[i].iov_base, msgs[i].msg_len);
+			verdict_sweep(&td->vb);
+			if (n < MMSG_VLEN)
+				verdict_flush(&td->vb);
+			else
+				verdict_flush_expired(&td->vb);
+		} else if ((n < 0) && (errno == EAGAIN)) {
+			verdict_sweep(&td->vb);
+			verdict_flush(&td->vb);
+		} else {
+			break;
+		}
+	}
+	/* a config isn't used until the thread is unregistered */
+	conf_offline();
+	ERR_OUT("recvmmsg error: %s", strerror(errno));
+	free(pkt_bufs);
+	free(iovs);
+	free(msgs);
+}
+
+static void*
+thread_start(void *data)
+{
+	struct thread_data *td = (struct thread_data*)data;
+	unsigned int i;
+
+	thread_idx = td->idx;
+
+	INFO_OUT("start thread %u[%u] for nfqueue %u-%u", thread_idx,
+	  syscall(SYS_gettid), td->nfq_num, td->nfq_num + td->nq - 1);
+	
+	if (conf_reader_register() < 0) {
+		ERR_OUT("config reader registering error: no memory");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < td->nq; i++) {
+		td[i].h = init_nfq(&td[i]);
+		if (opts.workers)
+			pipeline_start(&td[i]);
+	}
+	switch (opts.io_engine) {
+	case io_engine_recv:
+		recv_loop(td, td->h);
+		break;
+	case io_engine_recvmmsg:
+		recvmmsg_loop(td, td->h);
+		break;
+	case io_engine_uring:
+#ifdef WITH_URING
+		uring_loop(td, td->nq);
+#endif
+		break;
+	}
+	for(i = 0; i < td->nq; i++)
+		if (nfq_close(td[i].h) != 0) {
+			ERR_OUT("nfq_close() error");
+			exit(EXIT_FAILURE);
+		}
+	conf_reader_unregister();
 	
 	return NULL;
 }
@@ -683,6 +1318,9 @@ main(int argc, char **argv)
 		exit(2);
 	if (conf_parse(opts.conf_name) < 0)
 		exit(2);
+	if ((opts.dnssnoop_size) &&
+	  (dnssnoop_init(opts.dnssnoop_size, opts.dnssnoop_ttl) < 0))
+		exit(EXIT_FAILURE);
 	
 	threads_init();
 
@@ -697,7 +1335,7 @@ main(int argc, char **argv)
 	}
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	for(i = 0; i <= (opts.qn_last - opts.qn_first); i++) {
+	for(i = 0; i <= (opts.qn_last - opts.qn_first); i += thread_data[i].nq) {
 		ret = pthread_create(&(thread_data[i].id), &attr, thread_start,
 		  &thread_data[i]);
 		if (ret != 0) {
@@ -1,14 +1,54 @@
 #ifndef __MAIN_H__
 #define __MAIN_H__
 
+#include <stdint.h>
 #include <pthread.h>
+#include "verdict.h"
 
 
+/* an interval(sec) of expired reassembled flows and fragmented datagrams
+ * deleting; receive loops and workers don't sleep longer */
+#define SWEEP_INTERVAL 1
+
+
+enum io_engine {
+	io_engine_recv,
+	io_engine_recvmmsg,
+	io_engine_uring
+};
+
 struct global_opts {
 	unsigned int is_debug;
 	unsigned int is_foreground;
 	unsigned int qn_first;
 	unsigned int qn_last;
+	unsigned int vbatch_size;
+	unsigned int vbatch_latency;
+	enum io_engine io_engine;
+	unsigned int uring_nq;
+	unsigned int workers;
+	/* mark bits to set on a packet of a flow with a final verdict */
+	uint32_t offload_mark;
+	/* flow cache size(0 - no cache), idle and max entry lifetime(sec) */
+	unsigned int fcache_size;
+	unsigned int fcache_idle;
+	unsigned int fcache_max;
+	/* tcp reassembly flows number(0 - no reassembly), max buffered bytes
+	 * and max flow lifetime(sec) */
+	unsigned int reasm_size;
+	unsigned int reasm_bytes;
+	unsigned int reasm_timeout;
+	/* ipv4 fragments reassembly datagrams number(0 - no reassembly), max
+	 * datagram payload size and max datagram lifetime(sec) */
+	unsigned int frag_size;
+	unsigned int frag_bytes;
+	unsigned int frag_timeout;
+	/* dns snooping table size(0 - no snooping) and max address
+	 * lifetime(sec) */
+	unsigned int dnssnoop_size;
+	unsigned int dnssnoop_ttl;
+	/* hold verdicts of buffered segments and fragments */
+	unsigned int is_reasm_hold;
 	const char *pidfile_name;
 	const char *conf_name;
 };
@@ -17,6 +57,12 @@ struct thread_data {
 	pthread_t id;
 	unsigned int idx;
 	unsigned int nfq_num;
+	/* number of queues serviced by this thread(starting from this one) */
+	unsigned int nq;
+	struct nfq_handle *h;
+	struct verdict_batch vb;
+	/* classifier workers(opts.workers items) */
+	struct pipe_worker *workers;
 	int ret;
 };
 
@@ -24,4 +70,30 @@ struct thread_data {
 extern __thread unsigned int thread_idx;
 
 
+/*
+ * Parse and filter a packet.
+ * data - a packet data
+ * size - a packet size
+ * id - a packet id
+ * verdict - a pointer to place a verdict(VERDICT_HOLD - a packet is held
+ *           by a tcp reassembly)
+ * mark - a pointer to place a mark
+ * vh - a pointer to place held packets, which get the same verdict, and
+ *      released ones, which must be accepted
+ */
+void pkt_verdict_get(unsigned char *data, int size, uint32_t id, uint32_t *verdict, uint32_t *mark, struct verdict_held *vh);
+/*
+ * Delete expired reassembled flows and fragmented datagrams of the current
+ * thread, if SWEEP_INTERVAL is passed since the last sweep. Held packets
+ * of deleted ones are released.
+ * vh - a pointer to place released packets, which must be accepted
+ *
+ * return:
+ *   0 - a sweep is finished or isn't needed
+ *   1 - a sweep isn't finished; call it again after vh packets are
+ *       accepted
+ */
+int pkt_sweep(struct verdict_held *vh);
+
+
 #endif /* __MAIN_H__ */
\ No newline at end of file
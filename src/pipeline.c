@@ -0,0 +1,320 @@
+/*
+ * traffic filter
+ * Copyright (C) 2017, Oleg Nemanov <lego12239@yandex.ru>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <libnetfilter_queue/libnetfilter_queue.h>
+#include "main.h"
+#include "log.h"
+#include "conf.h"
+#include "flow.h"
+#include "verdict.h"
+#include "pipeline.h"
+
+
+/* must be a power of 2 */
+#define PIPE_RING_SIZE 1024
+/* packets that are bigger are copied to allocated memory */
+#define PIPE_PKT_BUF_SIZE 2048
+/* ring polls before going to sleep */
+#define PIPE_SPIN_CNT 256
+
+
+extern struct global_opts opts;
+
+
+struct pipe_pkt {
+	uint32_t id;
+	int size;
+	unsigned char *data;
+	unsigned char buf[PIPE_PKT_BUF_SIZE];
+};
+
+/*
+ * Single producer(a queue receiving thread), single consumer(a worker)
+ * ring.
+ */
+struct pipe_ring {
+	/* written by a producer only */
+	unsigned int head __attribute__ ((aligned(64)));
+	/* written by a consumer only */
+	unsigned int tail __attribute__ ((aligned(64)));
+	/* a consumer sleeps on an empty ring */
+	unsigned int is_sleeping __attribute__ ((aligned(64)));
+	/* a producer sleeps on a full ring */
+	unsigned int is_full_sleeping;
+	pthread_mutex_t mut;
+	/* both can't sleep at once, so one cond is enough */
+	pthread_cond_t cond;
+	struct pipe_pkt *slots;
+};
+
+struct pipe_worker {
+	pthread_t id;
+	unsigned int idx;
+	struct thread_data *td;
+	struct pipe_ring ring;
+};
+
+
+static void _pipe_verdict_send(struct thread_data *td, int fd, uint32_t id,
+  uint32_t verdict, uint32_t mark);
+static void* _worker_start(void *data);
+
+
+/*
+ * Start opts.workers classifier threads for a queue. The queue nfq handle
+ * must be already initialized.
+ * td - a queue thread data
+ */
+void
+pipeline_start(struct thread_data *td)
+{
+	struct pipe_worker *w;
+	pthread_attr_t attr;
+	pthread_condattr_t cattr;
+	unsigned int i;
+	int ret;
+	
+	w = malloc(sizeof(*w) * opts.workers);
+	if (!w) {
+		ERR_OUT("pipeline workers allocating error: no memory");
+		exit(EXIT_FAILURE);
+	}
+	memset(w, 0, sizeof(*w) * opts.workers);
+	td->workers = w;
+	
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	/* a worker sleep is timed by a monotonic clock */
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	for(i = 0; i < opts.workers; i++) {
+		w[i].idx = i;
+		w[i].td = td;
+		w[i].ring.slots = malloc(sizeof(*w[i].ring.slots) * PIPE_RING_SIZE);
+		if (!w[i].ring.slots) {
+			ERR_OUT("pipeline ring allocating error: no memory");
+			exit(EXIT_FAILURE);
+		}
+		pthread_mutex_init(&w[i].ring.mut, NULL);
+		pthread_cond_init(&w[i].ring.cond, &cattr);
+		ret = pthread_create(&w[i].id, &attr, _worker_start, &w[i]);
+		if (ret != 0) {
+			ERR_OUT("worker thread creation error: %s", strerror(ret));
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_condattr_destroy(&cattr);
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Wait until a ring isn't full. Poll it for a while, then sleep.
+ */
+static void
+_ring_full_wait(struct pipe_ring *r, unsigned int head)
+{
+	unsigned int i;
+	
+	for(i = 0; i < PIPE_SPIN_CNT; i++)
+		if ((head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) !=
+		  PIPE_RING_SIZE)
+			return;
+	
+	conf_offline();
+	pthread_mutex_lock(&r->mut);
+	__atomic_store_n(&r->is_full_sleeping, 1, __ATOMIC_SEQ_CST);
+	while ((head - __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST)) ==
+	  PIPE_RING_SIZE)
+		pthread_cond_wait(&r->cond, &r->mut);
+	__atomic_store_n(&r->is_full_sleeping, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&r->mut);
+	conf_online();
+}
+
+/*
+ * Pass a packet to a queue classifier worker. All packets of the same flow
+ * are passed to the same worker to keep their order. A packet data is
+ * copied. Block while a worker ring is full. A packet, that can't be
+ * copied(no memory), is accepted at once.
+ * td - a queue thread data
+ * id - a packet id
+ * data - a packet data
+ * size - a packet size
+ */
+void
+pipeline_push(struct thread_data *td, uint32_t id, unsigned char *data,
+  int size)
+{
+	struct pipe_worker *w;
+	struct pipe_ring *r;
+	struct pipe_pkt *p;
+	struct flow_key key;
+	unsigned int head;
+	unsigned char *pdata;
+	
+	if (flow_key_get(data, size, &key) == 0)
+		w = &td->workers[flow_key_hash_sym(&key) % opts.workers];
+	else
+		w = &td->workers[0];
+	r = &w->ring;
+	
+	if (size <= PIPE_PKT_BUF_SIZE) {
+		pdata = NULL;
+	} else {
+		pdata = malloc(size);
+		if (!pdata) {
+			ERR_OUT("pipeline packet %u copying error: no memory; "
+			  "accept it", id);
+			_pipe_verdict_send(td, nfq_fd(td->h), id, NF_ACCEPT, 0);
+			return;
+		}
+	}
+	
+	head = r->head;
+	if ((head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) ==
+	  PIPE_RING_SIZE)
+		_ring_full_wait(r, head);
+	
+	p = &r->slots[head & (PIPE_RING_SIZE - 1)];
+	p->id = id;
+	p->size = size;
+	p->data = (pdata) ? pdata : p->buf;
+	memcpy(p->data, data, size);
+	
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->is_sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&r->mut);
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->mut);
+	}
+}
+
+/*
+ * Wait until a ring isn't empty. Poll it for a while, then sleep(no longer
+ * than SWEEP_INTERVAL).
+ *
+ * return:
+ *   0 - a ring isn't empty
+ *  -1 - a timeout is expired
+ */
+static int
+_ring_wait(struct pipe_ring *r, unsigned int tail)
+{
+	struct timespec ts;
+	unsigned int i;
+	int ret = 0;
+	
+	for(i = 0; i < PIPE_SPIN_CNT; i++)
+		if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != tail)
+			return 0;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += SWEEP_INTERVAL;
+	conf_offline();
+	pthread_mutex_lock(&r->mut);
+	__atomic_store_n(&r->is_sleeping, 1, __ATOMIC_SEQ_CST);
+	while ((__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == tail) &&
+	  (ret != ETIMEDOUT))
+		ret = pthread_cond_timedwait(&r->cond, &r->mut, &ts);
+	__atomic_store_n(&r->is_sleeping, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&r->mut);
+	conf_online();
+	
+	return (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != tail) ? 0 : -1;
+}
+
+/*
+ * Send a verdict of a pipeline packet. Workers send verdicts out of order,
+ * so only single packet verdicts are possible.
+ */
+static void
+_pipe_verdict_send(struct thread_data *td, int fd, uint32_t id,
+  uint32_t verdict, uint32_t mark)
+{
+	char msg[64];
+	int len;
+	
+	len = verdict_msg_make(msg, sizeof(msg), td->nfq_num, 0, id,
+	  verdict, mark);
+	if (send(fd, msg, len, 0) < 0)
+		ERR_OUT("verdict send error: %s", strerror(errno));
+}
+
+static void*
+_worker_start(void *data)
+{
+	struct pipe_worker *w = data;
+	struct pipe_ring *r = &w->ring;
+	struct pipe_pkt *p;
+	struct verdict_held vh;
+	uint32_t verdict, mark;
+	unsigned int tail, i;
+	int fd, is_more;
+	
+	thread_idx = w->td->idx;
+	INFO_OUT("start worker %u[%u] for nfqueue %u", w->idx,
+	  syscall(SYS_gettid), w->td->nfq_num);
+	
+	if (conf_reader_register() < 0) {
+		ERR_OUT("config reader registering error: no memory");
+		exit(EXIT_FAILURE);
+	}
+	fd = nfq_fd(w->td->h);
+	tail = r->tail;
+	for(;;) {
+		conf_quiescent();
+		do {
+			is_more = pkt_sweep(&vh);
+			for(i = 0; i < vh.released_cnt; i++)
+				_pipe_verdict_send(w->td, fd, vh.released[i], NF_ACCEPT, 0);
+		} while (is_more);
+		if ((__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) &&
+		  (_ring_wait(r, tail) < 0))
+			continue;
+		p = &r->slots[tail & (PIPE_RING_SIZE - 1)];
+		
+		pkt_verdict_get(p->data, p->size, p->id, &verdict, &mark, &vh);
+		for(i = 0; i < vh.released_cnt; i++)
+			_pipe_verdict_send(w->td, fd, vh.released[i], NF_ACCEPT, 0);
+		for(i = 0; i < vh.held_cnt; i++)
+			_pipe_verdict_send(w->td, fd, vh.held[i], verdict, mark);
+		if (verdict != VERDICT_HOLD)
+			_pipe_verdict_send(w->td, fd, p->id, verdict, mark);
+		
+		if (p->data != p->buf)
+			free(p->data);
+		tail++;
+		__atomic_store_n(&r->tail, tail, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&r->is_full_sleeping, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&r->mut);
+			pthread_cond_signal(&r->cond);
+			pthread_mutex_unlock(&r->mut);
+		}
+	}
+	
+	return NULL;
+}
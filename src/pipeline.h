@@ -0,0 +1,27 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <stdint.h>
+#include "main.h"
+
+
+/*
+ * Start opts.workers classifier threads for a queue. The queue nfq handle
+ * must be already initialized.
+ * td - a queue thread data
+ */
+void pipeline_start(struct thread_data *td);
+/*
+ * Pass a packet to a queue classifier worker. All packets of the same flow
+ * are passed to the same worker to keep their order. A packet data is
+ * copied. Block while a worker ring is full. A packet, that can't be
+ * copied(no memory), is accepted at once.
+ * td - a queue thread data
+ * id - a packet id
+ * data - a packet data
+ * size - a packet size
+ */
+void pipeline_push(struct thread_data *td, uint32_t id, unsigned char *data, int size);
+
+
+#endif  /* __PIPELINE_H__ */
@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "arena.h"
+
+
+struct pkt_arena_chunk {
+	struct pkt_arena_chunk *next;
+	size_t size;
+	char data[] __attribute__ ((aligned (PKT_ARENA_ALIGN)));
+};
+
+struct pkt_arena {
+	/* chunks of PKT_ARENA_CHUNK_SIZE; they are kept on reset */
+	struct pkt_arena_chunk *first;
+	struct pkt_arena_chunk *cur;
+	/* chunks for blocks larger than PKT_ARENA_CHUNK_SIZE; they are freed
+	 * on reset */
+	struct pkt_arena_chunk *large;
+	size_t off;
+	/* the last allocated block(for pkt_realloc()) */
+	void *last;
+};
+
+
+static __thread struct pkt_arena arena;
+
+
+static struct pkt_arena_chunk*
+_chunk_make(size_t size)
+{
+	struct pkt_arena_chunk *c;
+	
+	c = malloc(sizeof(*c) + size);
+	if (!c)
+		return NULL;
+	c->next = NULL;
+	c->size = size;
+	
+	return c;
+}
+
+static void*
+_pkt_alloc(size_t size)
+{
+	struct pkt_arena_chunk *c;
+	void *p;
+	
+	size = (size + PKT_ARENA_ALIGN - 1) & ~(size_t)(PKT_ARENA_ALIGN - 1);
+	if (size > PKT_ARENA_CHUNK_SIZE) {
+		c = _chunk_make(size);
+		if (!c)
+			return NULL;
+		c->next = arena.large;
+		arena.large = c;
+		return c->data;
+	}
+	
+	if ((!arena.cur) || (arena.off + size > arena.cur->size)) {
+		if ((arena.cur) && (arena.cur->next)) {
+			arena.cur = arena.cur->next;
+		} else {
+			c = _chunk_make(PKT_ARENA_CHUNK_SIZE);
+			if (!c)
+				return NULL;
+			if (arena.cur)
+				arena.cur->next = c;
+			else
+				arena.first = c;
+			arena.cur = c;
+		}
+		arena.off = 0;
+	}
+	p = arena.cur->data + arena.off;
+	arena.off += size;
+	arena.last = p;
+	
+	return p;
+}
+
+/*
+ * Allocate a zeroed memory block from a thread arena.
+ *
+ * return:
+ *   pointer - if everything is ok
+ *   NULL - if a memory error occured
+ */
+void*
+pkt_alloc(size_t size)
+{
+	void *p;
+	
+	p = _pkt_alloc(size);
+	if (p)
+		memset(p, 0, size);
+	
+	return p;
+}
+
+/*
+ * Resize a block allocated with pkt_alloc(). The last allocated block
+ * is resized in place if possible.
+ * p - a block(can be NULL)
+ * old_size - a current block size
+ * size - a new block size
+ *
+ * return:
+ *   pointer - if everything is ok
+ *   NULL - if a memory error occured
+ */
+void*
+pkt_realloc(void *p, size_t old_size, size_t size)
+{
+	void *p_new;
+	size_t off;
+	
+	if ((p) && (p == arena.last)) {
+		off = (char*)p - arena.cur->data;
+		if (off + size <= arena.cur->size) {
+			arena.off = (off + size + PKT_ARENA_ALIGN - 1) &
+			  ~(size_t)(PKT_ARENA_ALIGN - 1);
+			return p;
+		}
+	}
+	p_new = _pkt_alloc(size);
+	if ((p_new) && (p))
+		memcpy(p_new, p, old_size < size ? old_size : size);
+	
+	return p_new;
+}
+
+/*
+ * Copy at most n characters of s to a null terminated string allocated
+ * from a thread arena.
+ *
+ * return:
+ *   pointer - if everything is ok
+ *   NULL - if a memory error occured
+ */
+char*
+pkt_strndup(const char *s, size_t n)
+{
+	char *p;
+	
+	n = strnlen(s, n);
+	p = _pkt_alloc(n + 1);
+	if (!p)
+		return NULL;
+	memcpy(p, s, n);
+	p[n] = '\0';
+	
+	return p;
+}
+
+/*
+ * Free all blocks of a thread arena.
+ */
+void
+pkt_arena_reset(void)
+{
+	struct pkt_arena_chunk *c;
+	
+	while (arena.large) {
+		c = arena.large;
+		arena.large = c->next;
+		free(c);
+	}
+	arena.cur = arena.first;
+	arena.off = 0;
+	arena.last = NULL;
+}
@@ -0,0 +1,50 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/*
+ * A per-thread bump allocator for a packet parsing. All packet structures
+ * are allocated from it and are freed at once by pkt_arena_reset() (which
+ * pkt_free() calls), so a thread can have only one packet at a time.
+ */
+#define PKT_ARENA_CHUNK_SIZE 65536
+#define PKT_ARENA_ALIGN 16
+
+
+/*
+ * Allocate a zeroed memory block from a thread arena.
+ *
+ * return:
+ *   pointer - if everything is ok
+ *   NULL - if a memory error occured
+ */
+void* pkt_alloc(size_t size);
+/*
+ * Resize a block allocated with pkt_alloc(). The last allocated block
+ * is resized in place if possible.
+ * p - a block(can be NULL)
+ * old_size - a current block size
+ * size - a new block size
+ *
+ * return:
+ *   pointer - if everything is ok
+ *   NULL - if a memory error occured
+ */
+void* pkt_realloc(void *p, size_t old_size, size_t size);
+/*
+ * Copy at most n characters of s to a null terminated string allocated
+ * from a thread arena.
+ *
+ * return:
+ *   pointer - if everything is ok
+ *   NULL - if a memory error occured
+ */
+char* pkt_strndup(const char *s, size_t n);
+/*
+ * Free all blocks of a thread arena.
+ */
+void pkt_arena_reset(void);
+
+
+#endif  /* __ARENA_H__ */
@@ -0,0 +1,411 @@
+#include <netinet/ip.h>
+#include <endian.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "log.h"
+#include "pkt.h"
+#include "pkt_ip.h"
+#include "ipfrag.h"
+#include "pkts_hdlrs.h"
+
+
+struct ipfrag_table {
+	struct ipfrag_flow *f;
+	unsigned char *bufs;
+	unsigned int mask;
+	/* a number of used slots(no sweep is done for an empty table) */
+	unsigned int used_cnt;
+	/* a next slot to check by a sweep */
+	unsigned int sweep_idx;
+	/* ids of held fragments of expired and evicted datagrams */
+	uint32_t released[IPFRAG_RELEASED_MAX];
+	unsigned int released_cnt;
+};
+
+
+static unsigned int ipfrag_size;
+static unsigned int ipfrag_bytes;
+static unsigned int ipfrag_timeout;
+static int ipfrag_is_hold;
+
+static __thread struct ipfrag_table *ftable;
+
+
+/*
+ * Set fragments reassembly parameters. Must be called before packets
+ * processing.
+ * size - max number of datagrams in a table of each thread(0 - no
+ *        reassembly)
+ * bytes - max payload size of a datagram
+ * timeout - max datagram lifetime in seconds
+ * is_hold - hold verdicts of buffered fragments
+ */
+void
+ipfrag_set(unsigned int size, unsigned int bytes, unsigned int timeout,
+  int is_hold)
+{
+	ipfrag_size = size;
+	ipfrag_bytes = bytes;
+	ipfrag_timeout = timeout;
+	ipfrag_is_hold = is_hold;
+}
+
+/*
+ * Get a table of the current thread. It's allocated on the first call:
+ * all datagrams buffers are allocated at once, so a memory usage is
+ * bounded.
+ *
+ * return:
+ *   table - a pointer to a table
+ *   NULL - a reassembly is off or a memory error occured
+ */
+static struct ipfrag_table*
+_ipfrag_table_get(void)
+{
+	struct ipfrag_table *t;
+	unsigned int size, i;
+	
+	if ((ftable) || (!ipfrag_size))
+		return ftable;
+	
+	/* round up to a power of 2 */
+	for(size = 1; size < ipfrag_size; size <<= 1);
+	t = malloc(sizeof(*t));
+	if (!t)
+		goto err;
+	memset(t, 0, sizeof(*t));
+	t->f = calloc(size, sizeof(*t->f));
+	if (!t->f)
+		goto err_free_t;
+	t->bufs = malloc((size_t)size * ipfrag_bytes);
+	if (!t->bufs)
+		goto err_free_f;
+	for(i = 0; i < size; i++)
+		t->f[i].buf = t->bufs + (size_t)i * ipfrag_bytes;
+	t->mask = size - 1;
+	ftable = t;
+	
+	return t;
+	
+err_free_f:
+	free(t->f);
+err_free_t:
+	free(t);
+err:
+	ERR_OUT("fragments reassembly table allocating error: no memory");
+	/* work without a reassembly */
+	ipfrag_size = 0;
+	return NULL;
+}
+
+static uint32_t
+_ipfrag_now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	
+	return ts.tv_sec;
+}
+
+static uint32_t
+_ipfrag_hash(uint32_t saddr, uint32_t daddr, uint16_t ident, uint8_t proto)
+{
+	uint32_t h;
+	
+	h = saddr ^ (daddr * 0x9e3779b1) ^ ((ident << 8) | proto);
+	/* murmur3 finalizer */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	
+	return h;
+}
+
+static int
+_ipfrag_is_expired(struct ipfrag_flow *f, uint32_t now)
+{
+	return (now - f->ts) >= ipfrag_timeout;
+}
+
+/*
+ * Find a datagram of a fragment or add it. An expired datagram is
+ * deleted. A free or expired slot is taken for a new datagram; if there
+ * is no one, the oldest datagram in a probe window is evicted.
+ */
+static struct ipfrag_flow*
+_ipfrag_flow_get(struct ipfrag_table *t, struct pkt_ip *pkt_ip,
+  uint16_t ident)
+{
+	struct ipfrag_flow *f, *victim = NULL;
+	uint32_t idx, now;
+	unsigned int i;
+	
+	now = _ipfrag_now();
+	idx = _ipfrag_hash(pkt_ip->saddr, pkt_ip->daddr, ident, pkt_ip->proto);
+	for(i = 0; i < IPFRAG_PROBES; i++) {
+		f = &t->f[(idx + i) & t->mask];
+		if ((f->is_used) && (_ipfrag_is_expired(f, now)))
+			ipfrag_flow_del(f, 1);
+		if (!f->is_used) {
+			if ((!victim) || (victim->is_used))
+				victim = f;
+			continue;
+		}
+		if ((f->saddr == pkt_ip->saddr) && (f->daddr == pkt_ip->daddr) &&
+		  (f->ident == ident) && (f->proto == pkt_ip->proto))
+			return f;
+		if ((!victim) || ((victim->is_used) &&
+		  ((int32_t)(f->ts - victim->ts) < 0)))
+			victim = f;
+	}
+	if (victim->is_used)
+		ipfrag_flow_del(victim, 1);
+	
+	f = victim;
+	f->saddr = pkt_ip->saddr;
+	f->daddr = pkt_ip->daddr;
+	f->ident = ident;
+	f->proto = pkt_ip->proto;
+	f->is_used = 1;
+	f->ts = now;
+	f->len = 0;
+	f->ranges_cnt = 0;
+	f->held_cnt = 0;
+	t->used_cnt++;
+	
+	return f;
+}
+
+/*
+ * Add a received part to a datagram.
+ *
+ * return:
+ *   0 - a part is added
+ *   1 - a part is already received(a duplicate)
+ *   2 - a part overlaps received ones partially or a datagram is too
+ *       fragmented
+ */
+static int
+_ipfrag_range_add(struct ipfrag_flow *f, unsigned int start,
+  unsigned int end)
+{
+	struct ipfrag_range rs[IPFRAG_RANGES + 1], *r;
+	unsigned int i, n = 0;
+	int is_added = 0;
+	
+	for(i = 0; i < f->ranges_cnt; i++) {
+		r = &f->ranges[i];
+		if (r->end < start) {
+			rs[n++] = *r;
+		} else if (r->start > end) {
+			if (!is_added) {
+				rs[n].start = start;
+				rs[n++].end = end;
+				is_added = 1;
+			}
+			rs[n++] = *r;
+		} else {
+			if ((r->start <= start) && (end <= r->end))
+				return 1;
+			if ((r->start < end) && (start < r->end))
+				return 2;
+			/* adjacent parts are merged */
+			if (r->start < start)
+				start = r->start;
+			if (r->end > end)
+				end = r->end;
+		}
+	}
+	if (!is_added) {
+		rs[n].start = start;
+		rs[n++].end = end;
+	}
+	if (n > IPFRAG_RANGES)
+		return 2;
+	memcpy(f->ranges, rs, sizeof(*rs) * n);
+	f->ranges_cnt = n;
+	
+	return 0;
+}
+
+/*
+ * Add a fragment payload to a datagram buffer.
+ * pkt - an ip packet of a fragment
+ * data - a fragment data(with an ip header)
+ * size - a fragment size
+ * f - a pointer to place a datagram
+ *
+ * return:
+ *   0 - a datagram is complete(a payload is in a flow buffer)
+ *   1 - a fragment is buffered or it's a duplicate
+ *   2 - a fragment isn't buffered(a reassembly is off, a datagram is too
+ *       big or fragments are inconsistent); a datagram is deleted
+ */
+int
+ipfrag_add(struct pkt *pkt, unsigned char *data, int size,
+  struct ipfrag_flow **f)
+{
+	struct ipfrag_table *t;
+	struct iphdr *iph;
+	unsigned int hlen, off, len;
+	uint16_t frag;
+	int ret;
+	
+	*f = NULL;
+	t = _ipfrag_table_get();
+	if (!t)
+		return 2;
+	iph = (struct iphdr*)data;
+	hlen = iph->ihl * 4;
+	frag = be16toh(iph->frag_off);
+	if (hlen > size)
+		return 2;
+	off = (frag & IP_OFFMASK) * 8;
+	len = size - hlen;
+	/* not last fragments carry a multiple of 8 bytes */
+	if ((frag & IP_MF) && ((!len) || (len & 7)))
+		return 2;
+	*f = _ipfrag_flow_get(t, (struct pkt_ip*)pkt, be16toh(iph->id));
+	
+	if (off + len > ipfrag_bytes)
+		goto err_del;
+	if (!(frag & IP_MF)) {
+		if (((*f)->len) && ((*f)->len != off + len))
+			goto err_del;
+		if (((*f)->ranges_cnt) &&
+		  ((*f)->ranges[(*f)->ranges_cnt - 1].end > off + len))
+			goto err_del;
+		(*f)->len = off + len;
+	} else if (((*f)->len) && (off + len > (*f)->len)) {
+		goto err_del;
+	}
+	if (len) {
+		ret = _ipfrag_range_add(*f, off, off + len);
+		if (ret == 1)
+			return 1;
+		if (ret == 2)
+			goto err_del;
+		memcpy((*f)->buf + off, data + hlen, len);
+	}
+	
+	if (((*f)->len) && ((*f)->ranges_cnt == 1) &&
+	  ((*f)->ranges[0].start == 0) && ((*f)->ranges[0].end == (*f)->len))
+		return 0;
+	return 1;
+	
+err_del:
+	ipfrag_flow_del(*f, 1);
+	*f = NULL;
+	return 2;
+}
+
+/*
+ * Hold a verdict of a fragment until a datagram is complete.
+ * f - a datagram
+ * id - a packet id
+ *
+ * return:
+ *   0 - a verdict is held
+ *   1 - a hold policy is off or too many fragments are held
+ */
+int
+ipfrag_flow_hold(struct ipfrag_flow *f, uint32_t id)
+{
+	if ((!ipfrag_is_hold) || (f->held_cnt == IPFRAG_HELD_MAX))
+		return 1;
+	f->held[f->held_cnt++] = id;
+	
+	return 0;
+}
+
+/*
+ * Delete a datagram.
+ * f - a datagram
+ * is_release - pass held fragments ids to ipfrag_released_get(); otherwise,
+ *              a caller sets their verdicts
+ */
+void
+ipfrag_flow_del(struct ipfrag_flow *f, int is_release)
+{
+	unsigned int i;
+	
+	if (!f->is_used)
+		return;
+	if ((is_release) && (ftable)) {
+		for(i = 0; i < f->held_cnt; i++) {
+			if (ftable->released_cnt == IPFRAG_RELEASED_MAX) {
+				ERR_OUT("fragments reassembly: too many released packets - "
+				  "%u packets are left in a queue", f->held_cnt - i);
+				break;
+			}
+			ftable->released[ftable->released_cnt++] = f->held[i];
+		}
+	}
+	f->is_used = 0;
+	f->held_cnt = 0;
+	ftable->used_cnt--;
+}
+
+/*
+ * Delete expired datagrams of the table. Held fragments of a datagram are
+ * released. A sweep stops when there is no room for released ids; it's
+ * continued from the same slot by a next call(after ipfrag_released_get()).
+ *
+ * return:
+ *   0 - all slots are checked
+ *   1 - a sweep isn't finished
+ */
+int
+ipfrag_sweep(void)
+{
+	struct ipfrag_flow *f;
+	uint32_t now;
+	
+	if (!ftable)
+		return 0;
+	now = _ipfrag_now();
+	for(; (ftable->used_cnt) && (ftable->sweep_idx <= ftable->mask);
+	  ftable->sweep_idx++) {
+		if (IPFRAG_RELEASED_MAX - ftable->released_cnt < IPFRAG_HELD_MAX)
+			return 1;
+		f = &ftable->f[ftable->sweep_idx];
+		if ((f->is_used) && (_ipfrag_is_expired(f, now)))
+			ipfrag_flow_del(f, 1);
+	}
+	ftable->sweep_idx = 0;
+	
+	return 0;
+}
+
+/*
+ * Get ids of held fragments of deleted datagrams(expired, evicted or
+ * inconsistent), which must be accepted. Got ids are removed from
+ * the table.
+ * ids - an array to place ids to
+ * n - an array size
+ *
+ * return:
+ *   a number of placed ids
+ */
+unsigned int
+ipfrag_released_get(uint32_t *ids, unsigned int n)
+{
+	unsigned int cnt;
+	
+	if ((!ftable) || (!ftable->released_cnt))
+		return 0;
+	cnt = ftable->released_cnt;
+	if (cnt > n)
+		cnt = n;
+	memcpy(ids, ftable->released, sizeof(*ids) * cnt);
+	ftable->released_cnt -= cnt;
+	memmove(ftable->released, ftable->released + cnt,
+	  sizeof(*ids) * ftable->released_cnt);
+	
+	return cnt;
+}
@@ -0,0 +1,67 @@
+#ifndef __IPFRAG_H__
+#define __IPFRAG_H__
+
+#include <stdint.h>
+#include "pkt.h"
+
+/*
+ * A per-thread table of fragmented ipv4 datagrams, which fragments are
+ * buffered until a datagram is complete. Then a datagram payload is
+ * parsed once and verdicts of held fragments are set to a verdict of
+ * the last one(hold policy); otherwise, fragments are accepted at once
+ * and a verdict of the last one decides a datagram fate.
+ * Fragments of a datagram must be processed by one thread.
+ */
+#define IPFRAG_HELD_MAX 16
+#define IPFRAG_PROBES 4
+/* max number of not adjacent parts of a datagram */
+#define IPFRAG_RANGES 8
+/* max number of ids released at once(by a packet processing - an expired
+ * datagram and an evicted one; by a sweep) */
+#define IPFRAG_RELEASED_MAX (IPFRAG_HELD_MAX * 4)
+
+
+/* a received part of a datagram payload */
+struct ipfrag_range {
+	unsigned int start;
+	unsigned int end;
+};
+
+struct ipfrag_flow {
+	uint32_t saddr;
+	uint32_t daddr;
+	uint16_t ident;
+	uint8_t proto;
+	uint8_t is_used;
+	/* a creation time in seconds */
+	uint32_t ts;
+	/* a payload length(0 - the last fragment isn't got yet) */
+	unsigned int len;
+	/* received parts(sorted, not overlapped) */
+	struct ipfrag_range ranges[IPFRAG_RANGES];
+	unsigned int ranges_cnt;
+	/* ids of fragments with held verdicts */
+	uint32_t held[IPFRAG_HELD_MAX];
+	unsigned int held_cnt;
+	unsigned char *buf;
+};
+
+
+/*
+ * Set fragments reassembly parameters. Must be called before packets
+ * processing.
+ * size - max number of datagrams in a table of each thread(0 - no
+ *        reassembly)
+ * bytes - max payload size of a datagram
+ * timeout - max datagram lifetime in seconds
+ * is_hold - hold verdicts of buffered fragments
+ */
+void ipfrag_set(unsigned int size, unsigned int bytes, unsigned int timeout, int is_hold);
+int ipfrag_add(struct pkt *pkt, unsigned char *data, int size, struct ipfrag_flow **f);
+int ipfrag_flow_hold(struct ipfrag_flow *f, uint32_t id);
+void ipfrag_flow_del(struct ipfrag_flow *f, int is_release);
+int ipfrag_sweep(void);
+unsigned int ipfrag_released_get(uint32_t *ids, unsigned int n);
+
+
+#endif  /* __IPFRAG_H__ */
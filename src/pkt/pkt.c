@@ -5,12 +5,16 @@
 #include <string.h>
 #include <errno.h>
 #include <endian.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <linux/netfilter.h>
 #include <libnetfilter_queue/libnetfilter_queue.h>
 #include "main.h"
 #include "log.h"
 #include "pkt.h"
+#include "arena.h"
+#include "reasm.h"
+#include "ipfrag.h"
 #include "pkts_hdlrs.h"
 
 
@@ -18,8 +22,22 @@
 static struct pkt_hdlrs *ppkts[3];
 static char *ppkts_names[3] = {"ip", "ip6", NULL};
 
+/* payload classification counters of a thread */
+struct pkt_stat {
+	struct list_item_head list;
+	/* classified payloads by a payload type */
+	unsigned long classified[pkt_type__];
+	/* unclassified payloads by a transport type */
+	unsigned long unknown[pkt_type__];
+};
+
+static struct list_item_head pkt_stats;
+static pthread_mutex_t pkt_stats_mut = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct pkt_stat *pkt_stat;
+
 
 struct pkt_nfq* get_nfq_pkt(struct pkt *pkt);
+static struct pkt_stat* _pkt_stat_get(void);
 
 
 int
@@ -42,27 +60,39 @@ pkt_init(void)
 	return 0;
 }
 
+/*
+ * Parse a packet.
+ * data - a packet data
+ * size - a packet size
+ * id - a packet id
+ * attrs - attributes(PKT_ATTR_*) to get from a packet; layers yielding
+ *         nothing of them aren't parsed
+ *
+ * return:
+ *   pkt - a parsed packet chain
+ *   NULL - an error occured
+ */
 struct pkt*
-pkt_make(unsigned char *data, int size, uint32_t id)
+pkt_make(unsigned char *data, int size, uint32_t id, unsigned int attrs)
 {
 	struct pkt_nfq *pkt;
 	int i, ret;
 	
-	pkt = malloc(sizeof(*pkt));
+	pkt = pkt_alloc(sizeof(*pkt));
 	if (!pkt)
 		return NULL;
-	memset(pkt, 0, sizeof(*pkt));
 	pkt->pkt_type = pkt_type_nfq;
 	pkt->pkt_len = size;
 	pkt->pkt_raw = data;
 	pkt->id = id;
+	pkt->attrs = attrs;
 	for(i = 0; ppkts[i]; i++) {
-		if (!ppkts[i]->parse_pkt)
+		if ((!ppkts[i]->parse_pkt) || (!(ppkts[i]->attrs & attrs)))
 			continue;
 		ret = ppkts[i]->parse_pkt((struct pkt*)pkt, data, size);
 		if (ret < 0) {
 			ERR_OUT("pkt_make: err on parsing %s: %d", ppkts[i]->name, ret);
-			free(pkt);
+			pkt_arena_reset();
 			return NULL;
 		} else if (ret == 0) {
 			break;
@@ -72,50 +102,23 @@ pkt_make(unsigned char *data, int size, uint32_t id)
 	return (struct pkt*)pkt;
 }
 
-static void
-_pkt_free_pkt_cb(struct list_item_head *lh)
-{
-	struct pkt *pkt_cur;
-	
-	pkt_cur = list_item(lh, struct pkt, list);
-	if (pkts_list[pkt_cur->pkt_type]->free_pkt)
-		pkts_list[pkt_cur->pkt_type]->free_pkt(pkt_cur);
-}
-
-static void
-_pkt_free_domain_cb(struct list_item_head *lh)
-{
-	struct conn_domain *domain;
-	
-	domain = list_item(lh, struct conn_domain, list);
-	free(domain->name);
-	free(domain);
-}
-
-static void
-_pkt_free_uri_cb(struct list_item_head *lh)
-{
-	struct conn_uri *uri;
-	
-	uri = list_item(lh, struct conn_uri, list);
-	free(uri->value);
-	free(uri);
-}
-
 void
 pkt_free(struct pkt *pkt)
 {
-	struct pkt_nfq *pkt_nfq;
+	struct list_item_head *lh;
+	struct pkt *pkt_cur;
 
 	if (pkt->pkt_type != pkt_type_nfq) {
 		ERR_OUT("Call pkt_free() with wrong packet type");
 		return;
 	}
-	list_free(pkt->list.next, _pkt_free_pkt_cb);
-	pkt_nfq = (struct pkt_nfq*)pkt;
-	list_free(&pkt_nfq->domain->list, _pkt_free_domain_cb);
-	list_free(&pkt_nfq->uri->list, _pkt_free_uri_cb);
-	free(pkt);
+	list_for_each(lh, pkt->list.next) {
+		pkt_cur = list_item(lh, struct pkt, list);
+		if (pkts_list[pkt_cur->pkt_type]->free_pkt)
+			pkts_list[pkt_cur->pkt_type]->free_pkt(pkt_cur);
+	}
+	/* all packet structures are in the thread arena */
+	pkt_arena_reset();
 }
 
 void
@@ -133,11 +136,12 @@ pkt_dump(struct pkt *pkt)
 	pkt_nfq = (struct pkt_nfq*)pkt;
 	list_for_each(list, &pkt_nfq->domain->list) {
 		domain = list_item(list, struct conn_domain, list);
-		DBG_OUT("%u: pkt domain: %s", pkt_nfq->id, domain->name);
+		DBG_OUT("%u: pkt domain: %.*s", pkt_nfq->id, domain->len,
+		  domain->name);
 	}
 	list_for_each(list, &pkt_nfq->uri->list) {
 		uri = list_item(list, struct conn_uri, list);
-		DBG_OUT("%u: pkt uri: %s", pkt_nfq->id, uri->value);
+		DBG_OUT("%u: pkt uri: %.*s", pkt_nfq->id, uri->len, uri->value);
 	}
 	list_for_each(list, pkt->list.next) {
 		pkt = list_item(list, struct pkt, list);
@@ -181,6 +185,21 @@ get_pkt_id(struct pkt *pkt)
 	return (get_nfq_pkt(pkt))->id;
 }
 
+/*
+ * Check if any of attributes is needed for a packet chain.
+ * pkt - any packet of a chain
+ * attrs - attributes(PKT_ATTR_*)
+ *
+ * return:
+ *   0 - attributes aren't needed
+ *  !0 - otherwise
+ */
+int
+pkt_attrs_is_needed(struct pkt *pkt, unsigned int attrs)
+{
+	return (get_nfq_pkt(pkt))->attrs & attrs;
+}
+
 struct pkt*
 get_next_pkt(struct pkt *pkt)
 {
@@ -193,21 +212,62 @@ get_next_pkt(struct pkt *pkt)
 	return pkt;
 }
 
+/*
+ * Get a lowercase version of a string. A string is copied to the packet
+ * arena only if it has uppercase characters.
+ * str - a string(not null terminated)
+ * len - a string length
+ *
+ * return:
+ *   pointer - str or its lowercase copy
+ *   NULL - if a memory error occured
+ */
+char*
+pkt_lcase(char *str, unsigned int len)
+{
+	char *res;
+	unsigned int i;
+	
+	for(i = 0; i < len; i++)
+		if ((str[i] >= 'A') && (str[i] <= 'Z'))
+			break;
+	if (i == len)
+		return str;
+	res = pkt_alloc(len);
+	if (!res)
+		return NULL;
+	memcpy(res, str, i);
+	for(; i < len; i++)
+		res[i] = ((str[i] >= 'A') && (str[i] <= 'Z')) ? str[i] + 32 : str[i];
+	
+	return res;
+}
+
+/*
+ * Add a connection domain name. The name is lowercased and must be valid
+ * until the packet is freed.
+ * pkt - any packet of a chain
+ * name - a domain name(not null terminated)
+ * len - a name length
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ */
 int
-pkt_domain_add(struct pkt *pkt, char *name, int len)
+pkt_domain_add(struct pkt *pkt, char *name, unsigned int len)
 {
 	struct conn_domain *domain;
 	struct pkt_nfq *pkt_nfq;
 	
-	domain = malloc(sizeof(*domain));
+	domain = pkt_alloc(sizeof(*domain));
 	if (!domain)
 		return -1;
 	list_item_head_init(&domain->list);
-	domain->name = strndup(name, len);
-	if (!domain->name) {
-		free(domain);
+	domain->name = pkt_lcase(name, len);
+	if (!domain->name)
 		return -1;
-	}
+	domain->len = len;
 	pkt_nfq = get_nfq_pkt(pkt);
 	if (!pkt_nfq->domain)
 		pkt_nfq->domain = domain;
@@ -216,17 +276,29 @@ pkt_domain_add(struct pkt *pkt, char *name, int len)
 	return 0;
 }
 
+/*
+ * Add a connection uri. The value must be valid until the packet is
+ * freed.
+ * pkt - any packet of a chain
+ * value - an uri(not null terminated)
+ * len - an uri length
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ */
 int
-pkt_uri_add(struct pkt *pkt, char *value)
+pkt_uri_add(struct pkt *pkt, char *value, unsigned int len)
 {
 	struct conn_uri *uri;
 	struct pkt_nfq *pkt_nfq;
 	
-	uri = malloc(sizeof(*uri));
+	uri = pkt_alloc(sizeof(*uri));
 	if (!uri)
 		return -1;
 	list_item_head_init(&uri->list);
 	uri->value = value;
+	uri->len = len;
 	pkt_nfq = get_nfq_pkt(pkt);
 	if (!pkt_nfq->uri)
 		pkt_nfq->uri = uri;
@@ -235,9 +307,219 @@ pkt_uri_add(struct pkt *pkt, char *value)
 	return 0;
 }
 
+/*
+ * Hold a packet verdict. A packet is queued until a verdict of a packet
+ * finishing its reassembled flow is set.
+ * pkt - any packet of a chain
+ */
+void
+pkt_hold(struct pkt *pkt)
+{
+	get_nfq_pkt(pkt)->is_held = 1;
+}
+
+/*
+ * Check if a packet verdict is held.
+ * pkt - any packet of a chain
+ */
+int
+pkt_is_held(struct pkt *pkt)
+{
+	return get_nfq_pkt(pkt)->is_held;
+}
+
+/*
+ * Add held packets, which must get a verdict of this packet(e.g. fragments
+ * of a datagram and segments of a tcp flow). Ids are copied to the packet
+ * arena.
+ * pkt - any packet of a chain
+ * ids - held packets ids
+ * cnt - a number of ids
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - a memory error occured
+ */
+int
+pkt_held_set(struct pkt *pkt, uint32_t *ids, unsigned int cnt)
+{
+	struct pkt_nfq *pkt_nfq;
+	uint32_t *held_ids;
+	
+	if (!cnt)
+		return 0;
+	pkt_nfq = get_nfq_pkt(pkt);
+	held_ids = pkt_alloc(sizeof(*ids) * (pkt_nfq->held_cnt + cnt));
+	if (!held_ids)
+		return -1;
+	if (pkt_nfq->held_cnt)
+		memcpy(held_ids, pkt_nfq->held_ids,
+		  sizeof(*ids) * pkt_nfq->held_cnt);
+	memcpy(held_ids + pkt_nfq->held_cnt, ids, sizeof(*ids) * cnt);
+	pkt_nfq->held_ids = held_ids;
+	pkt_nfq->held_cnt += cnt;
+	
+	return 0;
+}
+
+/*
+ * Set handlers of port hints. Hints with unknown protocol names are left
+ * without handlers.
+ * hints - an array of hints ended with an item with NULL name
+ */
+void
+pkt_port_hints_init(struct pkt_port_hint *hints)
+{
+	int i, j;
+	
+	for(i = 0; hints[i].name; i++)
+		for(j = 0; pkts_list[j]; j++)
+			if (strcmp(hints[i].name, pkts_list[j]->name) == 0) {
+				hints[i].hdlrs = pkts_list[j];
+				break;
+			}
+}
+
+/*
+ * Choose a payload handler of a transport packet. A handler of a port
+ * hint is checked first, then probe_pkt of all handlers is tried. Handlers
+ * yielding no needed attributes are skipped. A result is counted in the
+ * thread stat.
+ * pkt - a transport packet
+ * hdlrs - a NULL terminated array of payload handlers
+ * hints - port hints(an array ended with an item with NULL name)
+ * sport - a source port
+ * dport - a destination port
+ * data - a payload
+ * size - a payload size
+ *
+ * return:
+ *   hdlrs - a handler to parse a payload with
+ *   NULL - no suitable handler
+ */
+struct pkt_hdlrs*
+pkt_payload_classify(struct pkt *pkt, struct pkt_hdlrs **hdlrs,
+  struct pkt_port_hint *hints, uint16_t sport, uint16_t dport,
+  unsigned char *data, int size)
+{
+	struct pkt_hdlrs *h = NULL;
+	struct pkt_stat *stat;
+	int i;
+	
+	if (size <= 0)
+		return NULL;
+	for(i = 0; hdlrs[i]; i++)
+		if ((hdlrs[i]->parse_pkt) &&
+		  (pkt_attrs_is_needed(pkt, hdlrs[i]->attrs)))
+			break;
+	if (!hdlrs[i])
+		return NULL;
+	
+	for(i = 0; hints[i].name; i++) {
+		if ((hints[i].port != dport) && (hints[i].port != sport))
+			continue;
+		h = hints[i].hdlrs;
+		if ((h) && (h->parse_pkt) && (pkt_attrs_is_needed(pkt, h->attrs)) &&
+		  ((!h->probe_pkt) || (h->probe_pkt(data, size))))
+			goto out;
+	}
+	for(i = 0; hdlrs[i]; i++) {
+		h = hdlrs[i];
+		if ((h->parse_pkt) && (pkt_attrs_is_needed(pkt, h->attrs)) &&
+		  ((!h->probe_pkt) || (h->probe_pkt(data, size))))
+			goto out;
+	}
+	h = NULL;
+	
+out:
+	/* counters are read by pkt_stat_out() from another thread */
+	stat = _pkt_stat_get();
+	if ((stat) && (h))
+		__atomic_fetch_add(&stat->classified[h->type], 1, __ATOMIC_RELAXED);
+	else if (stat)
+		__atomic_fetch_add(&stat->unknown[pkt->pkt_type], 1,
+		  __ATOMIC_RELAXED);
+	return h;
+}
+
+/*
+ * Get the calling thread stat. It's registered on the first call.
+ *
+ * return:
+ *   stat - a pointer to the thread stat
+ *   NULL - a memory error occured
+ */
+static struct pkt_stat*
+_pkt_stat_get(void)
+{
+	struct pkt_stat *stat;
+	int ret;
+	
+	if (pkt_stat)
+		return pkt_stat;
+	stat = aligned_alloc(64, (sizeof(*stat) + 63) & ~63);
+	if (!stat)
+		return NULL;
+	memset(stat, 0, sizeof(*stat));
+	
+	ret = pthread_mutex_lock(&pkt_stats_mut);
+	if (ret != 0) {
+		ERR_OUT("pkt stats mutex lock error: %s", strerror(ret));
+		exit(2);
+	}
+	list_add(&stat->list, &pkt_stats);
+	ret = pthread_mutex_unlock(&pkt_stats_mut);
+	if (ret != 0) {
+		ERR_OUT("pkt stats mutex unlock error: %s", strerror(ret));
+		exit(2);
+	}
+	pkt_stat = stat;
+	
+	return stat;
+}
+
+/*
+ * Output payload classification counters of each thread.
+ */
+void
+pkt_stat_out(void)
+{
+	struct list_item_head *lh;
+	struct pkt_stat *stat;
+	unsigned long cnt;
+	unsigned int n = 0;
+	int i, ret;
+	
+	ret = pthread_mutex_lock(&pkt_stats_mut);
+	if (ret != 0) {
+		ERR_OUT("pkt stats mutex lock error: %s", strerror(ret));
+		exit(2);
+	}
+	list_for_each(lh, pkt_stats.next) {
+		stat = list_item(lh, struct pkt_stat, list);
+		for(i = 0; pkts_list[i]; i++) {
+			cnt = __atomic_load_n(&stat->classified[i], __ATOMIC_RELAXED);
+			if (cnt)
+				INFO_OUT("stat for payload classification(thread %u): "
+				  "%s %lu", n, pkts_list[i]->name, cnt);
+			cnt = __atomic_load_n(&stat->unknown[i], __ATOMIC_RELAXED);
+			if (cnt)
+				INFO_OUT("stat for payload classification(thread %u): "
+				  "%s unknown %lu", n, pkts_list[i]->name, cnt);
+		}
+		n++;
+	}
+	ret = pthread_mutex_unlock(&pkt_stats_mut);
+	if (ret != 0) {
+		ERR_OUT("pkt stats mutex unlock error: %s", strerror(ret));
+		exit(2);
+	}
+}
+
 struct pkt_hdlrs pkt_hdlrs_nfq = {
 	"nfq",
 	0,
+	PKT_ATTR_ALL,
 	NULL,
 	NULL,
 	NULL,
@@ -14,21 +14,48 @@ struct pkt {
 	PKT_HEAD
 };
 
+/*
+ * Packet attributes filters look at. Only packet layers yielding
+ * needed attributes are parsed.
+ */
+#define PKT_ATTR_ADDR  0x01  /* ip addresses and protocol */
+#define PKT_ATTR_PORT  0x02  /* tcp/udp ports, icmp type and code */
+#define PKT_ATTR_SNI   0x04  /* tls server name */
+#define PKT_ATTR_HOST  0x08  /* http host */
+#define PKT_ATTR_URI   0x10  /* http uri */
+#define PKT_ATTR_QNAME 0x20  /* dns query name */
+#define PKT_ATTR_ANSWER 0x40 /* dns answer addresses */
+#define PKT_ATTR_DOMAIN (PKT_ATTR_SNI | PKT_ATTR_HOST | PKT_ATTR_QNAME)
+#define PKT_ATTR_ALL   0x7f
+
+/*
+ * Domains and uris are views(not null terminated) into a packet payload
+ * or into the packet arena, if a value must be normalized.
+ */
 struct conn_domain {
 	struct list_item_head list;
 	char *name;
+	unsigned int len;
 };
 
 struct conn_uri {
 	struct list_item_head list;
 	char *value;
+	unsigned int len;
 };
 
 struct pkt_nfq {
 	PKT_HEAD
 	uint32_t id;
+	/* needed attributes(PKT_ATTR_*) */
+	unsigned int attrs;
 	struct conn_domain *domain;
 	struct conn_uri *uri;
+	/* a packet verdict is held until a reassembled flow is finished */
+	uint8_t is_held;
+	/* held packets, which get a verdict of this one */
+	uint32_t *held_ids;
+	unsigned int held_cnt;
 };
 
 
@@ -37,13 +64,19 @@ struct pkt_nfq {
 
 
 int pkt_init(void);
-struct pkt* pkt_make(unsigned char *data, int size, uint32_t id);
+struct pkt* pkt_make(unsigned char *data, int size, uint32_t id, unsigned int attrs);
 uint32_t get_pkt_id(struct pkt *pkt);
+int pkt_attrs_is_needed(struct pkt *pkt, unsigned int attrs);
 struct pkt* get_next_pkt(struct pkt *pkt);
-int pkt_domain_add(struct pkt *pkt, char *name, int len);
-int pkt_uri_add(struct pkt *pkt, char *value);
+int pkt_domain_add(struct pkt *pkt, char *name, unsigned int len);
+int pkt_uri_add(struct pkt *pkt, char *value, unsigned int len);
+char* pkt_lcase(char *str, unsigned int len);
+void pkt_hold(struct pkt *pkt);
+int pkt_is_held(struct pkt *pkt);
+int pkt_held_set(struct pkt *pkt, uint32_t *ids, unsigned int cnt);
 void pkt_free(struct pkt *pkt);
 void pkt_dump(struct pkt *pkt);
+void pkt_stat_out(void);
 void pkt_errout(struct pkt *pkt, const char * const fmt, ...);
 
 
@@ -2,9 +2,11 @@
 #include <endian.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <arpa/inet.h>
 #include "log.h"
 #include "util.h"
 #include "pkt.h"
+#include "arena.h"
 #include "pkt_tcp.h"
 #include "pkt_udp.h"
 #include "pkt_dns.h"
@@ -45,8 +47,9 @@ struct pkt_dnshdr {
 };
 
 
-static int free_pkt(struct pkt *pkt);
 static int _parse_qentry(unsigned char *data, int size, struct dns_qentry *qe);
+static int _parse_answers(struct pkt_dns *pkt, unsigned char *data, int size, unsigned int cnt);
+static int _skip_name(unsigned char *data, int size);
 static int _dump_pkt(int outlvl, struct pkt *pkt);
 
 
@@ -64,28 +67,34 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 	struct pkt_udp *pkt_udp;
 	struct pkt_dns *pkt;
 	struct dns_qentry qentry, *qentry_new;
-	unsigned int i, off;
+	unsigned int i, off, is_answer = 0;
 	uint16_t cnt;
 	int ret;
 
 	/* Is this really a dns packet? */
 	if (size < sizeof(*dnsh))
 		return 1;
+	dnsh = (struct pkt_dnshdr*)data;
 	if (pkt_prev->pkt_type == pkt_type_tcp) {
 		pkt_tcp = (struct pkt_tcp*)pkt_prev;
 		if (pkt_tcp->dport != 53)
 			return 1;
 	} else if (pkt_prev->pkt_type == pkt_type_udp) {
 		pkt_udp = (struct pkt_udp*)pkt_prev;
-		if (pkt_udp->dport != 53)
+		/* answers are parsed only for addresses snooping and only
+		 * over udp(a whole answer is in one packet); a query from
+		 * port 53(e.g. between resolvers) is parsed as a query */
+		if ((pkt_udp->sport == 53) && (dnsh->qr) &&
+		  (pkt_attrs_is_needed(pkt_prev, PKT_ATTR_ANSWER)))
+			is_answer = 1;
+		else if (pkt_udp->dport != 53)
 			return 1;
 	} else
 		return 1;
 	
-	/* Is this a dns request packet? */
-	dnsh = (struct pkt_dnshdr*)data;
+	/* Is this a dns request packet(or an answer, if we want it)? */
 	cnt = be16toh(dnsh->qdcount);
-	if ((dnsh->qr != 0) || (dnsh->rcode != 0))
+	if ((dnsh->qr != is_answer) || (dnsh->rcode != 0))
 		return 2;
 	if (cnt == 0)
 		return 2;
@@ -94,16 +103,17 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 		  "question section: %u!", get_pkt_id(pkt_prev), cnt);
 
 	off = sizeof(*dnsh);
-	pkt = malloc(sizeof(*pkt));
+	pkt = pkt_alloc(sizeof(*pkt));
 	if (!pkt)
 		return -1;
-	memset(pkt, 0, sizeof(*pkt));
 	list_item_head_init(&pkt->list);
 	list_add(&pkt->list, &pkt_prev->list);
 
 	pkt->pkt_type = pkt_type_dns;
 	pkt->pkt_len = size;
 	pkt->pkt_raw = data;
+	pkt->qr = dnsh->qr;
+	pkt->qdcount = cnt;
 	
 	/* Do not save this info. For a little speed up */
 	/*
@@ -129,21 +139,18 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 		ret = _parse_qentry(data + off, size, &qentry);
 		if (ret < 0) {
 			list_rm(&pkt->list);
-			free_pkt((struct pkt*)pkt);
 			return 1;
 		}
 		off += ret;
 		if (ret > size) {
 			list_rm(&pkt->list);
-			free_pkt((struct pkt*)pkt);
 			return 1;
 		}
 		size -= ret;
-		qentry_new = (struct dns_qentry*)realloc(pkt->qentry,
-		  (i+1)*sizeof(struct dns_qentry));
+		qentry_new = (struct dns_qentry*)pkt_realloc(pkt->qentry,
+		  i*sizeof(struct dns_qentry), (i+1)*sizeof(struct dns_qentry));
 		if (!qentry_new) {
 			list_rm(&pkt->list);
-			free_pkt((struct pkt*)pkt);
 			return -1;
 		}
 		pkt->qentry = qentry_new;
@@ -151,34 +158,46 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 		pkt->qentry[i].qname_len = qentry.qname_len;
 		pkt->qentry[i].qtype = qentry.qtype;
 		pkt->qentry[i].qclass = qentry.qclass;
-		
-		if (pkt_domain_add(pkt_prev, qentry.qname, qentry.qname_len) < 0) {
-			list_rm(&pkt->list);
-			free_pkt((struct pkt*)pkt);
-			return -1;
-		}
 	}
 	/* size == 0 and i != cnt */
 	if (i != cnt) {
 		list_rm(&pkt->list);
-		free_pkt((struct pkt*)pkt);
 		return 1;
 	}
+	/* a question name of an answer isn't a packet domain: an answer is
+	 * filtered as before and its addresses are matched by a caller */
+	if (is_answer) {
+		if (_parse_answers(pkt, data + off, size,
+		  be16toh(dnsh->ancount)) < 0) {
+			list_rm(&pkt->list);
+			return -1;
+		}
+		return 0;
+	}
+	/* domains are views into qentry array, so add them only after it
+	 * stops growing */
+	for(i = 0; i < cnt; i++)
+		if (pkt_domain_add(pkt_prev, pkt->qentry[i].qname,
+		  pkt->qentry[i].qname_len) < 0) {
+			list_rm(&pkt->list);
+			return -1;
+		}
 	
 	return 0;
 }
 
+/*
+ * Check if a payload has a dns header shape.
+ */
 static int
-free_pkt(struct pkt *pkt)
+probe_pkt(unsigned char *data, int size)
 {
-	struct pkt_dns *pkt_dns;
+	struct pkt_dnshdr *dnsh;
 	
-	if (pkt->pkt_type != pkt_type_dns)
-		return -2;
-	pkt_dns = (struct pkt_dns*)pkt;
-	free(pkt_dns->qentry);
-	free(pkt_dns);
-	return 0;
+	if (size < sizeof(*dnsh))
+		return 0;
+	dnsh = (struct pkt_dnshdr*)data;
+	return (dnsh->z == 0) && (dnsh->opcode <= 5) && (dnsh->qdcount != 0);
 }
 
 static int
@@ -199,6 +218,7 @@ _dump_pkt(int outlvl, struct pkt *pkt)
 	uint32_t id;
 	int i;
 	struct pkt_dns *pkt_dns;
+	char addr[INET6_ADDRSTRLEN];
 	
 	if (pkt->pkt_type != pkt_type_dns)
 		return -2;
@@ -214,17 +234,23 @@ _dump_pkt(int outlvl, struct pkt *pkt)
 	  pkt_dns->ancount, pkt_dns->nscount, pkt_dns->arcount);
 	for(i = 0; i < pkt_dns->qdcount; i++)
 		ANY_OUT(outlvl, "%u: dns: qentry - %s", id, pkt_dns->qentry[i].qname);
+	for(i = 0; i < pkt_dns->answer_cnt; i++)
+		ANY_OUT(outlvl, "%u: dns: answer - %s(ttl %u)", id,
+		  inet_ntop(AF_INET6, pkt_dns->answer[i].addr, addr, sizeof(addr)),
+		  pkt_dns->answer[i].ttl);
 	return 0;
 }
 
 struct pkt_hdlrs pkt_hdlrs_dns = {
 	"dns",
 	0,
+	PKT_ATTR_QNAME | PKT_ATTR_ANSWER,
 	init,
 	parse_pkt,
-	free_pkt,
+	NULL,
 	dump_pkt,
-	errout_pkt
+	errout_pkt,
+	probe_pkt
 };
 
 static int
@@ -258,3 +284,82 @@ _parse_qentry(unsigned char *data, int size, struct dns_qentry *qe)
 	return i;
 }
 
+/*
+ * Save addresses of A and AAAA records of an answer section. Other
+ * records(e.g. CNAME ones of a chain to addresses) are skipped.
+ * pkt - a dns packet
+ * data - a start of an answer section
+ * size - a size of data
+ * cnt - a number of records in an answer section
+ *
+ * return:
+ *   0 - everything is ok(a truncated section is ignored)
+ *  -1 - a memory error occured
+ */
+static int
+_parse_answers(struct pkt_dns *pkt, unsigned char *data, int size,
+  unsigned int cnt)
+{
+	struct dns_answer *a;
+	unsigned int i, off = 0;
+	uint16_t type, class, rdlen;
+	int ret;
+	
+	if (!cnt)
+		return 0;
+	pkt->answer = pkt_alloc(sizeof(*pkt->answer) *
+	  (cnt < PKT_DNS_ANSWERS_MAX ? cnt : PKT_DNS_ANSWERS_MAX));
+	if (!pkt->answer)
+		return -1;
+	for(i = 0; (i < cnt) && (pkt->answer_cnt < PKT_DNS_ANSWERS_MAX); i++) {
+		ret = _skip_name(data + off, size - off);
+		if (ret < 0)
+			return 0;
+		off += ret;
+		/* type, class, ttl and rdlength */
+		if (off + 10 > size)
+			return 0;
+		type = be16toh(*((uint16_t*)(data + off)));
+		class = be16toh(*((uint16_t*)(data + off + 2)));
+		rdlen = be16toh(*((uint16_t*)(data + off + 8)));
+		if (off + 10 + rdlen > size)
+			return 0;
+		if ((class == 1) && (((type == 1) && (rdlen == 4)) ||
+		  ((type == 28) && (rdlen == 16)))) {
+			a = &pkt->answer[pkt->answer_cnt++];
+			if (rdlen == 4) {
+				a->addr[10] = 0xff;
+				a->addr[11] = 0xff;
+			}
+			memcpy(a->addr + 16 - rdlen, data + off + 10, rdlen);
+			a->ttl = be32toh(*((uint32_t*)(data + off + 4)));
+		}
+		off += 10 + rdlen;
+	}
+	
+	return 0;
+}
+
+/*
+ * Skip an encoded domain name(labels ending with a zero one or with
+ * a compression pointer).
+ *
+ * return:
+ *   >0 - an encoded name size
+ *  -1 - a name is truncated
+ */
+static int
+_skip_name(unsigned char *data, int size)
+{
+	int i = 0;
+	
+	while (i < size) {
+		if ((data[i] & 0xc0) == 0xc0)
+			return (i + 2 <= size) ? i + 2 : -1;
+		if (!data[i])
+			return i + 1;
+		i += data[i] + 1;
+	}
+	
+	return -1;
+}
@@ -2,6 +2,8 @@
 #define __PKT_DNS_H__
 
 #define PKT_DNS_NAME_MAXSIZE 256
+/* max number of saved addresses of an answer */
+#define PKT_DNS_ANSWERS_MAX 32
 
 struct dns_qentry {
 	char qname[PKT_DNS_NAME_MAXSIZE];
@@ -10,6 +12,13 @@ struct dns_qentry {
 	uint16_t qclass;
 };
 
+/* an address from an A or AAAA record of an answer */
+struct dns_answer {
+	/* an address in network byte order(ipv4 one is ipv4-mapped) */
+	uint8_t addr[16];
+	uint32_t ttl;
+};
+
 struct pkt_dns {
 	PKT_HEAD
 	uint16_t id;
@@ -28,6 +37,9 @@ struct pkt_dns {
 	uint16_t nscount;
 	uint16_t arcount;
 	struct dns_qentry *qentry;
+	/* addresses of an answer(qr is 1) */
+	struct dns_answer *answer;
+	unsigned int answer_cnt;
 };
 
 #endif  /* __PKT_DNS_H__ */
@@ -3,11 +3,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "log.h"
 #include "util.h"
 #include "pkt.h"
+#include "arena.h"
 #include "pkt_http.h"
 #include "pkt_tcp.h"
+#include "reasm.h"
 #include "pkts_hdlrs.h"
 
 
@@ -19,15 +26,16 @@ struct http_token_ctx {
 };
 
 
-static int free_pkt(struct pkt *pkt);
-static int _parse_start_line(struct pkt_http *pkt, char **buf, int *size);
-static int _parse_header(struct pkt_http *pkt, char **buf, int *size);
+static int _parse_start_line(struct pkt_http *pkt, char **buf, char *end);
+static int _scan_request(struct pkt_http *pkt, struct reasm_state *st, char *buf, char *end);
 static int _add_domain_and_uri(struct pkt *pkt_prev, struct pkt_http *pkt);
-static void uri_add_target(char *uri, char *target);
-static struct http_header* _http_header_add(struct pkt_http *pkt, char *name, int name_len, char *value, int value_len);
-static unsigned int _get_token(char *str, unsigned int n, char **end);
+static unsigned int uri_add_target(char *uri, char *target, unsigned int len);
+static char* _find_chr(char *s, char *end, char c1, char c2, char c3);
+static char* _skip_spaces(char *s, char *end);
 static int _dump_pkt(int outlvl, struct pkt *pkt);
 
+struct pkt_hdlrs pkt_hdlrs_http;
+
 
 static int
 init(void)
@@ -39,7 +47,12 @@ static int
 parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 {
 	struct pkt_http *pkt;
-	int ret, id, is_host_found = 0;
+	struct pkt_tcp *pkt_tcp;
+	struct reasm_flow *f;
+	struct reasm_state st;
+	char *buf;
+	unsigned int len;
+	int ret, id;
 
 	/* get tcp port number */
 	if (pkt_prev->pkt_type != pkt_type_tcp) {
@@ -47,11 +60,37 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 		  pkts_list[pkt_prev->pkt_type]->name);
 		return -2;
 	}
+	pkt_tcp = (struct pkt_tcp*)pkt_prev;
 	
-	pkt = malloc(sizeof(*pkt));
+	/* continue a request split across segments */
+	f = pkt_tcp->reasm;
+	if (f) {
+		ret = reasm_flow_append(f, pkt_tcp->seq, data, size);
+		if (ret == 1) {
+			/* a retransmission of buffered data */
+			if ((size > 0) &&
+			  (reasm_flow_hold(f, get_pkt_id(pkt_prev)) == 0))
+				pkt_hold(pkt_prev);
+			return 0;
+		} else if (ret == 2) {
+			/* a request can't be reassembled - held packets get
+			 * a verdict of this one */
+			ret = pkt_held_set(pkt_prev, f->held, f->held_cnt);
+			reasm_flow_del(f, ret < 0);
+			return ret;
+		}
+		buf = (char*)f->buf;
+		len = f->len;
+		st = f->state;
+	} else {
+		buf = (char*)data;
+		len = size;
+		memset(&st, 0, sizeof(st));
+	}
+	
+	pkt = pkt_alloc(sizeof(*pkt));
 	if (!pkt)
 		return -1;
-	memset(pkt, 0, sizeof(*pkt));
 	list_item_head_init(&pkt->list);
 	list_add(&pkt->list, &pkt_prev->list);
 	
@@ -59,101 +98,144 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 	pkt->pkt_len = size;
 	pkt->pkt_raw = data;
 	
-	ret = _parse_start_line(pkt, (char**)&data, &size);
-	if (ret != 0)
-		goto err_free_pkt;
-	
-	while ((ret = _parse_header(pkt, (char**)&data, &size)) == 0) {
-		if (strcmp(pkt->headers->name, "host") == 0) {
-			ret = _add_domain_and_uri(pkt_prev, pkt);
-			if (ret < 0)
-				goto err_free_pkt;
-			is_host_found = 1;
-			/* do not process other headers */
-			ret = 2;
-			break;
+	/* only a host header is needed - do not process other headers */
+	ret = _scan_request(pkt, &st, buf, buf + len);
+	if (ret == 1) {
+		/* headers are truncated - wait for next segments */
+		if (!f) {
+			f = reasm_flow_add(pkt_prev, &pkt_hdlrs_http);
+			if ((f) && (reasm_flow_append(f, pkt_tcp->seq, data, size))) {
+				reasm_flow_del(f, 0);
+				f = NULL;
+			}
+		}
+		if (f) {
+			f->state = st;
+			if (reasm_flow_hold(f, get_pkt_id(pkt_prev)) == 0)
+				pkt_hold(pkt_prev);
+			list_rm(&pkt->list);
+			return 0;
 		}
-	}
-	if (ret != 2) {
 		id = get_pkt_id(pkt_prev);
 		PKT_ERROUT((struct pkt*)pkt, "%u: http: headers parse error", id);
-		/* try to process wrong request too */
-		if (!is_host_found)
-			goto err_free_pkt;
+		goto err_unlink_pkt;
+	}
+	if (f) {
+		/* a request is finished - held packets get a verdict of this
+		 * one */
+		if (pkt_held_set(pkt_prev, f->held, f->held_cnt) < 0) {
+			reasm_flow_del(f, 1);
+			ret = -1;
+			goto err_unlink_pkt;
+		}
+		if (ret == 3) {
+			reasm_flow_del(f, 0);
+			goto err_unlink_pkt;
+		}
 	}
-	if (!is_host_found) {
+	if (ret == 3)
+		goto err_unlink_pkt;
+	if (ret != 2) {
+		ret = _add_domain_and_uri(pkt_prev, pkt);
+		if (ret < 0) {
+			/* held ids are dropped with a packet chain on error, so
+			 * they are released */
+			if (f)
+				reasm_flow_del(f, 1);
+			goto err_unlink_pkt;
+		}
+	} else {
 		id = get_pkt_id(pkt_prev);
 		PKT_ERROUT((struct pkt*)pkt, "%u: http: can't found host header", id);
 	}
+	/* a flow is deleted in free_pkt(), since pkt fields point to its
+	 * buffer */
+	pkt->reasm = f;
 	
 	return 0;
 
-err_free_pkt:
+err_unlink_pkt:
 	if (ret < 0) {
 		id = get_pkt_id(pkt_prev);
 		PKT_ERROUT((struct pkt*)pkt, "%u: http parse error %d", id, ret);
 	}
 	list_rm(&pkt->list);
-	free_pkt((struct pkt*)pkt);
 	return ret;
 }
 
+static int
+free_pkt(struct pkt *pkt)
+{
+	struct pkt_http *pkt_http;
+	
+	pkt_http = (struct pkt_http*)pkt;
+	if (pkt_http->reasm)
+		reasm_flow_del(pkt_http->reasm, 0);
+	return 0;
+}
+
 static int
 _add_domain_and_uri(struct pkt *pkt_prev, struct pkt_http *pkt)
 {
-	char *uri = NULL, *host, *port;
-	int ret, len;
+	char *uri, *host, *name, *port;
+	unsigned int len, name_len, host_len, port_len;
+	int ret;
 	
-	normalize_domain_name(pkt->headers->value);
+	name = pkt_lcase(pkt->host, pkt->host_len);
+	if (!name)
+		return -1;
 	
 	/* Add domain name */
-	len = strlen(pkt->headers->value);
-	port = strrchr(pkt->headers->value, ':');
-	if (port)
-		len = port - pkt->headers->value;
-	ret = pkt_domain_add(pkt_prev, pkt->headers->value, len);
+	for(name_len = pkt->host_len; name_len; name_len--)
+		if (name[name_len - 1] == ':')
+			break;
+	if (name_len)
+		name_len--;
+	else
+		name_len = pkt->host_len;
+	port = name + name_len;
+	port_len = pkt->host_len - name_len;
+	ret = pkt_domain_add(pkt_prev, name, name_len);
 	if (ret < 0)
 		return ret;
+	if (!pkt_attrs_is_needed(pkt_prev, PKT_ATTR_URI))
+		return 0;
 	
 	/* Add uri */
-	host = normalize_uri_host(pkt->headers->value, len);
+	host = normalize_uri_host(name, name_len);
 	if (!host)
 		return -2;
-	if (!port)
-		port = "";
-	
-	len = strlen("http://") + strlen(pkt->target);
-	if (host == pkt->headers->value)
-		len += strlen(pkt->headers->value);
-	else
-		len += strlen(host) + strlen(port);
+	if (host == name) {
+		/* nothing is escaped - keep a port as is */
+		host_len = pkt->host_len;
+		port_len = 0;
+	} else {
+		host_len = strlen(host);
+	}
 	
-	uri = malloc(len + 1);
+	len = strlen("http://") + host_len + port_len + pkt->target_len;
+	uri = pkt_alloc(len + 1);
 	if (!uri)
 		goto err_cleanup;
-	uri[0] = '\0';
-	strcat(uri, "http://");
-	if (host == pkt->headers->value) {
-		strcat(uri, pkt->headers->value);
-	} else {
-		strcat(uri, host);
-		strcat(uri, port);
-	}
-	uri_add_target(uri + strlen(uri), pkt->target);
+	memcpy(uri, "http://", strlen("http://"));
+	len = strlen("http://");
+	memcpy(uri + len, host, host_len);
+	len += host_len;
+	memcpy(uri + len, port, port_len);
+	len += port_len;
+	len += uri_add_target(uri + len, pkt->target, pkt->target_len);
 
-	ret = pkt_uri_add(pkt_prev, uri);
+	ret = pkt_uri_add(pkt_prev, uri, len);
 	if (ret < 0)
 		goto err_cleanup;
 	
-	if (host != pkt->headers->value)
+	if (host != name)
 		free(host);
 	return 0;
 
 err_cleanup:
-	if (host != pkt->headers->value)
+	if (host != name)
 		free(host);
-	if (uri)
-		free(uri);
 	return -1;
 }
 
@@ -161,20 +243,25 @@ err_cleanup:
  * Add target string to uri removing duplicates of / and trailing /.
  * uri - a destination pointer
  * target - a source string
+ * len - a source string length
+ *
+ * return:
+ *   a number of characters written to uri
  */
-static void
-uri_add_target(char *uri, char *target)
+static unsigned int
+uri_add_target(char *uri, char *target, unsigned int len)
 {
+	char *start = uri, *end = target + len;
 	int do_copy = 1, path_exist = 0;
 	
-	while ((*target != '\0') && (*target != '?') && (*target != '#')) {
+	while ((target != end) && (*target != '?') && (*target != '#')) {
 		if (do_copy) {
 			*uri = *target;
 			uri++;
 		}
 		target++;
 		path_exist = 1;
-		if ((*(uri - 1) == '/') && (*target == '/'))
+		if ((*(uri - 1) == '/') && (target != end) && (*target == '/'))
 			do_copy = 0;
 		else
 			do_copy = 1;
@@ -182,35 +269,28 @@ uri_add_target(char *uri, char *target)
 	if (path_exist)
 		if (*(uri - 1) == '/')
 			uri--;
+	memcpy(uri, target, end - target);
+	uri += end - target;
 	*uri = '\0';
-	strcat(uri, target);
-}
-
-static void
-_free_pkt_header_cb(struct list_item_head *lh)
-{
-	struct http_header *hdr;
 	
-	hdr = list_item(lh, struct http_header, list);
-	free(hdr->name);
-	free(hdr->value);
-	free(hdr);
+	return uri - start;
 }
 
+/*
+ * Check if a payload starts with a known request method.
+ */
 static int
-free_pkt(struct pkt *pkt)
+probe_pkt(unsigned char *data, int size)
 {
-	struct pkt_http *pkt_http;
+	static const char * const methods[] = {"GET ", "POST", "HEAD", "PUT ",
+	  "DELE", "OPTI", "PATC", "CONN", "TRAC", NULL};
+	int i;
 	
-	if (pkt->pkt_type != pkt_type_http)
-		return -2;
-	pkt_http = (struct pkt_http*)pkt;
-	free(pkt_http->method);
-	free(pkt_http->target);
-	free(pkt_http->version);
-	if (pkt_http->headers)
-		list_free(&pkt_http->headers->list, _free_pkt_header_cb);
-	free(pkt_http);
+	if (size < 4)
+		return 0;
+	for(i = 0; methods[i]; i++)
+		if (memcmp(data, methods[i], 4) == 0)
+			return 1;
 	return 0;
 }
 
@@ -230,8 +310,6 @@ static int
 _dump_pkt(int outlvl, struct pkt *pkt)
 {
 	uint32_t id;
-	struct list_item_head *lh;
-	struct http_header *header;
 	struct pkt_http *pkt_http;
 	
 	if (pkt->pkt_type != pkt_type_http)
@@ -239,12 +317,13 @@ _dump_pkt(int outlvl, struct pkt *pkt)
 	id = get_pkt_id(pkt);
 	pkt_http = (struct pkt_http*)pkt;
 	
-	ANY_OUT(outlvl, "%u: http: %s %s %s, size = %d", id, pkt_http->method,
-	  pkt_http->target, pkt_http->version, pkt_http->pkt_len);
-	list_for_each(lh, &pkt_http->headers->list) {
-		header = list_item(lh, struct http_header, list);
-		ANY_OUT(outlvl, "%u: http: %s: %s", id, header->name, header->value);
-	}
+	ANY_OUT(outlvl, "%u: http: %.*s %.*s %.*s, size = %d", id,
+	  pkt_http->method_len, pkt_http->method, pkt_http->target_len,
+	  pkt_http->target, pkt_http->version_len, pkt_http->version,
+	  pkt_http->pkt_len);
+	if (pkt_http->host)
+		ANY_OUT(outlvl, "%u: http: host: %.*s", id, pkt_http->host_len,
+		  pkt_http->host);
 	ANY_OUT(outlvl, "%u: http: PACKET DUMP: %.*s", id, pkt_http->pkt_len,
 	  pkt_http->pkt_raw);
 	return 0;
@@ -253,216 +332,158 @@ _dump_pkt(int outlvl, struct pkt *pkt)
 struct pkt_hdlrs pkt_hdlrs_http = {
 	"http",
 	0,
+	PKT_ATTR_HOST | PKT_ATTR_URI,
 	init,
 	parse_pkt,
 	free_pkt,
 	dump_pkt,
-	errout_pkt
+	errout_pkt,
+	probe_pkt
 };
 
+/*
+ * Parse a request line.
+ * pkt - a http packet
+ * buf - a pointer to a request start; it's set to a next line start
+ * end - a packet data end
+ *
+ * return:
+ *   0 - everything is ok
+ *   1 - a request line is wrong
+ */
 static int
-_parse_start_line(struct pkt_http *pkt, char **buf, int *size)
+_parse_start_line(struct pkt_http *pkt, char **buf, char *end)
 {
-	int ret;
 	char *s, *e;
 
-	s = *buf;	
 	/* get method */
-	ret = _get_token(s, *size, &e);
-	if (ret != 3)
-		return 1;
-	*size -= e - s;
-	if ((e - s) > 7)
-		return 1;
-	pkt->method = strndup(s, e - s);
-	if (!pkt->method)
-		return -1;
-	
-	s = e;
-	ret = _get_token(s, *size, &e);
-	if (ret != 1)
+	s = *buf;
+	e = _find_chr(s, end, ' ', '\t', '\n');
+	if ((e == end) || (*e == '\n') || (e == s) || ((e - s) > 7))
 		return 1;
-	*size -= e - s;
+	pkt->method = s;
+	pkt->method_len = e - s;
 	
 	/* get target */
-	s = e;
-	ret = _get_token(s, *size, &e);
-	if (ret != 3)
-		return 1;
-	*size -= e - s;
-	pkt->target = strndup(s, e - s);
-	if (!pkt->target)
-		return -1;
-	
-	s = e;
-	ret = _get_token(s, *size, &e);
-	if (ret != 1)
+	s = _skip_spaces(e, end);
+	e = _find_chr(s, end, ' ', '\t', '\n');
+	if ((e == end) || (*e == '\n') || (e == s))
 		return 1;
-	*size -= e - s;
+	pkt->target = s;
+	pkt->target_len = e - s;
 	
 	/* get version */
-	s = e;
-	ret = _get_token(s, *size, &e);
-	if (ret != 3)
-		return 1;
-	*size -= e - s;
-	if ((e - s) != 8)
-		return 1;
-	if (strncmp("HTTP/1.1", s, 8) != 0)
-		return 1;
-	pkt->version = strndup(s, e - s);
-	if (!pkt->version)
-		return -1;
-
-	s = e;
-	ret = _get_token(s, *size, &e);
-	if (ret != 2)
-		return 1;
-	*size -= e - s;
-
-	*buf = e;
-	return 0;	
-}
-
-static int
-_parse_header(struct pkt_http *pkt, char **buf, int *size)
-{
-	int ret;
-	char *s, *ss, *e;
-	struct http_header *hdr;
-
-	s = *buf;
-	/* get header name */
-	ret = _get_token(s, *size, &e);
-	if ((ret == 2) || (ret == 0))
-		return 2;
-	if (ret != 3)
-		return 1;
-	*size -= e - s;
-	if (*(e - 1) != ':')
+	s = _skip_spaces(e, end);
+	if (((end - s) < 8) || (strncmp("HTTP/1.1", s, 8) != 0))
 		return 1;
-	hdr = _http_header_add(pkt, s, e - s - 1, NULL, 0);
-	if (!hdr)
-		return -1;
-	lcase_en(hdr->name);
-	
-	s = e;
-	ret = _get_token(s, *size, &e);
-	if (ret != 1)
+	pkt->version = s;
+	pkt->version_len = 8;
+	s = _skip_spaces(s + 8, end);
+	if ((s < end) && (*s == '\r'))
+		s++;
+	if ((s == end) || (*s != '\n'))
 		return 1;
-	*size -= e - s;
 	
-	/* get header value */
-	s = ss = e;
-	while (((ret = _get_token(s, *size, &e)) == 1) ||
-	       (ret == 3)) {
-		*size -= e - s;
-		s = e;
-	}
-	if (ret == 0)
-		return 1;
-	*size -= e - s;
-	hdr->value = strndup(ss, s - ss);
-	if (!hdr->value)
-		return -1;
-
-	*buf = e;
-	return 0;	
+	*buf = s + 1;
+	return 0;
 }
 
-static struct http_header*
-_http_header_add(struct pkt_http *pkt, char *name, int name_len, char *value,
-  int value_len)
+/*
+ * Scan a request till a host header. A scan is resumed from a state, so
+ * a data can be scanned by parts as it's appended: only line starts are
+ * checked(other headers aren't parsed) and no byte is scanned twice,
+ * except a request line, which is split again on each call.
+ * pkt - a http packet
+ * st - a scan state(zeroed for a new request)
+ * buf - a request start
+ * end - a data end
+ *
+ * return:
+ *   0 - a host header is found
+ *   1 - headers are truncated
+ *   2 - headers end is reached
+ *   3 - a request line is wrong
+ */
+static int
+_scan_request(struct pkt_http *pkt, struct reasm_state *st, char *buf,
+  char *end)
 {
-	struct http_header *header;
-	
-	header = malloc(sizeof(*header));
-	if (!header)
-		return NULL;
-	memset(header, 0, sizeof(*header));
-	list_item_head_init(&header->list);
+	char *s, *e;
 	
-	if (name) {
-		header->name = strndup(name, name_len);
-		if (!header->name)
-			goto err_cleanup;
+	if (st->http.start_line_end) {
+		s = buf;
+		_parse_start_line(pkt, &s, buf + st->http.start_line_end);
 	}
-	if (value) {
-		header->value = strndup(value, value_len);
-		if (!header->value)
-			goto err_cleanup;
+	for(;;) {
+		s = buf + st->http.line_off;
+		e = _find_chr(buf + st->http.scan_off, end, '\n', '\n', '\n');
+		if (e == end) {
+			st->http.scan_off = end - buf;
+			return 1;
+		}
+		st->http.line_off = st->http.scan_off = e + 1 - buf;
+		if (!st->http.start_line_end) {
+			if (_parse_start_line(pkt, &s, e + 1) != 0)
+				return 3;
+			st->http.start_line_end = e + 1 - buf;
+			continue;
+		}
+		if ((e == s) || ((e == (s + 1)) && (*s == '\r')))
+			return 2;
+		if (((e - s) < 5) || (strncasecmp(s, "host:", 5) != 0))
+			continue;
+		
+		s = _skip_spaces(s + 5, e);
+		for(; e > s; e--)
+			if ((e[-1] != '\r') && (e[-1] != ' ') && (e[-1] != '\t'))
+				break;
+		pkt->host = s;
+		pkt->host_len = e - s;
+		return 0;
 	}
-	if (pkt->headers)
-		list_add_before(&header->list, &pkt->headers->list);
-	pkt->headers = header;
-
-	return header;
-	
-err_cleanup:
-	free(header->name);
-	free(header->value);
-	free(header);
-	return NULL;
 }
 
 /*
- * Find a token end and return it length.
- * str - a buffer with tokens
- * n - a buffer size
- * end - a pointer to place address of character after last character of token
+ * Find a first c1, c2 or c3 character. SSE2 is used to check 16 bytes
+ * at once, if it's available.
+ * s - a buffer start
+ * end - a buffer end
+ * c1, c2, c3 - characters to find
  *
  * return:
- *   0 - token not found
- *   1 - token is space
- *   2 - token is new line
- *   3 - token is not space
+ *   pointer - a found character address
+ *   end - characters aren't found
  */
-static unsigned int
-_get_token(char *str, unsigned int n, char **end)
+static char*
+_find_chr(char *s, char *end, char c1, char c2, char c3)
 {
-	unsigned int i = 0, state = 0, ret = 0;
+#ifdef __SSE2__
+	__m128i v1, v2, v3, d, m;
+	unsigned int mask;
 	
-	for(i = 0; (state < 2) && (i < n); i++)
-		switch (state) {
-		case 0:
-			state = 1;
-			if ((str[i] == ' ') || (str[i] == '\t'))
-				ret = 1;
-			else if ((str[i] == '\r') || (str[i] == '\n'))
-				ret = 2;
-			else
-				ret = 3;
+	v1 = _mm_set1_epi8(c1);
+	v2 = _mm_set1_epi8(c2);
+	v3 = _mm_set1_epi8(c3);
+	for(; (end - s) >= 16; s += 16) {
+		d = _mm_loadu_si128((__m128i*)s);
+		m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(d, v1),
+		  _mm_cmpeq_epi8(d, v2)), _mm_cmpeq_epi8(d, v3));
+		mask = _mm_movemask_epi8(m);
+		if (mask)
+			return s + __builtin_ctz(mask);
+	}
+#endif
+	for(; s < end; s++)
+		if ((*s == c1) || (*s == c2) || (*s == c3))
 			break;
-		case 1:
-			switch (ret) {
-			case 1:
-				if ((str[i] != ' ') && (str[i] != '\t')) {
-					state = 2;
-					i--;
-				}
-				break;
-			case 2:
-				state = 2;
-				if ((str[i] != '\n') && (str[i] != '\r'))
-					i--;
-				break;
-			case 3:
-				if ((str[i] == ' ') || (str[i] == '\t')) {
-					state = 2;
-					i--;
-				} else if (str[i] == '\n') {
-					state = 2;
-					i--;
-					if (str[i] == '\r')
-						i--;
-					ret = 3;
-				}
-				break;
-			}
+	return s;
+}
+
+static char*
+_skip_spaces(char *s, char *end)
+{
+	for(; s < end; s++)
+		if ((*s != ' ') && (*s != '\t'))
 			break;
-		}
-	
-	*end = str + i;
-	
-	return ret;
+	return s;
 }
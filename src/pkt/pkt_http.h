@@ -3,18 +3,33 @@
 
 #include "list.h"
 
+struct reasm_flow;
+
+/*
+ * All strings are views into a packet payload(not null terminated).
+ */
 struct http_header {
 	struct list_item_head list;
 	char *name;
+	unsigned int name_len;
 	char *value;
+	unsigned int value_len;
 };
 
 struct pkt_http {
 	PKT_HEAD
 	char *method;
+	unsigned int method_len;
 	char *target;
+	unsigned int target_len;
 	char *version;
+	unsigned int version_len;
+	char *host;
+	unsigned int host_len;
+	/* pkt_http.c finds a host header only and doesn't fill headers */
 	struct http_header *headers;
+	/* a reassembled flow fields point to(see reasm.h) */
+	struct reasm_flow *reasm;
 };
 
 #endif  /* __PKT_HTTP_H__ */
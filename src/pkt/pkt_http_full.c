@@ -3,9 +3,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <strings.h>
 #include "log.h"
 #include "util.h"
 #include "pkt.h"
+#include "arena.h"
 #include "pkt_http.h"
 #include "pkt_tcp.h"
 #include "pkts_hdlrs.h"
@@ -19,12 +22,10 @@ struct http_token_ctx {
 };
 
 
-static int free_pkt(struct pkt *pkt);
 static int _parse_start_line(struct pkt_http *pkt, char **buf, int *size);
 static int _parse_header(struct pkt_http *pkt, char **buf, int *size);
-static struct http_header* _http_header_add(struct pkt_http *pkt, char *name, int name_len, char *value, int value_len);
+static struct http_header* _http_header_add(struct pkt_http *pkt, char *name, int name_len);
 static unsigned int _get_token(char *str, unsigned int n, char **end);
-static void _lc(char *name);
 static int _dump_pkt(int outlvl, struct pkt *pkt);
 
 
@@ -37,7 +38,7 @@ init(void)
 static int
 parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 {
-	char *uri = NULL, *ptr;
+	char *uri = NULL, *host, *ptr;
 	struct pkt_http *pkt;
 	int ret, len, id, is_host_found = 0;
 
@@ -48,10 +49,9 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 		return -2;
 	}
 	
-	pkt = malloc(sizeof(*pkt));
+	pkt = pkt_alloc(sizeof(*pkt));
 	if (!pkt)
 		return -1;
-	memset(pkt, 0, sizeof(*pkt));
 	list_item_head_init(&pkt->list);
 	list_add(&pkt->list, &pkt_prev->list);
 	
@@ -61,33 +61,36 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 	
 	ret = _parse_start_line(pkt, (char**)&data, &size);
 	if (ret != 0)
-		goto err_free_pkt;
+		goto err_unlink_pkt;
 	
 	while ((ret = _parse_header(pkt, (char**)&data, &size)) == 0) {
-		if (strcmp(pkt->headers->name, "host") == 0) {
-			ret = normalize_and_check_domain_name(pkt->headers->value);
+		if ((pkt->headers->name_len == 4) &&
+		  (strncasecmp(pkt->headers->name, "host", 4) == 0)) {
+			ret = -1;
+			host = pkt_strndup(pkt->headers->value, pkt->headers->value_len);
+			if (!host)
+				goto err_unlink_pkt;
+			ret = normalize_and_check_domain_name(host);
 			if (ret < 0)
-				goto err_free_pkt;
-			len = snprintf(NULL, 0, "http://%s%s", pkt->headers->value,
+				goto err_unlink_pkt;
+			len = snprintf(NULL, 0, "http://%s%.*s", host, pkt->target_len,
 			  pkt->target);
 			ret = -1;
-			uri = malloc(len + 1);
+			uri = pkt_alloc(len + 1);
 			if (!uri)
-				goto err_free_pkt;
-			snprintf(uri, len + 1, "http://%s%s", pkt->headers->value,
+				goto err_unlink_pkt;
+			snprintf(uri, len + 1, "http://%s%.*s", host, pkt->target_len,
 			  pkt->target);
-			ret = pkt_uri_add(pkt_prev, uri);
-			if (ret < 0) {
-				free(uri);
-				goto err_free_pkt;
-			}
-			len = strlen(pkt->headers->value);
-			ptr = strrchr(pkt->headers->value, ':');
+			ret = pkt_uri_add(pkt_prev, uri, len);
+			if (ret < 0)
+				goto err_unlink_pkt;
+			len = strlen(host);
+			ptr = strrchr(host, ':');
 			if (ptr)
-				len = ptr - pkt->headers->value;
-			ret = pkt_domain_add(pkt_prev, pkt->headers->value, len);
+				len = ptr - host;
+			ret = pkt_domain_add(pkt_prev, host, len);
 			if (ret < 0)
-				goto err_free_pkt;
+				goto err_unlink_pkt;
 			is_host_found = 1;
 			/* do process other headers */
 			ret = 2;
@@ -99,7 +102,7 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 		PKT_ERROUT((struct pkt*)pkt, "%u: http: headers parse error", id);
 		/* try to process wrong request too */
 		if (!is_host_found)
-			goto err_free_pkt;
+			goto err_unlink_pkt;
 	}
 	if (!is_host_found) {
 		id = get_pkt_id(pkt_prev);
@@ -108,44 +111,15 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 	
 	return 0;
 
-err_free_pkt:
+err_unlink_pkt:
 	if (ret < 0) {
 		id = get_pkt_id(pkt_prev);
 		PKT_ERROUT((struct pkt*)pkt, "%u: http parse error %d", id, ret);
 	}
 	list_rm(&pkt->list);
-	free_pkt((struct pkt*)pkt);
 	return ret;
 }
 
-static void
-_free_pkt_header_cb(struct list_item_head *lh)
-{
-	struct http_header *hdr;
-	
-	hdr = list_item(lh, struct http_header, list);
-	free(hdr->name);
-	free(hdr->value);
-	free(hdr);
-}
-
-static int
-free_pkt(struct pkt *pkt)
-{
-	struct pkt_http *pkt_http;
-	
-	if (pkt->pkt_type != pkt_type_http)
-		return -2;
-	pkt_http = (struct pkt_http*)pkt;
-	free(pkt_http->method);
-	free(pkt_http->target);
-	free(pkt_http->version);
-	if (pkt_http->headers)
-		list_free(&pkt_http->headers->list, _free_pkt_header_cb);
-	free(pkt_http);
-	return 0;
-}
-
 static int
 dump_pkt(struct pkt *pkt)
 {
@@ -171,13 +145,16 @@ _dump_pkt(int outlvl, struct pkt *pkt)
 	id = get_pkt_id(pkt);
 	pkt_http = (struct pkt_http*)pkt;
 	
-	ANY_OUT(outlvl, "%u: http: %s %s %s, size = %d", id, pkt_http->method,
-	  pkt_http->target, pkt_http->version, pkt_http->pkt_len);
+	ANY_OUT(outlvl, "%u: http: %.*s %.*s %.*s, size = %d", id,
+	  pkt_http->method_len, pkt_http->method, pkt_http->target_len,
+	  pkt_http->target, pkt_http->version_len, pkt_http->version,
+	  pkt_http->pkt_len);
 	list_for_each(lh, &pkt_http->headers->list) {
 		header = list_item(lh, struct http_header, list);
-		ANY_OUT(outlvl, "%u: http: %s: %s", id, header->name, header->value);
+		ANY_OUT(outlvl, "%u: http: %.*s: %.*s", id, header->name_len,
+		  header->name, header->value_len, header->value);
 	}
-	ANY_OUT(outlvl, "%u: http: PACKET DUMP: %.*s", pkt_http->pkt_len,
+	ANY_OUT(outlvl, "%u: http: PACKET DUMP: %.*s", id, pkt_http->pkt_len,
 	  pkt_http->pkt_raw);
 	return 0;
 }
@@ -185,11 +162,13 @@ _dump_pkt(int outlvl, struct pkt *pkt)
 struct pkt_hdlrs pkt_hdlrs_http = {
 	"http",
 	0,
+	PKT_ATTR_HOST | PKT_ATTR_URI,
 	init,
 	parse_pkt,
-	free_pkt,
+	NULL,
 	dump_pkt,
-	errout_pkt
+	errout_pkt,
+	NULL
 };
 
 static int
@@ -206,9 +185,8 @@ _parse_start_line(struct pkt_http *pkt, char **buf, int *size)
 	*size -= e - s;
 	if ((e - s) > 7)
 		return 1;
-	pkt->method = strndup(s, e - s);
-	if (!pkt->method)
-		return -1;
+	pkt->method = s;
+	pkt->method_len = e - s;
 	
 	s = e;
 	ret = _get_token(e, *size, &e);
@@ -225,9 +203,8 @@ _parse_start_line(struct pkt_http *pkt, char **buf, int *size)
 	ee = e;
 	while ((ee != s) && (*(ee - 1) == '/'))
 		ee--;
-	pkt->target = strndup(s, ee - s);
-	if (!pkt->target)
-		return -1;
+	pkt->target = s;
+	pkt->target_len = ee - s;
 	
 	s = e;
 	ret = _get_token(e, *size, &e);
@@ -245,9 +222,8 @@ _parse_start_line(struct pkt_http *pkt, char **buf, int *size)
 		return 1;
 	if (strncmp("HTTP/1.1", s, 8) != 0)
 		return 1;
-	pkt->version = strndup(s, e - s);
-	if (!pkt->version)
-		return -1;
+	pkt->version = s;
+	pkt->version_len = e - s;
 
 	s = e;
 	ret = _get_token(e, *size, &e);
@@ -276,10 +252,9 @@ _parse_header(struct pkt_http *pkt, char **buf, int *size)
 	*size -= e - s;
 	if (*(e - 1) != ':')
 		return 1;
-	hdr = _http_header_add(pkt, s, e - s - 1, NULL, 0);
+	hdr = _http_header_add(pkt, s, e - s - 1);
 	if (!hdr)
 		return -1;
-	_lc(hdr->name);
 	
 	s = e;
 	ret = _get_token(e, *size, &e);
@@ -297,47 +272,29 @@ _parse_header(struct pkt_http *pkt, char **buf, int *size)
 	if (ret == 0)
 		return 1;
 	*size -= e - s;
-	hdr->value = strndup(ss, s - ss);
-	if (!hdr->value)
-		return -1;
+	hdr->value = ss;
+	hdr->value_len = s - ss;
 
 	*buf = e;
 	return 0;	
 }
 
 static struct http_header*
-_http_header_add(struct pkt_http *pkt, char *name, int name_len, char *value,
-  int value_len)
+_http_header_add(struct pkt_http *pkt, char *name, int name_len)
 {
 	struct http_header *header;
 	
-	header = malloc(sizeof(*header));
+	header = pkt_alloc(sizeof(*header));
 	if (!header)
 		return NULL;
-	memset(header, 0, sizeof(*header));
 	list_item_head_init(&header->list);
-	
-	if (name) {
-		header->name = strndup(name, name_len);
-		if (!header->name)
-			goto err_cleanup;
-	}
-	if (value) {
-		header->value = strndup(value, value_len);
-		if (!header->value)
-			goto err_cleanup;
-	}
+	header->name = name;
+	header->name_len = name_len;
 	if (pkt->headers)
 		list_add_before(&header->list, &pkt->headers->list);
 	pkt->headers = header;
 
 	return header;
-	
-err_cleanup:
-	free(header->name);
-	free(header->value);
-	free(header);
-	return NULL;
 }
 
 /*
@@ -402,13 +359,3 @@ _get_token(char *str, unsigned int n, char **end)
 	return ret;
 }
 
-static void
-_lc(char *name)
-{
-	while (*name) {
-		if ((*name >= 65) && (*name <= 90))
-			*name = *name + 32;
-		name++;
-	}
-}
-
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include "log.h"
 #include "pkt.h"
+#include "arena.h"
 #include "pkt_icmp.h"
 #include "pkts_hdlrs.h"
 
@@ -22,10 +23,9 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 {
 	struct pkt_icmp *pkt;
 	
-	pkt = malloc(sizeof(*pkt));
+	pkt = pkt_alloc(sizeof(*pkt));
 	if (!pkt)
 		return -1;
-	memset(pkt, 0, sizeof(*pkt));
 	list_item_head_init(&pkt->list);
 	list_add(&pkt->list, &pkt_prev->list);
 
@@ -38,18 +38,6 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 	return 0;
 }
 
-static int
-free_pkt(struct pkt *pkt)
-{
-	struct pkt_icmp *pkt_icmp;
-	
-	if (pkt->pkt_type != pkt_type_icmp)
-		return -2;
-	pkt_icmp = (struct pkt_icmp*)pkt;
-	free(pkt_icmp);
-	return 0;
-}
-
 static int
 dump_pkt(struct pkt *pkt)
 {
@@ -81,10 +69,12 @@ _dump_pkt(int outlvl, struct pkt *pkt)
 struct pkt_hdlrs pkt_hdlrs_icmp = {
 	"icmp",
 	0,
+	PKT_ATTR_PORT,
 	init,
 	parse_pkt,
-	free_pkt,
+	NULL,
 	dump_pkt,
-	errout_pkt
+	errout_pkt,
+	NULL
 };
 
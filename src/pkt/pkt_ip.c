@@ -4,7 +4,9 @@
 #include <stdlib.h>
 #include "log.h"
 #include "pkt.h"
+#include "arena.h"
 #include "pkt_ip.h"
+#include "ipfrag.h"
 #include "pkts_hdlrs.h"
 
 
@@ -14,6 +16,8 @@ static char *ppkts_names[256] = {"_", "icmp", "igmp", "ggp", "ipencap",
   "xnet", "chaos", "udp"};
 
 
+static int _parse_payload(struct pkt *pkt_prev, struct pkt_ip *pkt, unsigned char *data, int size);
+static int _parse_frag(struct pkt *pkt_prev, struct pkt_ip *pkt, unsigned char *data, int size);
 static int _dump_pkt(int outlvl, struct pkt *pkt);
 
 
@@ -37,7 +41,6 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 	struct iphdr *iph;
 	struct pkt_ip *pkt;
 	uint16_t len;
-	int ret;
 
 	iph = (struct iphdr*)data;
 	if (iph->version != 4)
@@ -45,10 +48,9 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 	len = be16toh(iph->tot_len);
 	if (len != size)
 		return 1;
-	pkt = malloc(sizeof(*pkt));
+	pkt = pkt_alloc(sizeof(*pkt));
 	if (!pkt)
 		return -1;
-	memset(pkt, 0, sizeof(*pkt));
 	list_item_head_init(&pkt->list);
 	list_add(&pkt->list, &pkt_prev->list);
 
@@ -59,29 +61,80 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 	pkt->daddr = be32toh(iph->daddr);
 	pkt->proto = iph->protocol;
 	
-	if ((ppkts[pkt->proto]) && (ppkts[pkt->proto]->parse_pkt)) {
-		ret = ppkts[pkt->proto]->parse_pkt((struct pkt*)pkt,
-		  data + iph->ihl * 4, size - iph->ihl * 4);
+	if (be16toh(iph->frag_off) & (IP_MF | IP_OFFMASK))
+		return _parse_frag(pkt_prev, pkt, data, size);
+	return _parse_payload(pkt_prev, pkt, data + iph->ihl * 4,
+	  size - iph->ihl * 4);
+}
+
+/*
+ * Parse a payload of a datagram with an upper layer protocol parser.
+ */
+static int
+_parse_payload(struct pkt *pkt_prev, struct pkt_ip *pkt, unsigned char *data,
+  int size)
+{
+	int ret;
+	
+	if ((ppkts[pkt->proto]) && (ppkts[pkt->proto]->parse_pkt) &&
+	  (pkt_attrs_is_needed(pkt_prev, ppkts[pkt->proto]->attrs))) {
+		ret = ppkts[pkt->proto]->parse_pkt((struct pkt*)pkt, data, size);
 		if (ret != 0) {
 			ERR_OUT("parse_pkt error: %s: %d",
 			  ppkts[pkt->proto]->name, ret);
 			list_rm(&pkt->list);
-			free(pkt);
 			return ret;
 		}
 	}
 	return 0;
 }
 
+/*
+ * Parse a fragment. Fragments are buffered until a datagram is complete,
+ * then a datagram payload is parsed. A fragment, which can't be
+ * reassembled, is parsed only if it's the first one.
+ */
 static int
-free_pkt(struct pkt *pkt)
+_parse_frag(struct pkt *pkt_prev, struct pkt_ip *pkt, unsigned char *data,
+  int size)
 {
-	struct pkt_ip *pkt_ip;
+	struct ipfrag_flow *f;
+	unsigned char *payload;
+	unsigned int hlen;
+	int ret;
+	
+	hlen = ((struct iphdr*)data)->ihl * 4;
+	ret = ipfrag_add((struct pkt*)pkt, data, size, &f);
+	if (ret == 1) {
+		if (ipfrag_flow_hold(f, get_pkt_id(pkt_prev)) == 0)
+			pkt_hold(pkt_prev);
+		return 0;
+	} else if (ret == 2) {
+		if (be16toh(((struct iphdr*)data)->frag_off) & IP_OFFMASK)
+			return 0;
+		return _parse_payload(pkt_prev, pkt, data + hlen, size - hlen);
+	}
+	
+	/* a payload is copied, since parsers point to it */
+	payload = pkt_alloc(f->len);
+	if (!payload) {
+		ipfrag_flow_del(f, 1);
+		return -1;
+	}
+	memcpy(payload, f->buf, f->len);
+	ret = _parse_payload(pkt_prev, pkt, payload, f->len);
+	/* a datagram can be held by a payload parser(e.g. by a tcp
+	 * reassembly) - held fragments are released then */
+	if ((ret != 0) || (pkt_is_held(pkt_prev))) {
+		ipfrag_flow_del(f, 1);
+		return ret;
+	}
+	if (pkt_held_set(pkt_prev, f->held, f->held_cnt) < 0) {
+		ipfrag_flow_del(f, 1);
+		return -1;
+	}
+	ipfrag_flow_del(f, 0);
 	
-	if (pkt->pkt_type != pkt_type_ip)
-		return -2;
-	pkt_ip = (struct pkt_ip*)pkt;
-	free(pkt_ip);
 	return 0;
 }
 
@@ -121,10 +174,12 @@ _dump_pkt(int outlvl, struct pkt *pkt)
 struct pkt_hdlrs pkt_hdlrs_ip = {
 	"ip",
 	0,
+	PKT_ATTR_ALL,
 	init,
 	parse_pkt,
-	free_pkt,
+	NULL,
 	dump_pkt,
-	errout_pkt
+	errout_pkt,
+	NULL
 };
 
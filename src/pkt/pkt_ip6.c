@@ -0,0 +1,183 @@
+#include <netinet/ip6.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "log.h"
+#include "pkt.h"
+#include "arena.h"
+#include "pkt_ip6.h"
+#include "pkts_hdlrs.h"
+
+
+/* max number of extension headers to skip */
+#define IP6_EXTS_MAX 8
+
+
+static struct pkt_hdlrs *ppkts[256];
+static char *ppkts_names[256] = {[6] = "tcp", [17] = "udp"};
+
+
+static int _dump_pkt(int outlvl, struct pkt *pkt);
+
+
+static int
+init(void)
+{
+	int i, j;
+	
+	for(i = 0; i < 256; i++) {
+		if (!ppkts_names[i])
+			continue;
+		for(j = 0; pkts_list[j]; j++)
+			if (strcmp(ppkts_names[i], pkts_list[j]->name) == 0) {
+				ppkts[i] = pkts_list[j];
+				break;
+			}
+	}
+	return 0;
+}
+
+static int
+parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
+{
+	struct ip6_hdr *ip6h;
+	struct pkt_ip6 *pkt;
+	uint16_t frag;
+	int off, ret;
+	
+	if ((size < sizeof(*ip6h)) || ((data[0] >> 4) != 6))
+		return 1;
+	ip6h = (struct ip6_hdr*)data;
+	/* jumbograms(a zero length) aren't supported */
+	if (be16toh(ip6h->ip6_plen) + sizeof(*ip6h) != size)
+		return 1;
+	pkt = pkt_alloc(sizeof(*pkt));
+	if (!pkt)
+		return -1;
+	list_item_head_init(&pkt->list);
+	list_add(&pkt->list, &pkt_prev->list);
+	
+	pkt->pkt_type = pkt_type_ip6;
+	pkt->pkt_len = size;
+	pkt->pkt_raw = data;
+	memcpy(pkt->saddr, &ip6h->ip6_src, 16);
+	memcpy(pkt->daddr, &ip6h->ip6_dst, 16);
+	pkt->proto = ip6h->ip6_nxt;
+	off = pkt_ip6_exts_skip(data, size, &pkt->proto, &frag);
+	/* an upper layer header is in the first fragment only */
+	pkt->is_frag = (frag & PKT_IP6_FRAG_OFFMASK) != 0;
+	if ((off < 0) || (pkt->is_frag))
+		return 0;
+	
+	if ((ppkts[pkt->proto]) && (ppkts[pkt->proto]->parse_pkt) &&
+	  (pkt_attrs_is_needed(pkt_prev, ppkts[pkt->proto]->attrs))) {
+		ret = ppkts[pkt->proto]->parse_pkt((struct pkt*)pkt, data + off,
+		  size - off);
+		if (ret != 0) {
+			ERR_OUT("parse_pkt error: %s: %d",
+			  ppkts[pkt->proto]->name, ret);
+			list_rm(&pkt->list);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static int
+dump_pkt(struct pkt *pkt)
+{
+	return _dump_pkt(OUTLVL_DBG, pkt);
+}
+
+static int
+errout_pkt(struct pkt *pkt)
+{
+	return _dump_pkt(OUTLVL_ERR, pkt);
+}
+
+static int
+_dump_pkt(int outlvl, struct pkt *pkt)
+{
+	uint32_t id;
+	struct pkt_ip6 *pkt_ip6;
+	char saddr[INET6_ADDRSTRLEN], daddr[INET6_ADDRSTRLEN];
+	
+	if (pkt->pkt_type != pkt_type_ip6)
+		return -2;
+	id = get_pkt_id(pkt);
+	pkt_ip6 = (struct pkt_ip6*)pkt;
+	
+	inet_ntop(AF_INET6, pkt_ip6->saddr, saddr, sizeof(saddr));
+	inet_ntop(AF_INET6, pkt_ip6->daddr, daddr, sizeof(daddr));
+	ANY_OUT(outlvl, "%u: IPv6: %s -> %s, size = %d, proto = %d%s", id,
+	  saddr, daddr, pkt_ip6->pkt_len, pkt_ip6->proto,
+	  pkt_ip6->is_frag ? ", not first fragment" : "");
+	return 0;
+}
+
+struct pkt_hdlrs pkt_hdlrs_ip6 = {
+	"ip6",
+	0,
+	PKT_ATTR_ALL,
+	init,
+	parse_pkt,
+	NULL,
+	dump_pkt,
+	errout_pkt,
+	NULL
+};
+
+/*
+ * Skip extension headers of a packet.
+ * data - a packet data
+ * size - a packet size
+ * proto - a next header field of a fixed header; an upper layer protocol
+ *         is placed here
+ * frag - a pointer to place an offset and M flag of a fragment header
+ *        in host byte order(0 - a packet isn't a fragment)
+ *
+ * return:
+ *   >=0 - an upper layer header offset
+ *   -1 - an extension header is truncated or there are too many headers
+ */
+int
+pkt_ip6_exts_skip(unsigned char *data, int size, uint8_t *proto,
+  uint16_t *frag)
+{
+	int off = sizeof(struct ip6_hdr), i;
+	
+	*frag = 0;
+	for(i = 0; i < IP6_EXTS_MAX; i++) {
+		switch (*proto) {
+		case IPPROTO_HOPOPTS:
+		case IPPROTO_ROUTING:
+		case IPPROTO_DSTOPTS:
+			if (off + 2 > size)
+				return -1;
+			*proto = data[off];
+			off += (data[off + 1] + 1) * 8;
+			break;
+		case IPPROTO_FRAGMENT:
+			if (off + 8 > size)
+				return -1;
+			*proto = data[off];
+			/* an atomic fragment(offset 0 without M flag) is
+			 * a whole packet */
+			*frag = ((data[off + 2] << 8) | data[off + 3]) &
+			  (PKT_IP6_FRAG_OFFMASK | PKT_IP6_FRAG_MF);
+			off += 8;
+			break;
+		case IPPROTO_AH:
+			if (off + 2 > size)
+				return -1;
+			*proto = data[off];
+			off += (data[off + 1] + 2) * 4;
+			break;
+		default:
+			return off > size ? -1 : off;
+		}
+	}
+	
+	return -1;
+}
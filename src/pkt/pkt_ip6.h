@@ -0,0 +1,38 @@
+#ifndef __PKT_IP6_H__
+#define __PKT_IP6_H__
+
+
+/* an offset mask and M flag of a fragment header field */
+#define PKT_IP6_FRAG_OFFMASK 0xfff8
+#define PKT_IP6_FRAG_MF 0x0001
+
+
+struct pkt_ip6 {
+	PKT_HEAD
+	/* addresses in network byte order */
+	uint8_t saddr[16];
+	uint8_t daddr[16];
+	/* an upper layer protocol(after extension headers) */
+	uint8_t proto;
+	/* a packet is a not first fragment */
+	uint8_t is_frag;
+};
+
+
+/*
+ * Skip extension headers of a packet.
+ * data - a packet data
+ * size - a packet size
+ * proto - a next header field of a fixed header; an upper layer protocol
+ *         is placed here
+ * frag - a pointer to place an offset and M flag of a fragment header
+ *        in host byte order(0 - a packet isn't a fragment)
+ *
+ * return:
+ *   >=0 - an upper layer header offset
+ *   -1 - an extension header is truncated or there are too many headers
+ */
+int pkt_ip6_exts_skip(unsigned char *data, int size, uint8_t *proto, uint16_t *frag);
+
+
+#endif  /* __PKT_IP6_H__ */
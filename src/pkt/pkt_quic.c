@@ -0,0 +1,664 @@
+#include <endian.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include "log.h"
+#include "pkt.h"
+#include "arena.h"
+#include "reasm.h"
+#include "pkt_tls.h"
+#include "pkt_quic.h"
+#include "pkts_hdlrs.h"
+
+
+#define QUIC_V1 0x00000001
+#define QUIC_V2 0x6b3343cf
+#define QUIC_CID_MAX 20
+/* client datagrams with Initial packets must be padded to this size */
+#define QUIC_INITIAL_MIN 1200
+/* max number of dcid states of a thread(must be a power of 2) */
+#define QUIC_FLOWS 256
+#define QUIC_PROBES 4
+/* max ClientHello size */
+#define QUIC_CRYPTO_MAX 4096
+/* max number of not adjacent parts of a CRYPTO stream */
+#define QUIC_CRYPTO_RANGES 8
+/* max dcid state lifetime in seconds */
+#define QUIC_TIMEOUT 10
+
+
+/* a received part of a CRYPTO stream */
+struct quic_range {
+	unsigned int start;
+	unsigned int end;
+};
+
+/*
+ * A state of a connection attempt: client Initial keys derived from
+ * a dcid and a ClientHello reassembled from CRYPTO frames.
+ */
+struct quic_flow {
+	uint8_t dcid[QUIC_CID_MAX];
+	uint8_t dcid_len;
+	uint8_t is_used;
+	/* 0 - a sni isn't got yet, 1 - a sni is got, 2 - there is no sni */
+	uint8_t result;
+	uint32_t version;
+	/* a creation time in seconds */
+	uint32_t ts;
+	uint8_t key[16];
+	uint8_t iv[12];
+	uint8_t hp[16];
+	/* received parts of a CRYPTO stream(sorted, not overlapped) */
+	struct quic_range ranges[QUIC_CRYPTO_RANGES];
+	unsigned int ranges_cnt;
+	struct reasm_state st;
+	unsigned int sni_off;
+	unsigned int sni_len;
+	unsigned char *buf;
+};
+
+struct quic_table {
+	struct quic_flow *f;
+	unsigned char *bufs;
+	EVP_CIPHER_CTX *gcm;
+	EVP_CIPHER_CTX *ecb;
+};
+
+struct quic_ver {
+	uint32_t version;
+	/* a long header packet type of Initial */
+	uint8_t initial_type;
+	uint8_t salt[20];
+	char *key_label;
+	char *iv_label;
+	char *hp_label;
+};
+
+
+static struct quic_ver quic_vers[] = {
+	{QUIC_V1, 0, {0x38, 0x76, 0x2c, 0xf7, 0xf5, 0x59, 0x34, 0xb3, 0x4d, 0x17,
+	  0x9a, 0xe6, 0xa4, 0xc8, 0x0c, 0xad, 0xcc, 0xbb, 0x7f, 0x0a},
+	  "quic key", "quic iv", "quic hp"},
+	{QUIC_V2, 1, {0x0d, 0xed, 0xe3, 0xde, 0xf7, 0x00, 0xa6, 0xdb, 0x81, 0x93,
+	  0x81, 0xbe, 0x6e, 0x26, 0x9d, 0xcb, 0xf9, 0xbd, 0x2e, 0xd9},
+	  "quicv2 key", "quicv2 iv", "quicv2 hp"},
+	{0, 0, {0}, NULL, NULL, NULL}
+};
+
+static __thread struct quic_table *qtable;
+
+
+static struct quic_ver* _quic_ver_get(unsigned char *data);
+static unsigned char* _varint_get(unsigned char *p, unsigned char *end, uint64_t *val);
+static struct quic_table* _quic_table_get(void);
+static struct quic_flow* _quic_flow_get(struct quic_table *t, unsigned char *dcid, unsigned int dcid_len, struct quic_ver *ver);
+static int _quic_decrypt(struct quic_table *t, struct quic_flow *f, unsigned char *data, unsigned int pn_off, unsigned int end, unsigned char **out, unsigned int *out_len, uint32_t *pn);
+static void _quic_frames_parse(struct quic_flow *f, unsigned char *p, unsigned char *end);
+static void _quic_sni_get(struct quic_flow *f);
+static int _dump_pkt(int outlvl, struct pkt *pkt);
+
+
+/*
+ * Parse a client Initial packet(the first one in a datagram). Keys are
+ * derived from a dcid, a packet is decrypted and CRYPTO frames are
+ * gathered in a dcid state until a ClientHello sni is got. Next Initial
+ * packets with the same dcid get a sni from a state without a decryption.
+ */
+static int
+parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
+{
+	struct pkt_quic *pkt;
+	struct quic_ver *ver;
+	struct quic_table *t;
+	struct quic_flow *f;
+	unsigned char *p, *end, *dcid, *out;
+	unsigned int dcid_len, pn_off, out_len;
+	uint64_t n;
+	int ret;
+	
+	if ((size < 7) || ((data[0] & 0xc0) != 0xc0))
+		return 1;
+	ver = _quic_ver_get(data);
+	if ((!ver) || (((data[0] >> 4) & 0x03) != ver->initial_type))
+		return 1;
+	/* a dcid, a scid, a token and a length */
+	p = data + 5;
+	end = data + size;
+	dcid_len = *p++;
+	if ((dcid_len > QUIC_CID_MAX) || ((end - p) <= dcid_len))
+		return 1;
+	dcid = p;
+	p += dcid_len;
+	n = *p++;
+	if ((n > QUIC_CID_MAX) || ((end - p) < n))
+		return 1;
+	p += n;
+	p = _varint_get(p, end, &n);
+	if ((!p) || ((end - p) < n))
+		return 1;
+	p += n;
+	p = _varint_get(p, end, &n);
+	if ((!p) || ((end - p) < n))
+		return 1;
+	pn_off = p - data;
+	
+	pkt = pkt_alloc(sizeof(*pkt));
+	if (!pkt)
+		return -1;
+	list_item_head_init(&pkt->list);
+	list_add(&pkt->list, &pkt_prev->list);
+	
+	pkt->pkt_type = pkt_type_quic;
+	pkt->pkt_len = size;
+	pkt->pkt_raw = data;
+	pkt->version = ver->version;
+	pkt->dcid_len = dcid_len;
+	
+	t = _quic_table_get();
+	if (!t)
+		return 0;
+	f = _quic_flow_get(t, dcid, dcid_len, ver);
+	if (!f)
+		return 0;
+	if (f->result) {
+		pkt->is_cached = 1;
+	} else {
+		ret = _quic_decrypt(t, f, data, pn_off, pn_off + n, &out, &out_len,
+		  &pkt->pn);
+		if (ret < 0)
+			goto err_unlink_pkt;
+		if (ret > 0) {
+			DBG_OUT("%u: quic: Initial packet decryption error",
+			  get_pkt_id(pkt_prev));
+			return 0;
+		}
+		_quic_frames_parse(f, out, out + out_len);
+		_quic_sni_get(f);
+	}
+	if (f->result != 1)
+		return 0;
+	
+	pkt->sni = (char*)f->buf + f->sni_off;
+	pkt->sni_len = f->sni_len;
+	ret = pkt_domain_add(pkt_prev, pkt->sni, pkt->sni_len);
+	if (ret < 0)
+		goto err_unlink_pkt;
+	
+	return 0;
+	
+err_unlink_pkt:
+	list_rm(&pkt->list);
+	return ret;
+}
+
+/*
+ * Check if a payload looks like a datagram with a client Initial packet.
+ */
+static int
+probe_pkt(unsigned char *data, int size)
+{
+	struct quic_ver *ver;
+	
+	if ((size < QUIC_INITIAL_MIN) || ((data[0] & 0xc0) != 0xc0))
+		return 0;
+	ver = _quic_ver_get(data);
+	
+	return (ver) && (((data[0] >> 4) & 0x03) == ver->initial_type);
+}
+
+static int
+dump_pkt(struct pkt *pkt)
+{
+	return _dump_pkt(OUTLVL_DBG, pkt);
+}
+
+static int
+errout_pkt(struct pkt *pkt)
+{
+	return _dump_pkt(OUTLVL_ERR, pkt);
+}
+
+static int
+_dump_pkt(int outlvl, struct pkt *pkt)
+{
+	struct pkt_quic *pkt_quic;
+	uint32_t id;
+	
+	if (pkt->pkt_type != pkt_type_quic)
+		return -2;
+	id = get_pkt_id(pkt);
+	pkt_quic = (struct pkt_quic*)pkt;
+	
+	ANY_OUT(outlvl, "%u: quic: Initial, version=0x%08x, dcid length=%hhu, "
+	  "pn=%u, size = %u", id, pkt_quic->version, pkt_quic->dcid_len,
+	  pkt_quic->pn, pkt_quic->pkt_len);
+	if (pkt_quic->sni)
+		ANY_OUT(outlvl, "%u: quic: sni=%.*s%s", id, pkt_quic->sni_len,
+		  pkt_quic->sni, pkt_quic->is_cached ? "(cached)" : "");
+	return 0;
+}
+
+struct pkt_hdlrs pkt_hdlrs_quic = {
+	"quic",
+	0,
+	PKT_ATTR_SNI,
+	NULL,
+	parse_pkt,
+	NULL,
+	dump_pkt,
+	errout_pkt,
+	probe_pkt
+};
+
+static struct quic_ver*
+_quic_ver_get(unsigned char *data)
+{
+	uint32_t version;
+	int i;
+	
+	version = be32toh(*(uint32_t*)(data + 1));
+	for(i = 0; quic_vers[i].version; i++)
+		if (quic_vers[i].version == version)
+			return &quic_vers[i];
+	
+	return NULL;
+}
+
+/*
+ * Get a variable-length integer.
+ * p - an integer start
+ * end - a data end
+ * val - a pointer to place an integer
+ *
+ * return:
+ *   pointer - a pointer to the next byte after an integer
+ *   NULL - an integer is truncated
+ */
+static unsigned char*
+_varint_get(unsigned char *p, unsigned char *end, uint64_t *val)
+{
+	unsigned int len, i;
+	
+	if (p >= end)
+		return NULL;
+	len = 1 << (*p >> 6);
+	if ((end - p) < len)
+		return NULL;
+	*val = *p & 0x3f;
+	for(i = 1; i < len; i++)
+		*val = (*val << 8) | p[i];
+	
+	return p + len;
+}
+
+/*
+ * Get a table of the current thread. It's allocated on the first call.
+ *
+ * return:
+ *   table - a pointer to a table
+ *   NULL - a memory error occured
+ */
+static struct quic_table*
+_quic_table_get(void)
+{
+	struct quic_table *t;
+	unsigned int i;
+	
+	if (qtable)
+		return qtable;
+	
+	t = malloc(sizeof(*t));
+	if (!t)
+		goto err;
+	memset(t, 0, sizeof(*t));
+	t->f = calloc(QUIC_FLOWS, sizeof(*t->f));
+	if (!t->f)
+		goto err_free_t;
+	t->bufs = malloc(QUIC_FLOWS * QUIC_CRYPTO_MAX);
+	if (!t->bufs)
+		goto err_free_f;
+	for(i = 0; i < QUIC_FLOWS; i++)
+		t->f[i].buf = t->bufs + i * QUIC_CRYPTO_MAX;
+	t->gcm = EVP_CIPHER_CTX_new();
+	t->ecb = EVP_CIPHER_CTX_new();
+	if ((!t->gcm) || (!t->ecb))
+		goto err_free_ctx;
+	if ((!EVP_DecryptInit_ex(t->gcm, EVP_aes_128_gcm(), NULL, NULL, NULL)) ||
+	  (!EVP_EncryptInit_ex(t->ecb, EVP_aes_128_ecb(), NULL, NULL, NULL)))
+		goto err_free_ctx;
+	EVP_CIPHER_CTX_set_padding(t->ecb, 0);
+	qtable = t;
+	
+	return t;
+	
+err_free_ctx:
+	EVP_CIPHER_CTX_free(t->ecb);
+	EVP_CIPHER_CTX_free(t->gcm);
+	free(t->bufs);
+err_free_f:
+	free(t->f);
+err_free_t:
+	free(t);
+err:
+	ERR_OUT("quic table allocating error");
+	return NULL;
+}
+
+/*
+ * Make a TLS 1.3 HKDF-Expand-Label with an empty context. A length must
+ * be <= 32(one HMAC-SHA256 block).
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - an error occured
+ */
+static int
+_hkdf_expand_label(uint8_t *secret, char *label, uint8_t *out,
+  unsigned int len)
+{
+	uint8_t info[2 + 1 + 255 + 1 + 1], md[EVP_MAX_MD_SIZE];
+	unsigned int label_len, info_len, md_len;
+	
+	label_len = strlen(label);
+	info[0] = 0;
+	info[1] = len;
+	info[2] = 6 + label_len;
+	memcpy(info + 3, "tls13 ", 6);
+	memcpy(info + 9, label, label_len);
+	info_len = 9 + label_len;
+	/* an empty context and a block counter */
+	info[info_len++] = 0;
+	info[info_len++] = 1;
+	if (!HMAC(EVP_sha256(), secret, 32, info, info_len, md, &md_len))
+		return -1;
+	memcpy(out, md, len);
+	
+	return 0;
+}
+
+/*
+ * Derive client Initial keys of a flow.
+ *
+ * return:
+ *   0 - everything is ok
+ *  -1 - an error occured
+ */
+static int
+_quic_keys_make(struct quic_flow *f, struct quic_ver *ver)
+{
+	uint8_t secret[EVP_MAX_MD_SIZE], client_secret[32];
+	unsigned int len;
+	
+	/* HKDF-Extract */
+	if (!HMAC(EVP_sha256(), ver->salt, sizeof(ver->salt), f->dcid,
+	  f->dcid_len, secret, &len))
+		return -1;
+	if ((_hkdf_expand_label(secret, "client in", client_secret, 32) < 0) ||
+	  (_hkdf_expand_label(client_secret, ver->key_label, f->key, 16) < 0) ||
+	  (_hkdf_expand_label(client_secret, ver->iv_label, f->iv, 12) < 0) ||
+	  (_hkdf_expand_label(client_secret, ver->hp_label, f->hp, 16) < 0))
+		return -1;
+	
+	return 0;
+}
+
+static uint32_t
+_quic_now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	
+	return ts.tv_sec;
+}
+
+/*
+ * Find a state of a dcid or add it. A free or expired slot is taken for
+ * a new state; if there is no one, the oldest state in a probe window is
+ * evicted.
+ *
+ * return:
+ *   flow - a pointer to a state
+ *   NULL - keys deriving error
+ */
+static struct quic_flow*
+_quic_flow_get(struct quic_table *t, unsigned char *dcid,
+  unsigned int dcid_len, struct quic_ver *ver)
+{
+	struct quic_flow *f, *victim = NULL;
+	uint32_t h, now;
+	unsigned int i;
+	
+	/* FNV-1a */
+	h = 2166136261u;
+	for(i = 0; i < dcid_len; i++)
+		h = (h ^ dcid[i]) * 16777619u;
+	now = _quic_now();
+	for(i = 0; i < QUIC_PROBES; i++) {
+		f = &t->f[(h + i) & (QUIC_FLOWS - 1)];
+		if ((!f->is_used) || ((now - f->ts) >= QUIC_TIMEOUT)) {
+			if (!victim)
+				victim = f;
+			continue;
+		}
+		if ((f->dcid_len == dcid_len) && (f->version == ver->version) &&
+		  (memcmp(f->dcid, dcid, dcid_len) == 0))
+			return f;
+		if ((!victim) || ((victim->is_used) &&
+		  ((int32_t)(f->ts - victim->ts) < 0)))
+			victim = f;
+	}
+	
+	f = victim;
+	memcpy(f->dcid, dcid, dcid_len);
+	f->dcid_len = dcid_len;
+	f->version = ver->version;
+	f->ts = now;
+	f->result = 0;
+	f->ranges_cnt = 0;
+	memset(&f->st, 0, sizeof(f->st));
+	f->is_used = 1;
+	if (_quic_keys_make(f, ver) < 0) {
+		ERR_OUT("quic: Initial keys deriving error");
+		f->is_used = 0;
+		return NULL;
+	}
+	
+	return f;
+}
+
+/*
+ * Remove a header protection and decrypt a packet payload. A header is
+ * copied, so a packet data isn't changed. Only a truncated packet number
+ * is used for a nonce: it's enough for first client packets.
+ * t - a thread table
+ * f - a dcid state
+ * data - a packet start
+ * pn_off - a packet number offset
+ * end - a packet end offset
+ * out - a pointer to place a decrypted payload(in the packet arena)
+ * out_len - a pointer to place a decrypted payload length
+ * pn - a pointer to place a packet number
+ *
+ * return:
+ *   0 - everything is ok
+ *   1 - a packet is too short
+ *   2 - a decryption error(a packet isn't authenticated)
+ *  -1 - a memory error occured
+ */
+static int
+_quic_decrypt(struct quic_table *t, struct quic_flow *f, unsigned char *data,
+  unsigned int pn_off, unsigned int end, unsigned char **out,
+  unsigned int *out_len, uint32_t *pn)
+{
+	unsigned char *hdr, mask[16], nonce[12];
+	unsigned int pn_len, i;
+	int len;
+	
+	/* a sample starts 4 bytes after a packet number start */
+	if ((pn_off + 4 + 16) > end)
+		return 1;
+	if ((!EVP_EncryptInit_ex(t->ecb, NULL, NULL, f->hp, NULL)) ||
+	  (!EVP_EncryptUpdate(t->ecb, mask, &len, data + pn_off + 4, 16)))
+		return 2;
+	hdr = pkt_alloc(pn_off + 4);
+	if (!hdr)
+		return -1;
+	memcpy(hdr, data, pn_off + 4);
+	hdr[0] ^= mask[0] & 0x0f;
+	pn_len = (hdr[0] & 0x03) + 1;
+	*pn = 0;
+	for(i = 0; i < pn_len; i++) {
+		hdr[pn_off + i] ^= mask[1 + i];
+		*pn = (*pn << 8) | hdr[pn_off + i];
+	}
+	memcpy(nonce, f->iv, sizeof(nonce));
+	for(i = 0; i < 4; i++)
+		nonce[11 - i] ^= (*pn >> (8 * i)) & 0xff;
+	
+	/* a payload is followed by a 16 bytes tag */
+	*out_len = end - pn_off - pn_len - 16;
+	*out = pkt_alloc(*out_len + 16);
+	if (!*out)
+		return -1;
+	if ((!EVP_DecryptInit_ex(t->gcm, NULL, NULL, f->key, nonce)) ||
+	  (!EVP_DecryptUpdate(t->gcm, NULL, &len, hdr, pn_off + pn_len)) ||
+	  (!EVP_DecryptUpdate(t->gcm, *out, &len, data + pn_off + pn_len,
+	  *out_len)) ||
+	  (!EVP_CIPHER_CTX_ctrl(t->gcm, EVP_CTRL_GCM_SET_TAG, 16,
+	  data + end - 16)) ||
+	  (EVP_DecryptFinal_ex(t->gcm, *out + len, &len) <= 0))
+		return 2;
+	
+	return 0;
+}
+
+/*
+ * Add a CRYPTO frame data to a dcid state. A data beyond QUIC_CRYPTO_MAX
+ * is skipped; a frame is skipped if a stream is too fragmented.
+ */
+static void
+_quic_crypto_add(struct quic_flow *f, uint64_t off, unsigned char *data,
+  uint64_t len)
+{
+	struct quic_range rs[QUIC_CRYPTO_RANGES + 1];
+	unsigned int start, end, i, n = 0;
+	int is_added = 0;
+	
+	if (off >= QUIC_CRYPTO_MAX)
+		return;
+	if (len > (QUIC_CRYPTO_MAX - off))
+		len = QUIC_CRYPTO_MAX - off;
+	start = off;
+	end = off + len;
+	for(i = 0; i < f->ranges_cnt; i++) {
+		if (f->ranges[i].end < start) {
+			rs[n++] = f->ranges[i];
+		} else if (f->ranges[i].start > end) {
+			if (!is_added) {
+				rs[n].start = start;
+				rs[n++].end = end;
+				is_added = 1;
+			}
+			if (n == (QUIC_CRYPTO_RANGES + 1))
+				return;
+			rs[n++] = f->ranges[i];
+		} else {
+			/* overlapped or adjacent ranges are merged */
+			if (f->ranges[i].start < start)
+				start = f->ranges[i].start;
+			if (f->ranges[i].end > end)
+				end = f->ranges[i].end;
+		}
+	}
+	if (!is_added) {
+		rs[n].start = start;
+		rs[n++].end = end;
+	}
+	if (n > QUIC_CRYPTO_RANGES)
+		return;
+	memcpy(f->buf + off, data, len);
+	memcpy(f->ranges, rs, sizeof(*rs) * n);
+	f->ranges_cnt = n;
+}
+
+/*
+ * Parse frames of a decrypted Initial packet. Only CRYPTO frames are
+ * taken; a parsing is stopped on a frame, which can't be in a client
+ * Initial packet.
+ * f - a dcid state
+ * p - a payload start
+ * end - a payload end
+ */
+static void
+_quic_frames_parse(struct quic_flow *f, unsigned char *p, unsigned char *end)
+{
+	uint64_t type, off, len, cnt, n;
+	
+	while (p < end) {
+		p = _varint_get(p, end, &type);
+		if (!p)
+			return;
+		switch (type) {
+		case 0x00:
+			/* PADDING */
+			while ((p < end) && (*p == 0))
+				p++;
+			break;
+		case 0x01:
+			/* PING */
+			break;
+		case 0x02:
+		case 0x03:
+			/* ACK: a largest, a delay, a ranges count, a first range,
+			 * ranges(a gap and a length) and ECN counts */
+			if ((!(p = _varint_get(p, end, &n))) ||
+			  (!(p = _varint_get(p, end, &n))) ||
+			  (!(p = _varint_get(p, end, &cnt))) ||
+			  (!(p = _varint_get(p, end, &n))))
+				return;
+			cnt = cnt * 2 + ((type == 0x03) ? 3 : 0);
+			for(; cnt; cnt--)
+				if (!(p = _varint_get(p, end, &n)))
+					return;
+			break;
+		case 0x06:
+			/* CRYPTO */
+			if ((!(p = _varint_get(p, end, &off))) ||
+			  (!(p = _varint_get(p, end, &len))) || ((end - p) < len))
+				return;
+			_quic_crypto_add(f, off, p, len);
+			p += len;
+			break;
+		default:
+			return;
+		}
+	}
+}
+
+/*
+ * Scan a received prefix of a CRYPTO stream for a ClientHello sni.
+ */
+static void
+_quic_sni_get(struct quic_flow *f)
+{
+	unsigned int len;
+	char *name;
+	int ret;
+	
+	if ((!f->ranges_cnt) || (f->ranges[0].start != 0))
+		return;
+	ret = tls_sni_scan(&f->st, f->buf, f->ranges[0].end, QUIC_CRYPTO_MAX,
+	  &name, &len);
+	if (ret == 0) {
+		f->result = 1;
+		f->sni_off = (unsigned char*)name - f->buf;
+		f->sni_len = len;
+	} else if (ret != 1) {
+		f->result = 2;
+	}
+}
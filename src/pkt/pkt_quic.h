@@ -0,0 +1,17 @@
+#ifndef __PKT_QUIC_H__
+#define __PKT_QUIC_H__
+
+struct pkt_quic {
+	PKT_HEAD
+	uint32_t version;
+	uint8_t dcid_len;
+	/* a packet number of a decrypted packet */
+	uint32_t pn;
+	/* a server name(a view into a dcid state buffer) */
+	char *sni;
+	unsigned int sni_len;
+	/* a sni is taken from a dcid state without a decryption */
+	uint8_t is_cached;
+};
+
+#endif  /* __PKT_QUIC_H__ */
@@ -4,13 +4,18 @@
 #include <stdint.h>
 #include "log.h"
 #include "pkt.h"
+#include "arena.h"
 #include "pkt_tcp.h"
+#include "reasm.h"
 #include "pkts_hdlrs.h"
 
 
 /* List of payload packets that we can process */
 static struct pkt_hdlrs *ppkts[3];
 static char *ppkts_names[3] = {"http", "tls", NULL};
+/* Payload packets ports hints(checked before signatures) */
+static struct pkt_port_hint ports_hints[] = {{80, "http", NULL}, {8080, "http", NULL},
+  {443, "tls", NULL}, {0, NULL, NULL}};
 
 
 static int _dump_pkt(int outlvl, struct pkt *pkt);
@@ -27,6 +32,7 @@ init(void)
 				ppkts[k++] = pkts_list[j];
 				break;
 			}
+	pkt_port_hints_init(ports_hints);
 	return 0;
 }
 
@@ -35,13 +41,13 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 {
 	struct tcphdr *tcph;
 	struct pkt_tcp *pkt;
-	int i, ret;
+	struct pkt_hdlrs *hdlrs;
+	int ret;
 	
 	tcph = (struct tcphdr*)data;
-	pkt = malloc(sizeof(*pkt));
+	pkt = pkt_alloc(sizeof(*pkt));
 	if (!pkt)
 		return -1;
-	memset(pkt, 0, sizeof(*pkt));
 	list_item_head_init(&pkt->list);
 	list_add(&pkt->list, &pkt_prev->list);
 
@@ -50,37 +56,33 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 	pkt->pkt_raw = data;
 	pkt->sport = be16toh(tcph->source);
 	pkt->dport = be16toh(tcph->dest);
+	pkt->seq = be32toh(tcph->seq);
 
-	for(i = 0; ppkts[i]; i++) {
-		if (!ppkts[i]->parse_pkt)
-			continue;
-		ret = ppkts[i]->parse_pkt((struct pkt*)pkt, data + tcph->doff * 4,
+	/* a flow payload is reassembled - pass it to the same handler */
+	pkt->reasm = reasm_flow_get((struct pkt*)pkt);
+	if ((pkt->reasm) && ((tcph->rst) || (tcph->syn))) {
+		reasm_flow_del(pkt->reasm, 1);
+		pkt->reasm = NULL;
+	}
+	if (pkt->reasm)
+		hdlrs = pkt->reasm->hdlrs;
+	else
+		hdlrs = pkt_payload_classify((struct pkt*)pkt, ppkts, ports_hints,
+		  pkt->sport, pkt->dport, data + tcph->doff * 4,
 		  size - tcph->doff * 4);
-		if (ret < 0) {
-			ERR_OUT("parse_pkt error: %s: %d", ppkts[i]->name, ret);
-			list_rm(&pkt->list);
-			free(pkt);
-			return ret;
-		} else if (ret == 0) {
-			break;
-		}
+	if (!hdlrs)
+		return 0;
+	ret = hdlrs->parse_pkt((struct pkt*)pkt, data + tcph->doff * 4,
+	  size - tcph->doff * 4);
+	if (ret < 0) {
+		ERR_OUT("parse_pkt error: %s: %d", hdlrs->name, ret);
+		list_rm(&pkt->list);
+		return ret;
 	}
 	
 	return 0;
 }
 
-static int
-free_pkt(struct pkt *pkt)
-{
-	struct pkt_tcp *pkt_tcp;
-	
-	if (pkt->pkt_type != pkt_type_tcp)
-		return -2;
-	pkt_tcp = (struct pkt_tcp*)pkt;
-	free(pkt_tcp);
-	return 0;
-}
-
 static int
 dump_pkt(struct pkt *pkt)
 {
@@ -112,10 +114,12 @@ _dump_pkt(int outlvl, struct pkt *pkt)
 struct pkt_hdlrs pkt_hdlrs_tcp = {
 	"tcp",
 	0,
+	PKT_ATTR_PORT | PKT_ATTR_SNI | PKT_ATTR_HOST | PKT_ATTR_URI,
 	init,
 	parse_pkt,
-	free_pkt,
+	NULL,
 	dump_pkt,
-	errout_pkt
+	errout_pkt,
+	NULL
 };
 
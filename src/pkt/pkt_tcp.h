@@ -1,10 +1,15 @@
 #ifndef __PKT_TCP_H__
 #define __PKT_TCP_H__
 
+struct reasm_flow;
+
 struct pkt_tcp {
 	PKT_HEAD
 	uint16_t sport;
 	uint16_t dport;
+	uint32_t seq;
+	/* a reassembled flow of a packet(see reasm.h) */
+	struct reasm_flow *reasm;
 };
 
 #endif  /* __PKT_TCP_H__ */
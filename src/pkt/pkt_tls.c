@@ -2,10 +2,15 @@
 #include <endian.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include "main.h"
 #include "log.h"
 #include "util.h"
 #include "pkt.h"
+#include "arena.h"
 #include "pkt_tls.h"
+#include "pkt_tcp.h"
+#include "reasm.h"
 #include "pkts_hdlrs.h"
 
 
@@ -22,11 +27,19 @@ struct tlsmsghdr {
 } __attribute__ ((__packed__));
 
 
-static int free_pkt(struct pkt *pkt);
+static int _parse_client_hello(struct pkt *pkt_prev, unsigned char *data, int size);
+static int _scan_client_hello(struct reasm_state *st, unsigned char *buf, unsigned int len, char **name, unsigned int *name_len);
+#ifdef DEBUG
+static void _add_msgs(struct pkt_tls *pkt, unsigned char *data, int size);
 static int _add_msg(struct pkt_tls *pkt, unsigned char **data, int *size);
 static int _add_msg_clientHello_ext(struct tls_msg *msg, unsigned char **data, int *size);
+#endif
 static int _dump_pkt(int outlvl, struct pkt *pkt);
 
+struct pkt_hdlrs pkt_hdlrs_tls;
+
+extern struct global_opts opts;
+
 
 static int
 init(void)
@@ -38,28 +51,27 @@ init(void)
 static int
 parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 {
-	struct list_item_head *lh, *lh1;
 	struct tlshdr *tlsh;
-	struct tls_ext *ext;
-	struct tls_ext_sni_name *sni;
-	struct pkt_tls *pkt;
-	int len, ret;
-
+	int len;
+	
 	if (sizeof(*tlsh) != 5) {
 		ERR_OUT("tls: struct tlshdr size is't equal to 5!");
 		return -3;
 	}
-	/* Is this really a tls packet? */
-	if (size < sizeof(*tlsh))
-		return 1;
 	if (pkt_prev->pkt_type != pkt_type_tcp) {
 		ERR_OUT("tls protocol can't be in %s protocol",
 		  pkts_list[pkt_prev->pkt_type]->name);
 		return -2;
 	}
+	/* a ClientHello is split across segments */
+	if (((struct pkt_tcp*)pkt_prev)->reasm)
+		return _parse_client_hello(pkt_prev, data, size);
+	/* Is this really a tls packet? */
+	if (size < sizeof(*tlsh))
+		return 1;
 	tlsh = (struct tlshdr*)data;
 	len = be16toh(tlsh->length);
-	if ((len + sizeof(*tlsh)) != size)
+	if ((len + sizeof(*tlsh)) < size)
 		return 1;
 	if (tlsh->version_major != 3) {
 		/*
@@ -78,109 +90,242 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 	if (tlsh->type != 22)
 		return 1;
 	
-	pkt = malloc(sizeof(*pkt));
-	if (!pkt)
+	return _parse_client_hello(pkt_prev, data, size);
+}
+
+/*
+ * Get a sni of a ClientHello. Only a sni extension is parsed: other
+ * fields and extensions are jumped over. If a record is split across
+ * segments and a sni isn't in the first one, segments are buffered in
+ * a flow of the reassembly table until a sni is got. A full structure
+ * of a record is parsed only to dump it in a debug mode.
+ * pkt_prev - a tcp packet
+ * data - a segment payload
+ * size - a payload size
+ *
+ * return:
+ *   0 - everything is ok
+ *   1 - a payload isn't a ClientHello or a record is truncated(and
+ *       a reassembly is off)
+ *  <0 - an error occured
+ */
+static int
+_parse_client_hello(struct pkt *pkt_prev, unsigned char *data, int size)
+{
+	struct pkt_tcp *pkt_tcp;
+	struct pkt_tls *pkt;
+	struct reasm_flow *f;
+	struct reasm_state st;
+	unsigned char *buf;
+	unsigned int len, name_len;
+	char *name;
+	int ret;
+	
+	pkt_tcp = (struct pkt_tcp*)pkt_prev;
+	f = pkt_tcp->reasm;
+	if (f) {
+		ret = reasm_flow_append(f, pkt_tcp->seq, data, size);
+		if (ret == 1) {
+			/* a retransmission of buffered data */
+			if ((size > 0) &&
+			  (reasm_flow_hold(f, get_pkt_id(pkt_prev)) == 0))
+				pkt_hold(pkt_prev);
+			return 0;
+		} else if (ret == 2) {
+			/* a ClientHello is too big or a segment is lost - held
+			 * packets get a verdict of this one */
+			ret = pkt_held_set(pkt_prev, f->held, f->held_cnt);
+			reasm_flow_del(f, ret < 0);
+			return ret;
+		}
+		buf = f->buf;
+		len = f->len;
+		st = f->state;
+	} else {
+		buf = data;
+		len = size;
+		memset(&st, 0, sizeof(st));
+	}
+	
+	ret = _scan_client_hello(&st, buf, len, &name, &name_len);
+	if (ret == 1) {
+		/* wait for next segments */
+		if (!f) {
+			f = reasm_flow_add(pkt_prev, &pkt_hdlrs_tls);
+			if ((f) && (reasm_flow_append(f, pkt_tcp->seq, data, size))) {
+				reasm_flow_del(f, 0);
+				f = NULL;
+			}
+		}
+		if (!f)
+			return 1;
+		f->state = st;
+		if (reasm_flow_hold(f, get_pkt_id(pkt_prev)) == 0)
+			pkt_hold(pkt_prev);
+		return 0;
+	}
+	if ((f) && (pkt_held_set(pkt_prev, f->held, f->held_cnt) < 0)) {
+		reasm_flow_del(f, 1);
 		return -1;
-	memset(pkt, 0, sizeof(*pkt));
+	}
+	if ((ret != 0) && (f))
+		reasm_flow_del(f, 0);
+	if (ret == 3)
+		return 1;
+	
+	pkt = pkt_alloc(sizeof(*pkt));
+	if (!pkt)
+		goto err_del_flow;
 	list_item_head_init(&pkt->list);
 	list_add(&pkt->list, &pkt_prev->list);
 	
 	pkt->pkt_type = pkt_type_tls;
 	pkt->pkt_len = size;
 	pkt->pkt_raw = data;
-	
-	pkt->type = tlsh->type;
-	pkt->version_major = tlsh->version_major;
-	pkt->version_minor = tlsh->version_minor;
-	pkt->length = len;
-	
-	size -= sizeof(*tlsh);
-	data += sizeof(*tlsh);
-	while ((ret = _add_msg(pkt, &data, &size)) == 0) {
-		if (pkt->msgs->type == 1) {
-			if (pkt->msgs->clientHello.exts) {
-				list_for_each(lh, &pkt->msgs->clientHello.exts->list) {
-					ext = list_item(lh, struct tls_ext, list);
-					if (ext->type == 0) {
-						list_for_each(lh1, &ext->sni.names->list) {
-							sni = list_item(lh1, struct tls_ext_sni_name,
-							  list);
-							if (sni->type == 0) {
-								normalize_domain_name(sni->hostname.name);
-								ret = pkt_domain_add(pkt_prev,
-								  sni->hostname.name,
-								  strlen(sni->hostname.name));
-								if (ret < 0)
-									goto err_free_pkt;
-							}
-						}
-					}
-				}
-			}
-		}
+	pkt->type = buf[0];
+	pkt->version_major = buf[1];
+	pkt->version_minor = buf[2];
+	pkt->length = (buf[3] << 8) | buf[4];
+	if (ret == 2)
+		return 0;
+	pkt->sni = name;
+	pkt->sni_len = name_len;
+	/* a sni points to a flow buffer - a flow is deleted in free_pkt() */
+	pkt->reasm = f;
+#ifdef DEBUG
+	if ((opts.is_debug) && (!f) && ((pkt->length + 5) == size))
+		_add_msgs(pkt, data + 5, size - 5);
+#endif
+	if (pkt_domain_add(pkt_prev, name, name_len) < 0) {
+		list_rm(&pkt->list);
+		goto err_del_flow;
 	}
-	if (ret != 1)
-		goto err_free_pkt;
 	
 	return 0;
-
-err_free_pkt:
-	list_rm(&pkt->list);
-	free_pkt((struct pkt*)pkt);
-	return ret;
+	
+err_del_flow:
+	if (f)
+		reasm_flow_del(f, 0);
+	return -1;
 }
 
-static void
-_free_pkt_msg_ext_sni_names_cb(struct list_item_head *lh)
+/*
+ * Scan a ClientHello record till a sni extension(see tls_sni_scan()).
+ * st - a scan state(zeroed for a new record)
+ * buf - a record start
+ * len - a data length
+ * name - a pointer to place a server name(a view into buf)
+ * name_len - a pointer to place a server name length
+ *
+ * return:
+ *   0 - a sni is found
+ *   1 - a record is truncated
+ *   2 - there is no sni
+ *   3 - a record isn't a ClientHello or is wrong
+ */
+static int
+_scan_client_hello(struct reasm_state *st, unsigned char *buf,
+  unsigned int len, char **name, unsigned int *name_len)
 {
-	struct tls_ext_sni_name *name;
+	/* a record header */
+	if (len < 5)
+		return 1;
+	if ((buf[0] != 22) || (buf[1] != 3) || (buf[2] < 1))
+		return 3;
 	
-	name = list_item(lh, struct tls_ext_sni_name, list);
-	switch (name->type) {
-	case 0:
-		free(name->hostname.name);
-		break;
-	default:
-		break;
-	}
-	free(name);
+	/* a ClientHello in several records isn't supported */
+	return tls_sni_scan(st, buf + 5, len - 5, (buf[3] << 8) | buf[4], name,
+	  name_len);
 }
 
-static void
-_free_pkt_msg_ext_cb(struct list_item_head *lh)
+/*
+ * Scan a ClientHello handshake message till a sni extension. A scan is
+ * resumed from a state, so a data can be scanned by parts as it's
+ * appended: fixed fields are checked until all of them are got, then
+ * extensions are jumped over(their data can be still absent) till a sni
+ * one.
+ * st - a scan state(zeroed for a new message)
+ * buf - a message start(a handshake header)
+ * len - a data length
+ * max - max message length(e.g. a record length)
+ * name - a pointer to place a server name(a view into buf)
+ * name_len - a pointer to place a server name length
+ *
+ * return:
+ *   0 - a sni is found
+ *   1 - a message is truncated
+ *   2 - there is no sni
+ *   3 - a message isn't a ClientHello or is wrong
+ */
+int
+tls_sni_scan(struct reasm_state *st, unsigned char *buf, unsigned int len,
+  unsigned int max, char **name, unsigned int *name_len)
 {
-	struct tls_ext *ext;
+	unsigned int off, hs_end, ext_type, ext_end, l;
 	
-	ext = list_item(lh, struct tls_ext, list);
-	switch (ext->type) {
-	case 0:
-		if (ext->sni.names)
-			list_free(&ext->sni.names->list, _free_pkt_msg_ext_sni_names_cb);
-		break;
-	default:
-		break;
+	/* a handshake header */
+	if (len < 4)
+		return 1;
+	if (buf[0] != 1)
+		return 3;
+	hs_end = 4 + ((buf[1] << 16) | (buf[2] << 8) | buf[3]);
+	if (hs_end > max)
+		return 3;
+	
+	if (!st->tls.ext_off) {
+		/* version, random, session id, cipher suites, compression
+		 * methods */
+		off = 4 + 34;
+		if (len < (off + 1))
+			return 1;
+		off += 1 + buf[off];
+		if (len < (off + 2))
+			return 1;
+		off += 2 + ((buf[off] << 8) | buf[off + 1]);
+		if (len < (off + 1))
+			return 1;
+		off += 1 + buf[off];
+		if (off + 2 > hs_end)
+			return 2;
+		if (len < (off + 2))
+			return 1;
+		st->tls.exts_end = off + 2 + ((buf[off] << 8) | buf[off + 1]);
+		if (st->tls.exts_end > hs_end)
+			return 3;
+		st->tls.ext_off = off + 2;
 	}
-	free(ext);
-}
-
-static void
-_free_pkt_msg_cb(struct list_item_head *lh)
-{
-	struct tls_msg *msg;
 	
-	msg = list_item(lh, struct tls_msg, list);
-	switch (msg->type) {
-	case 1:
-		free(msg->clientHello.sess_id);
-		free(msg->clientHello.cipher_suites);
-		free(msg->clientHello.comp_methods);
-		if (msg->clientHello.exts)
-			list_free(&msg->clientHello.exts->list, _free_pkt_msg_ext_cb);
-		break;
-	default:
-		break;
+	for(off = st->tls.ext_off; off + 4 <= st->tls.exts_end; off = ext_end) {
+		if (len < (off + 4)) {
+			st->tls.ext_off = off;
+			return 1;
+		}
+		ext_type = (buf[off] << 8) | buf[off + 1];
+		ext_end = off + 4 + ((buf[off + 2] << 8) | buf[off + 3]);
+		if (ext_end > st->tls.exts_end)
+			return 3;
+		if (ext_type != 0)
+			continue;
+		if (len < ext_end) {
+			st->tls.ext_off = off;
+			return 1;
+		}
+		/* a server names list: a type(1 byte), a length(2 bytes), a name;
+		 * only a host name(type 0) is defined */
+		for(off += 6; off + 3 <= ext_end; off += 3 + l) {
+			l = (buf[off + 1] << 8) | buf[off + 2];
+			if (off + 3 + l > ext_end)
+				return 3;
+			if (buf[off] == 0) {
+				*name = (char*)buf + off + 3;
+				*name_len = l;
+				return 0;
+			}
+		}
+		return 2;
 	}
-	free(msg);
+	
+	return 2;
 }
 
 static int
@@ -188,16 +333,23 @@ free_pkt(struct pkt *pkt)
 {
 	struct pkt_tls *pkt_tls;
 	
-	if (pkt->pkt_type != pkt_type_tls)
-		return -2;
 	pkt_tls = (struct pkt_tls*)pkt;
-	list_free(&pkt_tls->msgs->list, _free_pkt_msg_cb);
-	free(pkt_tls);
+	if (pkt_tls->reasm)
+		reasm_flow_del(pkt_tls->reasm, 0);
 	return 0;
 }
 
 static int _dump_pkt_msg_clientHello(uint32_t id,struct tls_msg *msg);
 
+/*
+ * Check if a payload starts with a handshake record header of TLS.
+ */
+static int
+probe_pkt(unsigned char *data, int size)
+{
+	return (size >= 5) && (data[0] == 22) && (data[1] == 3);
+}
+
 static int
 dump_pkt(struct pkt *pkt)
 {
@@ -248,6 +400,9 @@ _dump_pkt(int outlvl, struct pkt *pkt)
 	  "(size - %u)",
 	  id, pkt_tls->type, str, pkt_tls->version_major, pkt_tls->version_minor,
 	  pkt_tls->length, pkt_tls->pkt_len);
+	if (pkt_tls->sni)
+		ANY_OUT(outlvl, "%u: tls: sni=%.*s", id, pkt_tls->sni_len,
+		  pkt_tls->sni);
 	list_for_each(lh, &pkt_tls->msgs->list) {
 		msg = list_item(lh, struct tls_msg, list);
 		switch (msg->type) {
@@ -307,7 +462,7 @@ _dump_pkt_msg_clientHello(uint32_t id, struct tls_msg *msg)
 	struct tls_ext *ext;
 	struct tls_ext_sni_name *name;
 	char *str;
-
+	
 	DBG_OUT("%u: tls: msg_type=%hhu: ver=%hhu.%hhu", id, msg->type,
 	  msg->clientHello.version_major, msg->clientHello.version_minor);
 	if (msg->clientHello.exts)
@@ -416,8 +571,8 @@ _dump_pkt_msg_clientHello(uint32_t id, struct tls_msg *msg)
 					switch (name->type) {
 					case 0:
 						DBG_OUT("%u: tls: msg_type=%hhu: ext_type=%hu: "
-						  "hostname=%s", id, msg->type, ext->type,
-						  name->hostname.name);
+						  "hostname=%.*s", id, msg->type, ext->type,
+						  name->hostname.len, name->hostname.name);
 						break;
 					default:
 						break;
@@ -434,15 +589,38 @@ _dump_pkt_msg_clientHello(uint32_t id, struct tls_msg *msg)
 struct pkt_hdlrs pkt_hdlrs_tls = {
 	"tls",
 	0,
+	PKT_ATTR_SNI,
 	init,
 	parse_pkt,
 	free_pkt,
 	dump_pkt,
-	errout_pkt
+	errout_pkt,
+	probe_pkt
 };
 
+#ifdef DEBUG
+/*
+ * A full structure parsing is needed only for a debug dump.
+ */
 static int _add_msg_clientHello(struct tls_msg *msg, unsigned char *data, int size);
 
+/*
+ * Parse all messages of a record to dump them.
+ * pkt - a tls packet
+ * data - a record data(after a header)
+ * size - a data size
+ */
+static void
+_add_msgs(struct pkt_tls *pkt, unsigned char *data, int size)
+{
+	int ret;
+	
+	while ((ret = _add_msg(pkt, &data, &size)) == 0);
+	if (ret != 1)
+		DBG_OUT("%u: tls: record parse error %d", get_pkt_id((struct pkt*)pkt),
+		  ret);
+}
+
 static int
 _add_msg(struct pkt_tls *pkt, unsigned char **data, int *size)
 {
@@ -459,15 +637,14 @@ _add_msg(struct pkt_tls *pkt, unsigned char **data, int *size)
 	if (*size < (len + sizeof(*tlsmsgh)))
 		return -3;
 	
-	tlsmsg = malloc(sizeof(*tlsmsg));
+	tlsmsg = pkt_alloc(sizeof(*tlsmsg));
 	if (!tlsmsg)
 		return -1;
-	memset(tlsmsg, 0, sizeof(*tlsmsg));
 	list_item_head_init(&tlsmsg->list);
 	if (pkt->msgs)
 		list_add_before(&tlsmsg->list, &pkt->msgs->list);
 	pkt->msgs = tlsmsg;
-
+	
 	tlsmsg->type = tlsmsgh->type;
 	tlsmsg->length = len;
 	
@@ -479,10 +656,10 @@ _add_msg(struct pkt_tls *pkt, unsigned char **data, int *size)
 		ret = 0;
 		break;
 	}
-
+	
 	*size -= len + sizeof(*tlsmsgh);
 	*data += len + sizeof(*tlsmsgh);
-
+	
 	return ret;
 }
 
@@ -547,10 +724,9 @@ _add_msg_clientHello_ext(struct tls_msg *msg, unsigned char **data, int *size)
 	if (*size == 0)
 		return 1;
 	
-	ext = malloc(sizeof(*ext));
+	ext = pkt_alloc(sizeof(*ext));
 	if (!ext)
 		return -1;
-	memset(ext, 0, sizeof(*ext));
 	list_item_head_init(&ext->list);
 	if (msg->clientHello.exts)
 		list_add_before(&ext->list, &msg->clientHello.exts->list);
@@ -578,10 +754,10 @@ _add_msg_clientHello_ext(struct tls_msg *msg, unsigned char **data, int *size)
 		ret = 0;
 		break;
 	}
-
+	
 	*size -= len;
 	*data += len;
-
+	
 	return ret;
 }
 
@@ -605,7 +781,7 @@ _add_msg_clientHello_ext_sni(struct tls_ext *ext, unsigned char *data,
 	while ((ret = _add_msg_clientHello_ext_sni_name(ext, &data, &size)) == 0);
 	if (ret != 1)
 		return ret;
-
+	
 	return 0;
 }
 
@@ -621,15 +797,14 @@ _add_msg_clientHello_ext_sni_name(struct tls_ext *ext, unsigned char **data,
 	
 	if (*size < 3)
 		return 2;
-	name = malloc(sizeof(*name));
+	name = pkt_alloc(sizeof(*name));
 	if (!name)
 		return -1;
-	memset(name, 0, sizeof(*name));
 	list_item_head_init(&name->list);
 	if (ext->sni.names)
 		list_add_before(&name->list, &ext->sni.names->list);
 	ext->sni.names = name;
-
+	
 	name->type = **data;
 	*data += 1;
 	*size -= 1;
@@ -641,9 +816,8 @@ _add_msg_clientHello_ext_sni_name(struct tls_ext *ext, unsigned char **data,
 			return 2;
 		*data += 2;
 		*size -= 2;
-		name->hostname.name = strndup((char*)*data, len);
-		if (!name->hostname.name)
-			return -1;
+		name->hostname.name = (char*)*data;
+		name->hostname.len = len;
 		*data += len;
 		*size -= len;
 		break;
@@ -653,3 +827,4 @@ _add_msg_clientHello_ext_sni_name(struct tls_ext *ext, unsigned char **data,
 	
 	return 0;
 }
+#endif /* DEBUG */
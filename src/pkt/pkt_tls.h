@@ -3,12 +3,17 @@
 
 #include "list.h"
 
+struct reasm_flow;
+struct reasm_state;
+
 struct tls_ext_sni_name {
 	struct list_item_head list;
 	uint8_t type;
 	union {
 		struct {
+			/* a view into a packet payload(not null terminated) */
 			char *name;
+			uint16_t len;
 		} hostname;
 	};
 };
@@ -50,7 +55,33 @@ struct pkt_tls {
 	uint8_t version_major;
 	uint8_t version_minor;
 	uint16_t length;
+	/* messages are parsed only in a debug mode(see _add_msgs()) */
 	struct tls_msg *msgs;
+	/* a server name of a ClientHello(a view into a payload or into
+	 * a flow buffer, see reasm.h) */
+	char *sni;
+	unsigned int sni_len;
+	struct reasm_flow *reasm;
 };
 
+
+/*
+ * Scan a ClientHello handshake message till a sni extension. A scan is
+ * resumed from a state, so a data can be scanned by parts as it's
+ * appended.
+ * st - a scan state(zeroed for a new message)
+ * buf - a message start(a handshake header)
+ * len - a data length
+ * max - max message length(e.g. a record length)
+ * name - a pointer to place a server name(a view into buf)
+ * name_len - a pointer to place a server name length
+ *
+ * return:
+ *   0 - a sni is found
+ *   1 - a message is truncated
+ *   2 - there is no sni
+ *   3 - a message isn't a ClientHello or is wrong
+ */
+int tls_sni_scan(struct reasm_state *st, unsigned char *buf, unsigned int len, unsigned int max, char **name, unsigned int *name_len);
+
 #endif  /* __PKT_TLS_H__ */
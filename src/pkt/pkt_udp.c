@@ -4,13 +4,17 @@
 #include <stdint.h>
 #include "log.h"
 #include "pkt.h"
+#include "arena.h"
 #include "pkt_udp.h"
 #include "pkts_hdlrs.h"
 
 
 /* List of payload packets that we can process */
-static struct pkt_hdlrs *ppkts[2];
-static char *ppkts_names[2] = {"dns", NULL};
+static struct pkt_hdlrs *ppkts[3];
+static char *ppkts_names[3] = {"dns", "quic", NULL};
+/* Payload packets ports hints(checked before signatures) */
+static struct pkt_port_hint ports_hints[] = {{53, "dns", NULL},
+  {443, "quic", NULL}, {0, NULL, NULL}};
 
 
 static int _dump_pkt(int outlvl, struct pkt *pkt);
@@ -27,6 +31,7 @@ init(void)
 				ppkts[k++] = pkts_list[j];
 				break;
 			}
+	pkt_port_hints_init(ports_hints);
 	return 0;
 }
 
@@ -36,16 +41,16 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 	struct udphdr *udph;
 	struct pkt_udp *pkt;
 	uint16_t len;
-	int i, ret;
+	struct pkt_hdlrs *hdlrs;
+	int ret;
 	
 	udph = (struct udphdr*)data;
 	len = be16toh(udph->len);
 	if (len != size)
 		return 1;
-	pkt = malloc(sizeof(*pkt));
+	pkt = pkt_alloc(sizeof(*pkt));
 	if (!pkt)
 		return -1;
-	memset(pkt, 0, sizeof(*pkt));
 	list_item_head_init(&pkt->list);
 	list_add(&pkt->list, &pkt_prev->list);
 
@@ -55,35 +60,20 @@ parse_pkt(struct pkt *pkt_prev, unsigned char *data, int size)
 	pkt->sport = be16toh(udph->source);
 	pkt->dport = be16toh(udph->dest);
 
-	for(i = 0; ppkts[i]; i++) {
-		if (!ppkts[i]->parse_pkt)
-			continue;
-		ret = ppkts[i]->parse_pkt((struct pkt*)pkt, data + 8, size - 8);
-		if (ret < 0) {
-			ERR_OUT("parse_pkt error: %s: %d", ppkts[i]->name, ret);
-			list_rm(&pkt->list);
-			free(pkt);
-			return ret;
-		} else if (ret == 0) {
-			break;
-		}
+	hdlrs = pkt_payload_classify((struct pkt*)pkt, ppkts, ports_hints,
+	  pkt->sport, pkt->dport, data + 8, size - 8);
+	if (!hdlrs)
+		return 0;
+	ret = hdlrs->parse_pkt((struct pkt*)pkt, data + 8, size - 8);
+	if (ret < 0) {
+		ERR_OUT("parse_pkt error: %s: %d", hdlrs->name, ret);
+		list_rm(&pkt->list);
+		return ret;
 	}
 	
 	return 0;
 }
 
-static int
-free_pkt(struct pkt *pkt)
-{
-	struct pkt_udp *pkt_udp;
-	
-	if (pkt->pkt_type != pkt_type_udp)
-		return -2;
-	pkt_udp = (struct pkt_udp*)pkt;
-	free(pkt_udp);
-	return 0;
-}
-
 static int
 dump_pkt(struct pkt *pkt)
 {
@@ -115,10 +105,12 @@ _dump_pkt(int outlvl, struct pkt *pkt)
 struct pkt_hdlrs pkt_hdlrs_udp = {
 	"udp",
 	0,
+	PKT_ATTR_PORT | PKT_ATTR_QNAME | PKT_ATTR_ANSWER | PKT_ATTR_SNI,
 	init,
 	parse_pkt,
-	free_pkt,
+	NULL,
 	dump_pkt,
-	errout_pkt
+	errout_pkt,
+	NULL
 };
 
@@ -1,23 +1,47 @@
 #ifndef __PKTS_HDLRS_H__
 #define __PKTS_HDLRS_H__
 
+#include <stdint.h>
 #include "pkt.h"
 #include "pkts_types.h"
 
 /*
  * init and parse_pkt error codes:
  * -1  - no mem
+ *
+ * Packet structures must be allocated with pkt_alloc()(see arena.h).
+ * free_pkt is needed only to release other resources and can be NULL.
+ * attrs are PKT_ATTR_* a handler(with its payload handlers) yields; a
+ * parent handler skips parse_pkt call if none of them is needed.
+ * probe_pkt is a cheap check of first payload bytes: return 1 if a payload
+ * looks like a handler protocol and 0 otherwise. If it's NULL, any payload
+ * is considered as a handler one.
  */
 struct pkt_hdlrs {
 	char *name;
 	enum pkt_type type;
+	unsigned int attrs;
 	int (*init)(void);
 	int (*parse_pkt)(struct pkt *pkt_prev, unsigned char *data, int size);
 	int (*free_pkt)(struct pkt *pkt);
 	int (*dump_pkt)(struct pkt *pkt);
 	int (*errout_pkt)(struct pkt *pkt);
+	int (*probe_pkt)(unsigned char *data, int size);
+};
+
+/*
+ * A well known port of a payload protocol. hdlrs is set on a transport
+ * handler init by pkt_port_hints_init().
+ */
+struct pkt_port_hint {
+	uint16_t port;
+	char *name;
+	struct pkt_hdlrs *hdlrs;
 };
 
 extern struct pkt_hdlrs *pkts_list[];
 
+void pkt_port_hints_init(struct pkt_port_hint *hints);
+struct pkt_hdlrs* pkt_payload_classify(struct pkt *pkt, struct pkt_hdlrs **hdlrs, struct pkt_port_hint *hints, uint16_t sport, uint16_t dport, unsigned char *data, int size);
+
 #endif /* __PKTS_HDLRS_H__ */
\ No newline at end of file
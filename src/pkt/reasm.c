@@ -0,0 +1,412 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "log.h"
+#include "pkt.h"
+#include "pkt_ip.h"
+#include "pkt_ip6.h"
+#include "pkt_tcp.h"
+#include "reasm.h"
+#include "pkts_hdlrs.h"
+
+
+struct reasm_table {
+	struct reasm_flow *f;
+	unsigned char *bufs;
+	unsigned int mask;
+	/* a next slot to check by a sweep */
+	unsigned int sweep_idx;
+	/* ids of held packets of expired and evicted flows */
+	uint32_t released[REASM_RELEASED_MAX];
+	unsigned int released_cnt;
+};
+
+
+static unsigned int reasm_size;
+static unsigned int reasm_bytes;
+static unsigned int reasm_timeout;
+static int reasm_is_hold;
+
+static __thread struct reasm_table *rtable;
+
+
+/*
+ * Set reassembly parameters. Must be called before packets processing.
+ * size - max number of flows in a table of each thread(0 - no reassembly)
+ * bytes - max number of buffered bytes of a flow
+ * timeout - max flow lifetime in seconds
+ * is_hold - hold verdicts of buffered segments
+ */
+void
+reasm_set(unsigned int size, unsigned int bytes, unsigned int timeout,
+  int is_hold)
+{
+	reasm_size = size;
+	reasm_bytes = bytes;
+	reasm_timeout = timeout;
+	reasm_is_hold = is_hold;
+}
+
+/*
+ * Get a table of the current thread. It's allocated on the first call:
+ * all flows buffers are allocated at once, so a memory usage is bounded.
+ *
+ * return:
+ *   table - a pointer to a table
+ *   NULL - a reassembly is off or a memory error occured
+ */
+static struct reasm_table*
+_reasm_table_get(void)
+{
+	struct reasm_table *t;
+	unsigned int size, i;
+	
+	if ((rtable) || (!reasm_size))
+		return rtable;
+	
+	/* round up to a power of 2 */
+	for(size = 1; size < reasm_size; size <<= 1);
+	t = malloc(sizeof(*t));
+	if (!t)
+		goto err;
+	memset(t, 0, sizeof(*t));
+	t->f = calloc(size, sizeof(*t->f));
+	if (!t->f)
+		goto err_free_t;
+	t->bufs = malloc((size_t)size * reasm_bytes);
+	if (!t->bufs)
+		goto err_free_f;
+	for(i = 0; i < size; i++)
+		t->f[i].buf = t->bufs + (size_t)i * reasm_bytes;
+	t->mask = size - 1;
+	rtable = t;
+	
+	return t;
+	
+err_free_f:
+	free(t->f);
+err_free_t:
+	free(t);
+err:
+	ERR_OUT("reassembly table allocating error: no memory");
+	/* work without a reassembly */
+	reasm_size = 0;
+	return NULL;
+}
+
+static uint32_t
+_reasm_now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	
+	return ts.tv_sec;
+}
+
+static uint32_t
+_reasm_hash(uint8_t *saddr, uint8_t *daddr, uint16_t sport, uint16_t dport)
+{
+	uint32_t h, s = 0, d = 0, w;
+	unsigned int i;
+	
+	for(i = 0; i < 16; i += 4) {
+		memcpy(&w, saddr + i, 4);
+		s ^= w;
+		memcpy(&w, daddr + i, 4);
+		d ^= w;
+	}
+	h = s ^ (d * 0x9e3779b1) ^ ((sport << 16) | dport);
+	/* murmur3 finalizer */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	
+	return h;
+}
+
+static void
+_reasm_addr4_set(uint8_t *addr, uint32_t addr4)
+{
+	memset(addr, 0, 10);
+	addr[10] = 0xff;
+	addr[11] = 0xff;
+	addr[12] = addr4 >> 24;
+	addr[13] = addr4 >> 16;
+	addr[14] = addr4 >> 8;
+	addr[15] = addr4;
+}
+
+/*
+ * Get addresses and ports of a tcp packet.
+ *
+ * return:
+ *   0 - everything is ok
+ *   1 - a packet isn't a tcp over ipv4/ipv6 one
+ */
+static int
+_reasm_key_get(struct pkt *pkt, uint8_t *saddr, uint8_t *daddr,
+  uint16_t *sport, uint16_t *dport)
+{
+	struct pkt *pkt_l3;
+	struct pkt_tcp *pkt_tcp;
+	
+	if ((pkt->pkt_type != pkt_type_tcp) || (!pkt->list.prev))
+		return 1;
+	pkt_tcp = (struct pkt_tcp*)pkt;
+	pkt_l3 = list_item(pkt->list.prev, struct pkt, list);
+	if (pkt_l3->pkt_type == pkt_type_ip) {
+		_reasm_addr4_set(saddr, ((struct pkt_ip*)pkt_l3)->saddr);
+		_reasm_addr4_set(daddr, ((struct pkt_ip*)pkt_l3)->daddr);
+	} else if (pkt_l3->pkt_type == pkt_type_ip6) {
+		memcpy(saddr, ((struct pkt_ip6*)pkt_l3)->saddr, 16);
+		memcpy(daddr, ((struct pkt_ip6*)pkt_l3)->daddr, 16);
+	} else {
+		return 1;
+	}
+	*sport = pkt_tcp->sport;
+	*dport = pkt_tcp->dport;
+	
+	return 0;
+}
+
+static int
+_reasm_is_expired(struct reasm_flow *f, uint32_t now)
+{
+	return (now - f->ts) >= reasm_timeout;
+}
+
+/*
+ * Find a flow of a tcp packet. An expired flow is deleted.
+ * pkt - a tcp packet
+ *
+ * return:
+ *   flow - a pointer to a found flow
+ *   NULL - a flow isn't found
+ */
+struct reasm_flow*
+reasm_flow_get(struct pkt *pkt)
+{
+	struct reasm_table *t;
+	struct reasm_flow *f;
+	uint8_t saddr[16], daddr[16];
+	uint32_t idx;
+	uint16_t sport, dport;
+	unsigned int i;
+	
+	t = _reasm_table_get();
+	if (!t)
+		return NULL;
+	if (_reasm_key_get(pkt, saddr, daddr, &sport, &dport) != 0)
+		return NULL;
+	idx = _reasm_hash(saddr, daddr, sport, dport);
+	for(i = 0; i < REASM_PROBES; i++) {
+		f = &t->f[(idx + i) & t->mask];
+		if ((!f->is_used) || (f->sport != sport) || (f->dport != dport) ||
+		  (memcmp(f->saddr, saddr, 16) != 0) ||
+		  (memcmp(f->daddr, daddr, 16) != 0))
+			continue;
+		if (_reasm_is_expired(f, _reasm_now())) {
+			reasm_flow_del(f, 1);
+			return NULL;
+		}
+		return f;
+	}
+	
+	return NULL;
+}
+
+/*
+ * Add a flow of a tcp packet. A free or expired slot is taken; if there
+ * is no one, the oldest flow in a probe window is evicted. The packet
+ * payload isn't added.
+ * pkt - a tcp packet
+ * hdlrs - a payload handler
+ *
+ * return:
+ *   flow - a pointer to an added flow
+ *   NULL - a reassembly is off
+ */
+struct reasm_flow*
+reasm_flow_add(struct pkt *pkt, struct pkt_hdlrs *hdlrs)
+{
+	struct reasm_table *t;
+	struct reasm_flow *f, *victim = NULL;
+	uint8_t saddr[16], daddr[16];
+	uint32_t idx, now;
+	uint16_t sport, dport;
+	unsigned int i;
+	
+	t = _reasm_table_get();
+	if (!t)
+		return NULL;
+	if (_reasm_key_get(pkt, saddr, daddr, &sport, &dport) != 0)
+		return NULL;
+	now = _reasm_now();
+	idx = _reasm_hash(saddr, daddr, sport, dport);
+	for(i = 0; i < REASM_PROBES; i++) {
+		f = &t->f[(idx + i) & t->mask];
+		if ((!f->is_used) || (_reasm_is_expired(f, now))) {
+			victim = f;
+			break;
+		}
+		if ((!victim) || ((int32_t)(f->ts - victim->ts) < 0))
+			victim = f;
+	}
+	if (victim->is_used)
+		reasm_flow_del(victim, 1);
+	
+	f = victim;
+	memcpy(f->saddr, saddr, 16);
+	memcpy(f->daddr, daddr, 16);
+	f->sport = sport;
+	f->dport = dport;
+	f->is_used = 1;
+	f->ts = now;
+	f->seq_next = ((struct pkt_tcp*)pkt)->seq;
+	f->hdlrs = hdlrs;
+	memset(&f->state, 0, sizeof(f->state));
+	f->held_cnt = 0;
+	f->len = 0;
+	
+	return f;
+}
+
+/*
+ * Append a segment payload to a flow buffer. A retransmitted data is
+ * skipped.
+ * f - a flow
+ * seq - a segment sequence number
+ * data - a segment payload
+ * size - a payload size
+ *
+ * return:
+ *   0 - a new data is appended
+ *   1 - a segment has no new data
+ *   2 - a segment is out of order or a buffer is full
+ */
+int
+reasm_flow_append(struct reasm_flow *f, uint32_t seq, unsigned char *data,
+  int size)
+{
+	uint32_t skip;
+	unsigned int len;
+	
+	skip = f->seq_next - seq;
+	if ((int32_t)skip < 0)
+		return 2;
+	if (skip >= size)
+		return 1;
+	len = size - skip;
+	if (len > (reasm_bytes - f->len))
+		return 2;
+	memcpy(f->buf + f->len, data + skip, len);
+	f->len += len;
+	f->seq_next += len;
+	
+	return 0;
+}
+
+/*
+ * Hold a verdict of a packet until the flow is finished.
+ * f - a flow
+ * id - a packet id
+ *
+ * return:
+ *   0 - a verdict is held
+ *   1 - a hold policy is off or too many packets are held
+ */
+int
+reasm_flow_hold(struct reasm_flow *f, uint32_t id)
+{
+	if ((!reasm_is_hold) || (f->held_cnt == REASM_HELD_MAX))
+		return 1;
+	f->held[f->held_cnt++] = id;
+	
+	return 0;
+}
+
+/*
+ * Delete a flow.
+ * f - a flow
+ * is_release - pass held packets ids to reasm_released_get(); otherwise,
+ *              a caller sets their verdicts
+ */
+void
+reasm_flow_del(struct reasm_flow *f, int is_release)
+{
+	unsigned int i;
+	
+	if ((is_release) && (rtable)) {
+		for(i = 0; i < f->held_cnt; i++) {
+			if (rtable->released_cnt == REASM_RELEASED_MAX) {
+				ERR_OUT("reassembly: too many released packets - "
+				  "%u packets are left in a queue", f->held_cnt - i);
+				break;
+			}
+			rtable->released[rtable->released_cnt++] = f->held[i];
+		}
+	}
+	f->is_used = 0;
+	f->held_cnt = 0;
+}
+
+/*
+ * Delete expired flows of the table. Held packets of a flow are released.
+ * A sweep stops when there is no room for released ids; it's continued
+ * from the same slot by a next call(after reasm_released_get()).
+ *
+ * return:
+ *   0 - all slots are checked
+ *   1 - a sweep isn't finished
+ */
+int
+reasm_sweep(void)
+{
+	struct reasm_flow *f;
+	uint32_t now;
+	
+	if (!rtable)
+		return 0;
+	now = _reasm_now();
+	for(; rtable->sweep_idx <= rtable->mask; rtable->sweep_idx++) {
+		if (REASM_RELEASED_MAX - rtable->released_cnt < REASM_HELD_MAX)
+			return 1;
+		f = &rtable->f[rtable->sweep_idx];
+		if ((f->is_used) && (_reasm_is_expired(f, now)))
+			reasm_flow_del(f, 1);
+	}
+	rtable->sweep_idx = 0;
+	
+	return 0;
+}
+
+/*
+ * Get ids of held packets of deleted flows(expired or evicted), which must
+ * be accepted. Got ids are removed from the table.
+ * ids - an array to place ids to
+ * n - an array size
+ *
+ * return:
+ *   a number of placed ids
+ */
+unsigned int
+reasm_released_get(uint32_t *ids, unsigned int n)
+{
+	unsigned int cnt;
+	
+	if ((!rtable) || (!rtable->released_cnt))
+		return 0;
+	cnt = rtable->released_cnt;
+	if (cnt > n)
+		cnt = n;
+	memcpy(ids, rtable->released, sizeof(*ids) * cnt);
+	rtable->released_cnt -= cnt;
+	memmove(rtable->released, rtable->released + cnt,
+	  sizeof(*ids) * rtable->released_cnt);
+	
+	return cnt;
+}
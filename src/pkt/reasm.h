@@ -0,0 +1,77 @@
+#ifndef __REASM_H__
+#define __REASM_H__
+
+#include <stdint.h>
+#include "pkt.h"
+
+/*
+ * A per-thread table of client->server tcp streams, which first bytes
+ * are buffered until a payload parser gets needed info(e.g. a http
+ * request headers or a tls ClientHello are split across segments).
+ * Packets of a flow must be processed by one thread.
+ * Verdicts of buffered segments are either set at once(accept policy) or
+ * held until the flow is finished(hold policy).
+ */
+#define REASM_HELD_MAX 8
+#define REASM_PROBES 8
+/* max number of ids released at once(by a packet processing - an expired
+ * flow and an evicted one; by a sweep) */
+#define REASM_RELEASED_MAX (REASM_HELD_MAX * 4)
+
+
+/* a state of an incremental payload parser(offsets into a flow buffer) */
+struct reasm_state {
+	union {
+		struct {
+			unsigned int line_off;
+			unsigned int scan_off;
+			unsigned int start_line_end;
+		} http;
+		struct {
+			/* a next extension(0 - fixed fields aren't parsed yet) */
+			unsigned int ext_off;
+			unsigned int exts_end;
+		} tls;
+	};
+};
+
+struct reasm_flow {
+	/* addresses in network byte order(ipv4 ones are ipv4-mapped) */
+	uint8_t saddr[16];
+	uint8_t daddr[16];
+	uint16_t sport;
+	uint16_t dport;
+	uint8_t is_used;
+	/* a creation time in seconds */
+	uint32_t ts;
+	/* a sequence number of a next byte */
+	uint32_t seq_next;
+	/* a payload handler which parses the buffered data */
+	struct pkt_hdlrs *hdlrs;
+	struct reasm_state state;
+	/* ids of packets with held verdicts */
+	uint32_t held[REASM_HELD_MAX];
+	unsigned int held_cnt;
+	unsigned int len;
+	unsigned char *buf;
+};
+
+
+/*
+ * Set reassembly parameters. Must be called before packets processing.
+ * size - max number of flows in a table of each thread(0 - no reassembly)
+ * bytes - max number of buffered bytes of a flow
+ * timeout - max flow lifetime in seconds
+ * is_hold - hold verdicts of buffered segments
+ */
+void reasm_set(unsigned int size, unsigned int bytes, unsigned int timeout, int is_hold);
+struct reasm_flow* reasm_flow_get(struct pkt *pkt);
+struct reasm_flow* reasm_flow_add(struct pkt *pkt, struct pkt_hdlrs *hdlrs);
+int reasm_flow_append(struct reasm_flow *f, uint32_t seq, unsigned char *data, int size);
+int reasm_flow_hold(struct reasm_flow *f, uint32_t id);
+void reasm_flow_del(struct reasm_flow *f, int is_release);
+int reasm_sweep(void);
+unsigned int reasm_released_get(uint32_t *ids, unsigned int n);
+
+
+#endif  /* __REASM_H__ */
@@ -0,0 +1,261 @@
+/*
+ * traffic filter
+ * Copyright (C) 2017, Oleg Nemanov <lego12239@yandex.ru>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include "log.h"
+#include "pkt/pkt.h"
+#include "pkt/pkt_ip.h"
+#include "pkt/pkt_ip6.h"
+#include "pkt/pkt_udp.h"
+#include "pkt/pkt_dns.h"
+#include "elist.h"
+#include "sinkhole.h"
+
+
+/* a ttl of an answer record */
+#define SINKHOLE_TTL 60
+/* ip6 and udp headers, a dns header, a question and an answer record */
+#define SINKHOLE_BUF_SIZE (40 + 8 + 12 + PKT_DNS_NAME_MAXSIZE + 2 + 4 + \
+  12 + 16)
+
+
+/* raw sockets of the current thread for ipv4 and ipv6(-1 - not opened,
+ * -2 - an opening error) */
+static __thread int sk[2] = { -1, -1 };
+
+
+static int
+_sinkhole_sock_get(int af)
+{
+	int *s = &sk[af == AF_INET6];
+	
+	if (*s == -1) {
+		/* IPPROTO_RAW implies that ip headers are included */
+		*s = socket(af, SOCK_RAW, IPPROTO_RAW);
+		if (*s < 0) {
+			ERR_OUT("sinkhole: raw socket creating error: %s",
+			  strerror(errno));
+			*s = -2;
+		}
+	}
+	
+	return *s;
+}
+
+static uint32_t
+_sinkhole_csum_add(uint32_t sum, const uint8_t *data, unsigned int len)
+{
+	unsigned int i;
+	
+	for(i = 0; i + 1 < len; i += 2)
+		sum += (data[i] << 8) | data[i + 1];
+	if (len & 1)
+		sum += data[len - 1] << 8;
+	
+	return sum;
+}
+
+static uint16_t
+_sinkhole_csum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	
+	return ~sum & 0xffff;
+}
+
+/*
+ * Make a dns answer to a query.
+ * pkt_dns - a query
+ * elist - a matched elist
+ * dns - a buffer to place an answer
+ *
+ * return:
+ *   >0 - an answer size
+ *   0 - a query is malformed
+ */
+static unsigned int
+_sinkhole_dns_make(struct pkt_dns *pkt_dns, struct elist *elist,
+  unsigned char *dns)
+{
+	unsigned char *q = pkt_dns->pkt_raw, *a;
+	unsigned int qlen;
+	uint16_t qtype, rdlen = 0;
+	uint8_t rcode = 0;
+	
+	/* a query name isn't compressed, so a question is copied as is */
+	qlen = pkt_dns->qentry[0].qname_len + 2 + 4;
+	if (12 + qlen > pkt_dns->pkt_len)
+		return 0;
+	qtype = pkt_dns->qentry[0].qtype;
+	if (!elist->sinkhole_af)
+		rcode = 3;
+	else if ((elist->sinkhole_af == AF_INET) && (qtype == 1))
+		rdlen = 4;
+	else if ((elist->sinkhole_af == AF_INET6) && (qtype == 28))
+		rdlen = 16;
+	
+	/* an id, qr, opcode, aa, rd, ra and rcode */
+	dns[0] = q[0];
+	dns[1] = q[1];
+	dns[2] = 0x80 | (q[2] & 0x79) | 0x04;
+	dns[3] = 0x80 | rcode;
+	*((uint16_t*)(dns + 4)) = htobe16(1);
+	*((uint16_t*)(dns + 6)) = htobe16(rdlen ? 1 : 0);
+	*((uint16_t*)(dns + 8)) = 0;
+	*((uint16_t*)(dns + 10)) = 0;
+	memcpy(dns + 12, q + 12, qlen);
+	if (!rdlen)
+		return 12 + qlen;
+	
+	a = dns + 12 + qlen;
+	/* a pointer to a question name */
+	a[0] = 0xc0;
+	a[1] = 12;
+	*((uint16_t*)(a + 2)) = htobe16(qtype);
+	*((uint16_t*)(a + 4)) = htobe16(1);
+	*((uint32_t*)(a + 6)) = htobe32(SINKHOLE_TTL);
+	*((uint16_t*)(a + 10)) = htobe16(rdlen);
+	memcpy(a + 12, elist->sinkhole_addr, rdlen);
+	
+	return 12 + qlen + 12 + rdlen;
+}
+
+/*
+ * Answer a dns query over udp, which is matched by an elist with
+ * a sinkhole action. An answer is NXDOMAIN or an address of the elist
+ * (if a query type is the address type; otherwise, an answer is empty)
+ * and it's sent with a raw socket of the current thread. A query
+ * itself must be dropped by a caller.
+ * pkt - a parsed packet
+ * elist - a matched elist
+ *
+ * return:
+ *   0 - an answer is sent
+ *   1 - a packet isn't a dns query over udp
+ *  -1 - an error occured
+ */
+int
+sinkhole_answer(struct pkt *pkt, struct elist *elist)
+{
+	unsigned char buf[SINKHOLE_BUF_SIZE];
+	struct pkt *pkt_l3, *p;
+	struct pkt_udp *pkt_udp;
+	struct pkt_dns *pkt_dns;
+	struct udphdr *udph;
+	struct iphdr *iph;
+	struct ip6_hdr *ip6h;
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+	struct sockaddr *sa;
+	socklen_t sa_len;
+	unsigned int hlen, len;
+	uint32_t sum;
+	int s, af;
+	
+	pkt_l3 = get_next_pkt(pkt);
+	if (!pkt_l3)
+		return 1;
+	if (pkt_l3->pkt_type == pkt_type_ip) {
+		af = AF_INET;
+		hlen = sizeof(*iph);
+	} else if (pkt_l3->pkt_type == pkt_type_ip6) {
+		af = AF_INET6;
+		hlen = sizeof(*ip6h);
+	} else {
+		return 1;
+	}
+	p = get_next_pkt(pkt_l3);
+	if ((!p) || (p->pkt_type != pkt_type_udp))
+		return 1;
+	pkt_udp = (struct pkt_udp*)p;
+	p = get_next_pkt(p);
+	if ((!p) || (p->pkt_type != pkt_type_dns))
+		return 1;
+	pkt_dns = (struct pkt_dns*)p;
+	if ((pkt_dns->qr) || (!pkt_dns->qdcount))
+		return 1;
+	
+	len = _sinkhole_dns_make(pkt_dns, elist, buf + hlen + sizeof(*udph));
+	if (!len)
+		return 1;
+	len += sizeof(*udph);
+	
+	/* addresses and ports are swapped */
+	udph = (struct udphdr*)(buf + hlen);
+	udph->source = htobe16(pkt_udp->dport);
+	udph->dest = htobe16(pkt_udp->sport);
+	udph->len = htobe16(len);
+	udph->check = 0;
+	if (af == AF_INET) {
+		iph = (struct iphdr*)buf;
+		memset(iph, 0, sizeof(*iph));
+		iph->version = 4;
+		iph->ihl = 5;
+		iph->tot_len = htobe16(hlen + len);
+		iph->ttl = 64;
+		iph->protocol = IPPROTO_UDP;
+		iph->saddr = htobe32(((struct pkt_ip*)pkt_l3)->daddr);
+		iph->daddr = htobe32(((struct pkt_ip*)pkt_l3)->saddr);
+		iph->check = htobe16(_sinkhole_csum_fold(
+		  _sinkhole_csum_add(0, buf, hlen)));
+		/* a pseudo header: addresses, a protocol and an udp length */
+		sum = _sinkhole_csum_add(0, (uint8_t*)&iph->saddr, 8);
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = iph->daddr;
+		sa = (struct sockaddr*)&sin;
+		sa_len = sizeof(sin);
+	} else {
+		ip6h = (struct ip6_hdr*)buf;
+		memset(ip6h, 0, sizeof(*ip6h));
+		ip6h->ip6_flow = htobe32(0x60000000);
+		ip6h->ip6_plen = htobe16(len);
+		ip6h->ip6_nxt = IPPROTO_UDP;
+		ip6h->ip6_hlim = 64;
+		memcpy(&ip6h->ip6_src, ((struct pkt_ip6*)pkt_l3)->daddr, 16);
+		memcpy(&ip6h->ip6_dst, ((struct pkt_ip6*)pkt_l3)->saddr, 16);
+		sum = _sinkhole_csum_add(0, (uint8_t*)&ip6h->ip6_src, 32);
+		memset(&sin6, 0, sizeof(sin6));
+		sin6.sin6_family = AF_INET6;
+		memcpy(&sin6.sin6_addr, &ip6h->ip6_dst, 16);
+		sa = (struct sockaddr*)&sin6;
+		sa_len = sizeof(sin6);
+	}
+	sum += IPPROTO_UDP + len;
+	sum = _sinkhole_csum_fold(_sinkhole_csum_add(sum, buf + hlen, len));
+	/* 0 means no checksum */
+	udph->check = sum ? htobe16(sum) : 0xffff;
+	
+	s = _sinkhole_sock_get(af);
+	if (s < 0)
+		return -1;
+	if (sendto(s, buf, hlen + len, 0, sa, sa_len) < 0) {
+		ERR_OUT("sinkhole: answer sending error: %s", strerror(errno));
+		return -1;
+	}
+	
+	return 0;
+}
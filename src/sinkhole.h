@@ -0,0 +1,25 @@
+#ifndef __SINKHOLE_H__
+#define __SINKHOLE_H__
+
+#include "pkt/pkt.h"
+#include "elist.h"
+
+
+/*
+ * Answer a dns query over udp, which is matched by an elist with
+ * a sinkhole action. An answer is NXDOMAIN or an address of the elist
+ * (if a query type is the address type; otherwise, an answer is empty)
+ * and it's sent with a raw socket of the current thread. A query
+ * itself must be dropped by a caller.
+ * pkt - a parsed packet
+ * elist - a matched elist
+ *
+ * return:
+ *   0 - an answer is sent
+ *   1 - a packet isn't a dns query over udp
+ *  -1 - an error occured
+ */
+int sinkhole_answer(struct pkt *pkt, struct elist *elist);
+
+
+#endif  /* __SINKHOLE_H__ */
@@ -0,0 +1,317 @@
+/*
+ * traffic filter
+ * Copyright (C) 2017, Oleg Nemanov <lego12239@yandex.ru>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <liburing.h>
+#include <libnetfilter_queue/libnetfilter_queue.h>
+#include "main.h"
+#include "log.h"
+#include "list.h"
+#include "verdict.h"
+#include "conf.h"
+#include "uring.h"
+
+
+#define URING_ENTRIES 256
+/* must be a power of 2 */
+#define URING_RBUFS_CNT 64
+#define URING_RBUF_SIZE 80000
+#define URING_RBUFS_GROUP 0
+#define URING_SBUFS_CNT 256
+#define URING_SBUF_SIZE 64
+
+#define URING_UD_RECV 1ULL
+#define URING_UD_SEND 2ULL
+#define URING_UD(type, idx) (((type) << 32) | (idx))
+#define URING_UD_TYPE(ud) ((ud) >> 32)
+#define URING_UD_IDX(ud) ((ud) & 0xffffffff)
+
+
+struct uring_ctx {
+	struct io_uring ring;
+	struct io_uring_buf_ring *rbr;
+	char *rbufs;
+	/* verdict messages buffers */
+	char *sbufs;
+	/* stack of free verdict messages buffers indexes */
+	unsigned int *sbufs_free;
+	unsigned int sbufs_free_cnt;
+	struct thread_data *td;
+	unsigned int n;
+};
+
+
+static struct io_uring_sqe*
+_uring_get_sqe(struct uring_ctx *ctx)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ctx->ring);
+	if (sqe)
+		return sqe;
+	/* submission queue is full - submit it and try again */
+	io_uring_submit(&ctx->ring);
+	return io_uring_get_sqe(&ctx->ring);
+}
+
+static void
+_uring_recv_arm(struct uring_ctx *ctx, unsigned int i)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = _uring_get_sqe(ctx);
+	if (!sqe) {
+		ERR_OUT("thread %u: io_uring: can't get sqe for receiving",
+		  thread_idx);
+		exit(EXIT_FAILURE);
+	}
+	io_uring_prep_recv_multishot(sqe, nfq_fd(ctx->td[i].h), NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_RBUFS_GROUP;
+	io_uring_sqe_set_data64(sqe, URING_UD(URING_UD_RECV, i));
+}
+
+static void
+_uring_rbuf_recycle(struct uring_ctx *ctx, unsigned int bid)
+{
+	io_uring_buf_ring_add(ctx->rbr, ctx->rbufs + URING_RBUF_SIZE * bid,
+	  URING_RBUF_SIZE, bid, io_uring_buf_ring_mask(URING_RBUFS_CNT), 0);
+	io_uring_buf_ring_advance(ctx->rbr, 1);
+}
+
+/*
+ * Wait until all queued verdict message sends are completed. Completions
+ * are only counted, not reaped: a caller can be in the middle of
+ * the completion queue processing.
+ */
+static void
+_uring_sends_wait(struct uring_ctx *ctx)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, queued, done;
+	int ret;
+
+	queued = URING_SBUFS_CNT - ctx->sbufs_free_cnt;
+	for(;;) {
+		done = 0;
+		io_uring_for_each_cqe(&ctx->ring, head, cqe)
+			if (URING_UD_TYPE(io_uring_cqe_get_data64(cqe)) ==
+			  URING_UD_SEND)
+				done++;
+		if (done == queued)
+			return;
+		ret = io_uring_submit_and_wait(&ctx->ring,
+		  io_uring_cq_ready(&ctx->ring) + 1);
+		if ((ret < 0) && (ret != -EINTR)) {
+			ERR_OUT("io_uring_submit_and_wait() error: %s", strerror(-ret));
+			return;
+		}
+	}
+}
+
+/*
+ * Verdict sender for verdict_batch. Queue a verdict message send to
+ * the ring. If there is no free message buffer, send it synchronously
+ * after all queued sends are completed(a batch verdict mustn't overtake
+ * earlier verdicts).
+ */
+static int
+_uring_verdict_send(struct verdict_batch *vb, int is_batch, uint32_t id,
+  uint32_t verdict, uint32_t mark)
+{
+	struct uring_ctx *ctx = vb->send_data;
+	struct thread_data *td;
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+	char msg[URING_SBUF_SIZE], *buf;
+	int len, fd;
+
+	td = list_item(vb, struct thread_data, vb);
+	fd = nfq_fd(td->h);
+
+	if (ctx->sbufs_free_cnt)
+		sqe = _uring_get_sqe(ctx);
+	else
+		sqe = NULL;
+	if (!sqe) {
+		_uring_sends_wait(ctx);
+		len = verdict_msg_make(msg, sizeof(msg), vb->qnum, is_batch, id,
+		  verdict, mark);
+		if (send(fd, msg, len, 0) < 0) {
+			ERR_OUT("verdict send error: %s", strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+
+	idx = ctx->sbufs_free[--ctx->sbufs_free_cnt];
+	buf = ctx->sbufs + URING_SBUF_SIZE * idx;
+	len = verdict_msg_make(buf, URING_SBUF_SIZE, vb->qnum, is_batch, id,
+	  verdict, mark);
+	io_uring_prep_send(sqe, fd, buf, len, 0);
+	io_uring_sqe_set_data64(sqe, URING_UD(URING_UD_SEND, idx));
+
+	return 0;
+}
+
+static void
+_uring_init(struct uring_ctx *ctx, struct thread_data *td, unsigned int n)
+{
+	unsigned int i;
+	int ret;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->td = td;
+	ctx->n = n;
+
+	ret = io_uring_queue_init(URING_ENTRIES, &ctx->ring, 0);
+	if (ret < 0) {
+		ERR_OUT("thread %u: io_uring_queue_init() error: %s", thread_idx,
+		  strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+
+	ctx->rbufs = malloc(URING_RBUF_SIZE * URING_RBUFS_CNT);
+	ctx->sbufs = malloc(URING_SBUF_SIZE * URING_SBUFS_CNT);
+	ctx->sbufs_free = malloc(sizeof(*ctx->sbufs_free) * URING_SBUFS_CNT);
+	if ((!ctx->rbufs) || (!ctx->sbufs) || (!ctx->sbufs_free)) {
+		ERR_OUT("thread %u: io_uring buffers allocating error: no memory",
+		  thread_idx);
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < URING_SBUFS_CNT; i++)
+		ctx->sbufs_free[i] = i;
+	ctx->sbufs_free_cnt = URING_SBUFS_CNT;
+
+	ctx->rbr = io_uring_setup_buf_ring(&ctx->ring, URING_RBUFS_CNT,
+	  URING_RBUFS_GROUP, 0, &ret);
+	if (!ctx->rbr) {
+		ERR_OUT("thread %u: io_uring_setup_buf_ring() error: %s",
+		  thread_idx, strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < URING_RBUFS_CNT; i++)
+		io_uring_buf_ring_add(ctx->rbr, ctx->rbufs + URING_RBUF_SIZE * i,
+		  URING_RBUF_SIZE, i, io_uring_buf_ring_mask(URING_RBUFS_CNT), i);
+	io_uring_buf_ring_advance(ctx->rbr, URING_RBUFS_CNT);
+
+	for(i = 0; i < n; i++) {
+		td[i].vb.send = _uring_verdict_send;
+		td[i].vb.send_data = ctx;
+		_uring_recv_arm(ctx, i);
+	}
+}
+
+static void
+_uring_deinit(struct uring_ctx *ctx)
+{
+	unsigned int i;
+
+	for(i = 0; i < ctx->n; i++) {
+		ctx->td[i].vb.send = NULL;
+		ctx->td[i].vb.send_data = NULL;
+	}
+	io_uring_free_buf_ring(&ctx->ring, ctx->rbr, URING_RBUFS_CNT,
+	  URING_RBUFS_GROUP);
+	io_uring_queue_exit(&ctx->ring);
+	free(ctx->sbufs_free);
+	free(ctx->sbufs);
+	free(ctx->rbufs);
+}
+
+/*
+ * Service n queues(starting from td) with one io_uring instance.
+ * Netlink messages are received with multishot receives into a provided
+ * buffers ring; verdicts are sent through the same ring.
+ * Return only on error.
+ * td - an array of n thread data with initialized nfq handles
+ * n - a number of queues
+ */
+void
+uring_loop(struct thread_data *td, unsigned int n)
+{
+	struct uring_ctx ctx;
+	struct io_uring_cqe *cqe;
+	struct __kernel_timespec ts;
+	uint64_t ud;
+	unsigned int i, bid;
+	int ret;
+
+	_uring_init(&ctx, td, n);
+
+	for(;;) {
+		/* expired reassembled flows are deleted without incoming
+		 * packets */
+		ts.tv_sec = SWEEP_INTERVAL;
+		ts.tv_nsec = 0;
+		conf_offline();
+		ret = io_uring_submit_and_wait_timeout(&ctx.ring, &cqe, 1, &ts, NULL);
+		conf_online();
+		if ((ret < 0) && (ret != -EINTR) && (ret != -ETIME)) {
+			ERR_OUT("io_uring_submit_and_wait_timeout() error: %s",
+			  strerror(-ret));
+			break;
+		}
+		while (io_uring_peek_cqe(&ctx.ring, &cqe) == 0) {
+			ud = io_uring_cqe_get_data64(cqe);
+			i = URING_UD_IDX(ud);
+			if (URING_UD_TYPE(ud) == URING_UD_SEND) {
+				if (cqe->res < 0)
+					ERR_OUT("verdict send error: %s", strerror(-cqe->res));
+				ctx.sbufs_free[ctx.sbufs_free_cnt++] = i;
+				io_uring_cqe_seen(&ctx.ring, cqe);
+				continue;
+			}
+
+			if (cqe->res > 0) {
+				bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				nfq_handle_packet(td[i].h, ctx.rbufs + URING_RBUF_SIZE * bid,
+				  cqe->res);
+				_uring_rbuf_recycle(&ctx, bid);
+				verdict_flush_expired(&td[i].vb);
+			} else if ((cqe->res < 0) && (cqe->res != -ENOBUFS)) {
+				ERR_OUT("thread %u: queue %u: io_uring recv error: %s",
+				  thread_idx, td[i].nfq_num, strerror(-cqe->res));
+				if (cqe->flags & IORING_CQE_F_BUFFER)
+					_uring_rbuf_recycle(&ctx,
+					  cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+				io_uring_cqe_seen(&ctx.ring, cqe);
+				goto out;
+			}
+			/* multishot receive is terminated(e.g. no free buffers) -
+			 * rearm it */
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				_uring_recv_arm(&ctx, i);
+			io_uring_cqe_seen(&ctx.ring, cqe);
+		}
+		/* held packets of a thread are from one queue(see main()) */
+		verdict_sweep(&td[0].vb);
+		/* the completion queue is drained - flush verdict batches */
+		for(i = 0; i < n; i++)
+			verdict_flush(&td[i].vb);
+	}
+
+out:
+	/* a config isn't used until the thread is unregistered */
+	conf_offline();
+	_uring_deinit(&ctx);
+}
@@ -0,0 +1,18 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "main.h"
+
+
+/*
+ * Service n queues(starting from td) with one io_uring instance.
+ * Netlink messages are received with multishot receives into a provided
+ * buffers ring; verdicts are sent through the same ring.
+ * Return only on error.
+ * td - an array of n thread data with initialized nfq handles
+ * n - a number of queues
+ */
+void uring_loop(struct thread_data *td, unsigned int n);
+
+
+#endif  /* __URING_H__ */
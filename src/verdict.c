@@ -0,0 +1,269 @@
+/*
+ * traffic filter
+ * Copyright (C) 2017, Oleg Nemanov <lego12239@yandex.ru>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_queue.h>
+#include <libnetfilter_queue/libnetfilter_queue.h>
+#include "main.h"
+#include "log.h"
+#include "verdict.h"
+
+
+extern struct global_opts opts;
+
+
+void
+verdict_batch_init(struct verdict_batch *vb, struct nfq_q_handle *qh,
+  uint16_t qnum)
+{
+	memset(vb, 0, sizeof(*vb));
+	vb->qh = qh;
+	vb->qnum = qnum;
+}
+
+static int
+_verdict_send(struct verdict_batch *vb, int is_batch, uint32_t id,
+  uint32_t verdict, uint32_t mark)
+{
+	int ret;
+	
+	if (vb->send)
+		return vb->send(vb, is_batch, id, verdict, mark);
+	
+	if (is_batch) {
+		ret = nfq_set_verdict_batch2(vb->qh, id, verdict, mark);
+		if (ret < 0)
+			ERR_OUT("nfq_set_verdict_batch2() error");
+	} else {
+		ret = nfq_set_verdict2(vb->qh, id, verdict, mark, 0, NULL);
+		if (ret < 0)
+			ERR_OUT("nfq_set_verdict() error");
+	}
+	
+	return ret;
+}
+
+/*
+ * Set a verdict for a packet. If batching is on, the verdict can be
+ * delayed until the batch is flushed.
+ * vb - a batch of the packet queue
+ * id - a packet id
+ * verdict - a verdict(NF_ACCEPT, NF_DROP, ...)
+ * mark - a mark to set on a packet
+ *
+ * return:
+ *   0 - everything is ok
+ *  <0 - a verdict sending error
+ */
+int
+verdict_set(struct verdict_batch *vb, uint32_t id, uint32_t verdict,
+  uint32_t mark)
+{
+	int ret;
+
+	if (opts.vbatch_size <= 1)
+		return _verdict_send(vb, 0, id, verdict, mark);
+
+	if ((vb->cnt) && ((vb->verdict != verdict) || (vb->mark != mark))) {
+		ret = verdict_flush(vb);
+		if (ret < 0)
+			return ret;
+	}
+	if (!vb->cnt) {
+		vb->verdict = verdict;
+		vb->mark = mark;
+		if (opts.vbatch_latency)
+			clock_gettime(CLOCK_MONOTONIC_COARSE, &vb->ts);
+	}
+	vb->id = id;
+	vb->cnt++;
+	if (vb->cnt >= opts.vbatch_size)
+		return verdict_flush(vb);
+	
+	return 0;
+}
+
+/*
+ * Set a verdict for a packet and its held packets, accept released
+ * packets. A packet with VERDICT_HOLD verdict is left in a queue.
+ * vb - a batch of the packet queue
+ * vh - held and released packets
+ * id - a packet id
+ * verdict - a verdict
+ * mark - a mark to set on a packet
+ *
+ * return:
+ *   0 - everything is ok
+ *  <0 - a verdict sending error
+ */
+int
+verdict_held_set(struct verdict_batch *vb, struct verdict_held *vh,
+  uint32_t id, uint32_t verdict, uint32_t mark)
+{
+	unsigned int i;
+	int ret;
+	
+	for(i = 0; i < vh->released_cnt; i++) {
+		DBG_OUT("%u: VERDICT - ACCEPT(released)", vh->released[i]);
+		ret = verdict_set(vb, vh->released[i], NF_ACCEPT, 0);
+		if (ret < 0)
+			return ret;
+	}
+	for(i = 0; i < vh->held_cnt; i++) {
+		ret = verdict_set(vb, vh->held[i], verdict, mark);
+		if (ret < 0)
+			return ret;
+	}
+	if (verdict == VERDICT_HOLD)
+		return 0;
+	
+	return verdict_set(vb, id, verdict, mark);
+}
+
+/*
+ * Send a verdict for all packets in the batch.
+ *
+ * return:
+ *   0 - everything is ok
+ *  <0 - a verdict sending error
+ */
+int
+verdict_flush(struct verdict_batch *vb)
+{
+	if (!vb->cnt)
+		return 0;
+	DBG_OUT("%u: VERDICT BATCH - %u packets", vb->id, vb->cnt);
+	vb->cnt = 0;
+
+	return _verdict_send(vb, 1, vb->id, vb->verdict, vb->mark);
+}
+
+/*
+ * Flush the batch, if its first packet waits longer than a flush latency.
+ *
+ * return:
+ *   0 - everything is ok
+ *  <0 - a verdict sending error
+ */
+int
+verdict_flush_expired(struct verdict_batch *vb)
+{
+	struct timespec now;
+	long usec;
+
+	if ((!vb->cnt) || (!opts.vbatch_latency))
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	usec = (now.tv_sec - vb->ts.tv_sec) * 1000000 +
+	  (now.tv_nsec - vb->ts.tv_nsec) / 1000;
+	if (usec < opts.vbatch_latency)
+		return 0;
+
+	return verdict_flush(vb);
+}
+
+/*
+ * Accept held packets of expired reassembled flows and fragmented
+ * datagrams of the current thread.
+ * vb - a batch of the thread queue
+ *
+ * return:
+ *   0 - everything is ok
+ *  <0 - a verdict sending error
+ */
+int
+verdict_sweep(struct verdict_batch *vb)
+{
+	struct verdict_held vh;
+	int is_more, ret;
+
+	do {
+		is_more = pkt_sweep(&vh);
+		/* no packet is classified, only released ones are accepted */
+		ret = verdict_held_set(vb, &vh, 0, VERDICT_HOLD, 0);
+		if (ret < 0)
+			return ret;
+	} while (is_more);
+
+	return 0;
+}
+
+/*
+ * Make a netlink verdict message for a queue qnum. It's the same message
+ * as nfq_set_verdict2()/nfq_set_verdict_batch2() make.
+ * buf - a buffer to place a message to
+ * size - a buffer size
+ * qnum - a queue number
+ * is_batch - make NFQNL_MSG_VERDICT_BATCH message instead of
+ *            NFQNL_MSG_VERDICT
+ * id - a packet id
+ * verdict - a verdict
+ * mark - a mark
+ *
+ * return:
+ *   >0 - a message length
+ *   -1 - a buffer is too small
+ */
+int
+verdict_msg_make(char *buf, unsigned int size, uint16_t qnum, int is_batch,
+  uint32_t id, uint32_t verdict, uint32_t mark)
+{
+	struct nlmsghdr *nlh;
+	struct nfgenmsg *nfg;
+	struct nlattr *nla;
+	struct nfqnl_msg_verdict_hdr *vh;
+	unsigned int len;
+	
+	len = NLMSG_SPACE(sizeof(*nfg)) + NLA_ALIGN(NLA_HDRLEN + sizeof(*vh)) +
+	  NLA_ALIGN(NLA_HDRLEN + sizeof(uint32_t));
+	if (size < len)
+		return -1;
+	memset(buf, 0, len);
+	
+	nlh = (struct nlmsghdr*)buf;
+	nlh->nlmsg_len = len;
+	nlh->nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) |
+	  (is_batch ? NFQNL_MSG_VERDICT_BATCH : NFQNL_MSG_VERDICT);
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+	
+	nfg = NLMSG_DATA(nlh);
+	nfg->nfgen_family = AF_UNSPEC;
+	nfg->version = NFNETLINK_V0;
+	nfg->res_id = htons(qnum);
+	
+	nla = (struct nlattr*)(buf + NLMSG_SPACE(sizeof(*nfg)));
+	nla->nla_len = NLA_HDRLEN + sizeof(*vh);
+	nla->nla_type = NFQA_VERDICT_HDR;
+	vh = (struct nfqnl_msg_verdict_hdr*)((char*)nla + NLA_HDRLEN);
+	vh->verdict = htonl(verdict);
+	vh->id = htonl(id);
+	
+	nla = (struct nlattr*)((char*)nla + NLA_ALIGN(nla->nla_len));
+	nla->nla_len = NLA_HDRLEN + sizeof(uint32_t);
+	nla->nla_type = NFQA_MARK;
+	*(uint32_t*)((char*)nla + NLA_HDRLEN) = htonl(mark);
+	
+	return len;
+}
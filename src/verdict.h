@@ -0,0 +1,123 @@
+#ifndef __VERDICT_H__
+#define __VERDICT_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <libnetfilter_queue/libnetfilter_queue.h>
+#include <linux/netfilter.h>
+#include "pkt/reasm.h"
+#include "pkt/ipfrag.h"
+
+
+/* a packet is held until a verdict of its reassembled flow is known */
+#define VERDICT_HOLD NF_STOLEN
+
+
+/*
+ * A batch of consecutive packets of one queue with the same verdict and
+ * mark. It is sent with one nfq_set_verdict_batch2() call(which sets a
+ * verdict for all queued packets with id <= batch id).
+ */
+struct verdict_batch {
+	struct nfq_q_handle *qh;
+	uint16_t qnum;
+	/* A verdict sender. If it's NULL, nfq_set_verdict*() is used. */
+	int (*send)(struct verdict_batch *vb, int is_batch, uint32_t id,
+	  uint32_t verdict, uint32_t mark);
+	void *send_data;
+	uint32_t id;
+	uint32_t verdict;
+	uint32_t mark;
+	unsigned int cnt;
+	/* time of the first packet adding to the batch */
+	struct timespec ts;
+};
+
+/*
+ * Packets, which verdicts are set along with a classified packet one.
+ */
+struct verdict_held {
+	/* held packets, which get a verdict of a classified packet */
+	uint32_t held[REASM_HELD_MAX + IPFRAG_HELD_MAX];
+	unsigned int held_cnt;
+	/* held packets of expired flows, which must be accepted */
+	uint32_t released[REASM_RELEASED_MAX + IPFRAG_RELEASED_MAX];
+	unsigned int released_cnt;
+};
+
+
+void verdict_batch_init(struct verdict_batch *vb, struct nfq_q_handle *qh, uint16_t qnum);
+/*
+ * Set a verdict for a packet. If batching is on, the verdict can be
+ * delayed until the batch is flushed.
+ * vb - a batch of the packet queue
+ * id - a packet id
+ * verdict - a verdict(NF_ACCEPT, NF_DROP, ...)
+ * mark - a mark to set on a packet
+ *
+ * return:
+ *   0 - everything is ok
+ *  <0 - a verdict sending error
+ */
+int verdict_set(struct verdict_batch *vb, uint32_t id, uint32_t verdict, uint32_t mark);
+/*
+ * Set a verdict for a packet and its held packets, accept released
+ * packets. A packet with VERDICT_HOLD verdict is left in a queue.
+ * vb - a batch of the packet queue
+ * vh - held and released packets
+ * id - a packet id
+ * verdict - a verdict
+ * mark - a mark to set on a packet
+ *
+ * return:
+ *   0 - everything is ok
+ *  <0 - a verdict sending error
+ */
+int verdict_held_set(struct verdict_batch *vb, struct verdict_held *vh, uint32_t id, uint32_t verdict, uint32_t mark);
+/*
+ * Send a verdict for all packets in the batch.
+ *
+ * return:
+ *   0 - everything is ok
+ *  <0 - a verdict sending error
+ */
+int verdict_flush(struct verdict_batch *vb);
+/*
+ * Flush the batch, if its first packet waits longer than a flush latency.
+ *
+ * return:
+ *   0 - everything is ok
+ *  <0 - a verdict sending error
+ */
+int verdict_flush_expired(struct verdict_batch *vb);
+/*
+ * Accept held packets of expired reassembled flows and fragmented
+ * datagrams of the current thread.
+ * vb - a batch of the thread queue
+ *
+ * return:
+ *   0 - everything is ok
+ *  <0 - a verdict sending error
+ */
+int verdict_sweep(struct verdict_batch *vb);
+
+/*
+ * Make a netlink verdict message for a queue qnum. It's the same message
+ * as nfq_set_verdict2()/nfq_set_verdict_batch2() make.
+ * buf - a buffer to place a message to
+ * size - a buffer size
+ * qnum - a queue number
+ * is_batch - make NFQNL_MSG_VERDICT_BATCH message instead of
+ *            NFQNL_MSG_VERDICT
+ * id - a packet id
+ * verdict - a verdict
+ * mark - a mark
+ *
+ * return:
+ *   >0 - a message length
+ *   -1 - a buffer is too small
+ */
+int verdict_msg_make(char *buf, unsigned int size, uint16_t qnum, int is_batch, uint32_t id, uint32_t verdict, uint32_t mark);
+
+
+#endif  /* __VERDICT_H__ */